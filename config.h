@@ -0,0 +1,4 @@
+#undef CONFIG_DEBUG
+#undef CONFIG_KLIBC
+#define CONFIG_THREADS
+#define CONFIG_X86EMU
@@ -73,6 +73,15 @@ OTHER DEALINGS IN THE SOFTWARE.
 #define REAL_MEM_SIZE 	0x40000
 #define REAL_MEM_BLOCKS 	0x100
 
+/*
+ The first REAL_TASK_SIZE bytes of the region are a bump arena for
+ task buffers (LRMI_alloc_task), which are all released at once by
+ LRMI_reset_task().  The rest is managed by the block list
+ (LRMI_alloc_real/LRMI_free_real).
+*/
+#define REAL_TASK_SIZE 	0x10000
+#define REAL_BLOCK_BASE 	((char *)REAL_MEM_BASE + REAL_TASK_SIZE)
+
 struct mem_block {
 	unsigned int size : 20;
 	unsigned int free : 1;
@@ -82,6 +91,7 @@ static struct {
 	int ready;
 	int count;
 	struct mem_block blocks[REAL_MEM_BLOCKS];
+	char *task_top;		/* first free byte of the task arena */
 } mem_info = { 0 };
 
 static int
@@ -145,8 +155,9 @@ real_mem_init(void)
 
 	mem_info.ready = 1;
 	mem_info.count = 1;
-	mem_info.blocks[0].size = REAL_MEM_SIZE;
+	mem_info.blocks[0].size = REAL_MEM_SIZE - REAL_TASK_SIZE;
 	mem_info.blocks[0].free = 1;
+	mem_info.task_top = (char *)REAL_MEM_BASE;
 
 	return 1;
 }
@@ -187,7 +198,7 @@ void *
 LRMI_alloc_real(int size)
 {
 	int i;
-	char *r = (char *)REAL_MEM_BASE;
+	char *r = REAL_BLOCK_BASE;
 
 	if (!mem_info.ready)
 		return NULL;
@@ -219,7 +230,7 @@ void
 LRMI_free_real(void *m)
 {
 	int i;
-	char *r = (char *)REAL_MEM_BASE;
+	char *r = REAL_BLOCK_BASE;
 
 	if (!mem_info.ready)
 		return;
@@ -246,6 +257,33 @@ LRMI_free_real(void *m)
 }
 
 
+void *
+LRMI_alloc_task(int size)
+{
+	char *r;
+
+	if (!mem_info.ready)
+		return NULL;
+
+	size = (size + 15) & ~15;
+
+	if (size > REAL_BLOCK_BASE - mem_info.task_top)
+		return NULL;
+
+	r = mem_info.task_top;
+	mem_info.task_top += size;
+
+	return (void *)r;
+}
+
+
+void
+LRMI_reset_task(void)
+{
+	mem_info.task_top = (char *)REAL_MEM_BASE;
+}
+
+
 #if defined(__linux__)
 #define DEFAULT_VM86_FLAGS 	(IF_MASK | IOPL_MASK)
 #elif defined(__NetBSD__) || defined(__FreeBSD__) || defined(__OpenBSD__)
@@ -288,6 +326,19 @@ static struct {
 } context = { 0 };
 
 
+/*
+ Kernel transitions made by vm86 code, see LRMI_get_stats()
+*/
+static struct LRMI_stats vm86_stats;
+
+
+void
+LRMI_get_stats(struct LRMI_stats *s)
+{
+	*s = vm86_stats;
+}
+
+
 static inline void
 set_bit(unsigned int bit, void *array)
 {
@@ -821,29 +872,46 @@ debug_info(int vret)
 
 
 #if defined(__linux__)
+/*
+ Run vm86 code until it returns to RETURN_TO_32_INT.
+
+ The signals stay blocked and %fs/%gs are saved for the whole call
+ instead of around every vm86() entry.  %fs/%gs still have to be
+ reloaded after each exit, as the kernel leaves the vm86 values in them,
+ but that doesn't take a system call.  I/O instructions following an
+ emulated one are emulated right away, without entering vm86 mode
+ just to have them trap again.
+*/
 static int
 run_vm86(void)
 {
 	unsigned int vret;
 	sigset_t all_sigs, old_sigs;
 	unsigned long old_gs, old_fs;
+	int ret = 0;
+#ifdef LRMI_DEBUG
+	struct LRMI_stats start = vm86_stats;
+#endif
+
+	// FIXME: may apply this to BSD equivalents?
+	sigfillset(&all_sigs);
+	sigprocmask(SIG_SETMASK, &all_sigs, &old_sigs);
+	asm volatile ("mov %%gs, %0" : "=rm" (old_gs));
+	asm volatile ("mov %%fs, %0" : "=rm" (old_fs));
 
 	while (1) {
-		// FIXME: may apply this to BSD equivalents?
-		sigfillset(&all_sigs);
-		sigprocmask(SIG_SETMASK, &all_sigs, &old_sigs);
-		asm volatile ("mov %%gs, %0" : "=rm" (old_gs));
-		asm volatile ("mov %%fs, %0" : "=rm" (old_fs));
+		vm86_stats.entries++;
 		vret = lrmi_vm86(&context.vm);
 		asm volatile ("mov %0, %%gs" :: "rm" (old_gs));
 		asm volatile ("mov %0, %%fs" :: "rm" (old_fs));
-		sigprocmask(SIG_SETMASK, &old_sigs, NULL);
 
 		if (VM86_TYPE(vret) == VM86_INTx) {
 			unsigned int v = VM86_ARG(vret);
 
-			if (v == RETURN_TO_32_INT)
-				return 1;
+			if (v == RETURN_TO_32_INT) {
+				ret = 1;
+				break;
+			}
 
 			pushw(CONTEXT_REGS.REG(eflags));
 			pushw(CONTEXT_REGS.REG(cs));
@@ -853,19 +921,30 @@ run_vm86(void)
 			CONTEXT_REGS.REG(eip) = get_int_off(v);
 			CONTEXT_REGS.REG(eflags) &= ~(VIF_MASK | TF_MASK);
 
+			vm86_stats.intx++;
 			continue;
 		}
 
-		if (VM86_TYPE(vret) != VM86_UNKNOWN)
+		if (VM86_TYPE(vret) != VM86_UNKNOWN || !emulate())
 			break;
 
-		if (!emulate())
-			break;
+		do
+			vm86_stats.io++;
+		while (emulate());
 	}
 
-	debug_info(vret);
+	sigprocmask(SIG_SETMASK, &old_sigs, NULL);
+
+#ifdef LRMI_DEBUG
+	fprintf(stderr, "run_vm86: %u kernel entries, %u ints reflected, "
+	 "%u I/O instructions emulated\n", vm86_stats.entries - start.entries,
+	 vm86_stats.intx - start.intx, vm86_stats.io - start.io);
+#endif
+
+	if (!ret)
+		debug_info(vret);
 
-	return 0;
+	return ret;
 }
 #elif defined(__NetBSD__) || defined(__FreeBSD__) || defined(__OpenBSD__)
 #if defined(__NetBSD__) || defined(__OpenBSD__)
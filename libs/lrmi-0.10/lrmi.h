@@ -101,6 +101,37 @@ LRMI_alloc_real(int size);
 void
 LRMI_free_real(void *m);
 
+/*
+ Allocate short-lived real mode memory
+ The returned block is paragraph (16 byte) aligned and stays valid
+ until the next call to LRMI_reset_task()
+*/
+#define LRMI_alloc_task LRMI_MAKENAME(alloc_task)
+void *
+LRMI_alloc_task(int size);
+
+/*
+ Release all blocks allocated with LRMI_alloc_task()
+*/
+#define LRMI_reset_task LRMI_MAKENAME(reset_task)
+void
+LRMI_reset_task(void);
+
+/*
+ Kernel transitions made by vm86 code so far (Linux only).  I/O
+ instructions only exit to LRMI if the port is not enabled in the
+ I/O permission bitmap (see ioperm(2)).
+*/
+struct LRMI_stats {
+	unsigned int entries;	/* vm86() calls, each ends with an exit */
+	unsigned int intx;	/* interrupts reflected into vm86 mode */
+	unsigned int io;	/* I/O instructions emulated */
+};
+
+#define LRMI_get_stats LRMI_MAKENAME(get_stats)
+void
+LRMI_get_stats(struct LRMI_stats *s);
+
 #else /* (__linux__ || __NetBSD__ || __FreeBSD__) && __i386__ */
 #warning "LRMI is not supported on your system!"
 #endif
@@ -0,0 +1,288 @@
+/****************************************************************************
+*
+*						Realmode X86 Emulator Library
+*
+*  ========================================================================
+*
+* Language:		ANSI C
+* Environment:	Linux
+*
+* Description:  Microbenchmarks for the emulator.  Small real mode
+*				kernels are assembled into the emulator memory and run in
+*				a loop.  For every category of instructions, we report the
+*				number of emulated instructions, the time per instruction
+*				and the number of instructions per second.
+*
+*				The output format is stable, one line per category:
+*
+*				<category> <instructions> <ns/insn> <Minsn/s>
+*
+****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "x86emu.h"
+
+/*-------------------------- Implementation -------------------------------*/
+
+#define MEM_SIZE        0x100000
+#define CODE_BASE       0x1000
+#define FAR_PROC        0x1800          /* RETF */
+#define INT_PROC        0x1810          /* IRET */
+#define NEAR_PROC       0x1820          /* RET */
+#define BENCH_INT       0x60
+#define DATA_BASE       0x3000
+#define STACK_TOP       0xf000
+
+/* Loop counters */
+#define CNT_CX          0               /* LOOP */
+#define CNT_DX          1               /* DEC DX; JNZ */
+
+typedef struct {
+    const char *name;
+    int counter;
+    int len;
+    u8 code[96];
+} bench_kernel;
+
+static bench_kernel kernels[] = {
+    {"alu", CNT_CX, 17, {
+        0x01, 0xd8,                     /* add ax,bx */
+        0x31, 0xc2,                     /* xor dx,ax */
+        0x21, 0xd6,                     /* and si,dx */
+        0x09, 0xf7,                     /* or di,si */
+        0x83, 0xd3, 0x01,               /* adc bx,1 */
+        0xd1, 0xe0,                     /* shl ax,1 */
+        0x45,                           /* inc bp */
+        0x39, 0xd0,                     /* cmp ax,dx */
+        0x90,                           /* nop */
+    }},
+    {"modrm", CNT_CX, 18, {
+        0x8b, 0x00,                     /* mov ax,[bx+si] */
+        0x89, 0x41, 0x04,               /* mov [bx+di+4],ax */
+        0x03, 0x46, 0x06,               /* add ax,[bp+6] */
+        0x01, 0x06, 0x00, 0x30,         /* add [0x3000],ax */
+        0x8b, 0x94, 0x34, 0x12,         /* mov dx,[si+0x1234] */
+        0xfe, 0x07,                     /* inc byte [bx] */
+    }},
+    {"string", CNT_CX, 11, {
+        0xbe, 0x00, 0x30,               /* mov si,0x3000 */
+        0xbf, 0x00, 0x50,               /* mov di,0x5000 */
+        0xac,                           /* lodsb */
+        0xaa,                           /* stosb */
+        0xa5,                           /* movsw */
+        0xa6,                           /* cmpsb */
+        0xaf,                           /* scasw */
+    }},
+    {"string_rep", CNT_DX, 18, {
+        0xbe, 0x00, 0x30,               /* mov si,0x3000 */
+        0xbf, 0x00, 0x50,               /* mov di,0x5000 */
+        0xb9, 0x40, 0x00,               /* mov cx,64 */
+        0xf3, 0xa4,                     /* rep movsb */
+        0xb9, 0x40, 0x00,               /* mov cx,64 */
+        0xf3, 0xab,                     /* rep stosw */
+        0x90,                           /* nop */
+        0x90,                           /* nop */
+    }},
+    {"call_int", CNT_CX, 10, {
+        0x9a, FAR_PROC & 0xff, FAR_PROC >> 8, 0x00, 0x00,
+                                        /* call 0000:FAR_PROC */
+        0xcd, BENCH_INT,                /* int BENCH_INT */
+        0xe8, 0x00, 0x00,               /* call NEAR_PROC (patched) */
+    }},
+    {"prefix32", CNT_CX, 22, {
+        0x66, 0x01, 0xd8,               /* add eax,ebx */
+        0x66, 0xc1, 0xe0, 0x03,         /* shl eax,3 */
+        0x66, 0x0f, 0xaf, 0xc3,         /* imul eax,ebx */
+        0x66, 0x8b, 0x07,               /* mov eax,[bx] */
+        0x67, 0x8b, 0x03,               /* mov ax,[ebx] */
+        0x26, 0x8b, 0x07,               /* mov ax,es:[bx] */
+        0x66, 0x40,                     /* inc eax */
+    }},
+    {"pio", CNT_CX, 8, {
+        0xee,                           /* out dx,al */
+        0xec,                           /* in al,dx */
+        0xe6, 0x80,                     /* out 0x80,al */
+        0xed,                           /* in ax,dx */
+        0xef,                           /* out dx,ax */
+        0xe4, 0x61,                     /* in al,0x61 */
+    }},
+};
+
+static u8 *mem;
+
+void
+printk(const char *fmt, ...)
+{
+}
+
+static u8 X86API pio_inb(X86EMU_pioAddr addr) { return 0xff; }
+static u16 X86API pio_inw(X86EMU_pioAddr addr) { return 0xffff; }
+static u32 X86API pio_inl(X86EMU_pioAddr addr) { return ~0; }
+static void X86API pio_outb(X86EMU_pioAddr addr, u8 val) { }
+static void X86API pio_outw(X86EMU_pioAddr addr, u16 val) { }
+static void X86API pio_outl(X86EMU_pioAddr addr, u32 val) { }
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/****************************************************************************
+REMARKS:
+Assembles the kernel at CODE_BASE, followed by the loop instruction and
+a HLT, and sets up the registers for a run of 'iters' iterations.
+****************************************************************************/
+static void
+bench_setup(bench_kernel * k, u16 iters)
+{
+    u8 *p = mem + CODE_BASE;
+    int i;
+
+    memset(mem, 0, MEM_SIZE);
+    memcpy(p, k->code, k->len);
+
+    /* Patch the near call target, see the call_int kernel. */
+    for (i = 0; i + 2 < k->len; i++) {
+        if (p[i] == 0xe8 && p[i + 1] == 0 && p[i + 2] == 0) {
+            u16 rel = NEAR_PROC - (CODE_BASE + i + 3);
+
+            p[i + 1] = rel & 0xff;
+            p[i + 2] = rel >> 8;
+        }
+    }
+    p += k->len;
+
+    if (k->counter == CNT_CX) {
+        *p++ = 0xe2;                    /* loop */
+        *p++ = -(k->len + 2);
+    }
+    else {
+        *p++ = 0x4a;                    /* dec dx */
+        *p++ = 0x75;                    /* jnz */
+        *p++ = -(k->len + 3);
+    }
+    *p = 0xf4;                          /* hlt */
+
+    mem[FAR_PROC] = 0xcb;               /* retf */
+    mem[INT_PROC] = 0xcf;               /* iret */
+    mem[NEAR_PROC] = 0xc3;              /* ret */
+    mem[BENCH_INT * 4] = INT_PROC & 0xff;
+    mem[BENCH_INT * 4 + 1] = INT_PROC >> 8;
+
+    memset(&M.x86, 0, sizeof(M.x86));
+    M.x86.R_CS = 0;
+    M.x86.R_IP = CODE_BASE;
+    M.x86.R_SS = 0;
+    M.x86.R_SP = STACK_TOP;
+    M.x86.R_BX = DATA_BASE;
+    M.x86.R_SI = 0x10;
+    M.x86.R_DI = 0x20;
+    M.x86.R_BP = 0x4000;
+    M.x86.R_DX = 0x3c4;
+    M.x86.R_FLG = F_ALWAYS_ON | F_IF;
+
+    if (k->counter == CNT_CX)
+        M.x86.R_CX = iters;
+    else
+        M.x86.R_DX = iters;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: bench [-r runs] [-n iterations] [category...]\n");
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    X86EMU_pioFuncs pioFuncs = {
+        .inb = pio_inb,
+        .inw = pio_inw,
+        .inl = pio_inl,
+        .outb = pio_outb,
+        .outw = pio_outw,
+        .outl = pio_outl,
+    };
+    int runs = 10, iters = 50000;
+    unsigned int i, j;
+    int c;
+
+    while ((c = getopt(argc, argv, "r:n:")) != -1) {
+        switch (c) {
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 'n':
+            iters = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (runs < 1 || iters < 1 || iters > 0xffff)
+        usage();
+
+    mem = malloc(MEM_SIZE);
+    if (!mem) {
+        fprintf(stderr, "Failed to allocate the emulator memory.\n");
+        return 1;
+    }
+
+    M.mem_base = (unsigned long) mem;
+    M.mem_size = MEM_SIZE;
+    X86EMU_setupPioFuncs(&pioFuncs);
+
+    printf("# x86emu benchmark: %d runs x %d iterations (best run)\n",
+           runs, iters);
+    printf("# %-12s %12s %10s %10s\n", "category", "insns", "ns/insn",
+           "Minsn/s");
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        bench_kernel *k = &kernels[i];
+        double best = 0, t;
+        u64 insns = 0;
+
+        if (optind < argc) {
+            for (j = optind; j < argc; j++)
+                if (!strcmp(argv[j], k->name))
+                    break;
+            if (j == argc)
+                continue;
+        }
+
+        for (c = 0; c < runs; c++) {
+            bench_setup(k, iters);
+            t = now_ns();
+            X86EMU_exec();
+            t = now_ns() - t;
+
+            if (!(M.x86.intr & INTR_HALTED) || M.x86.R_IP != CODE_BASE +
+                k->len + (k->counter == CNT_CX ? 2 : 3) + 1) {
+                fprintf(stderr, "%s: kernel did not finish at the HLT "
+                        "(%04x:%04x)\n", k->name, M.x86.R_CS, M.x86.R_IP);
+                return 1;
+            }
+
+            if (!c || t < best)
+                best = t;
+            insns = M.x86.icount;
+        }
+
+        printf("%-14s %12llu %10.2f %10.2f\n", k->name,
+               (unsigned long long) insns, best / insns, insns * 1e3 / best);
+    }
+
+    free(mem);
+    return 0;
+}
@@ -84,22 +84,77 @@ x86emu_intr_raise(u8 intrnum)
     M.x86.intr |= INTR_SYNCH;
 }
 
+/****************************************************************************
+PARAMETERS:
+op1	- Opcode byte
+
+RETURNS:
+Non-zero if op1 is a prefix, which is decoded by a handler of its own but
+belongs to the instruction that follows it.
+****************************************************************************/
+static int
+x86emu_is_prefix(u8 op1)
+{
+    switch (op1) {
+    case 0x26:
+    case 0x2e:
+    case 0x36:
+    case 0x3e:
+    case 0x64:
+    case 0x65:
+    case 0x66:
+    case 0x67:
+    case 0xf0:
+    case 0xf2:
+    case 0xf3:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
 /****************************************************************************
+REMARKS:
+Drops the prefixes left over from an instruction whose execution was cut
+short, so that they don't apply to the first instruction of the next call.
+****************************************************************************/
+static void
+x86emu_clear_prefixes(void)
+{
+    DECODE_CLEAR_SEGOVR();
+    M.x86.mode &= ~(SYSMODE_PREFIX_REPE | SYSMODE_PREFIX_REPNE);
+}
+
+/****************************************************************************
+PARAMETERS:
+max_insns	- Maximum number of instructions to execute, 0 for no limit
+
+RETURNS:
+X86EMU_EXEC_HALTED if the system halted, X86EMU_EXEC_LIMIT if the
+instruction limit was reached first.
+
 REMARKS:
 Main execution loop for the emulator. We return from here when the system
 halts, which is normally caused by a stack fault when we return from the
-original real mode call.
+original real mode call, or when max_insns instructions have been executed.
+In the latter case the complete machine state is preserved in M and
+execution can be continued with X86EMU_resume.  Prefixes are counted as
+part of the instruction they precede, and the limit is only checked
+between instructions, never right after a prefix.
 ****************************************************************************/
-void
-X86EMU_exec(void)
+static int
+x86emu_run(u32 max_insns)
 {
     u8 op1;
+    int limited = (max_insns != 0);
+    int prefix = 0;
 
-    M.x86.intr = 0;
     DB(x86emu_end_instr();
         )
 
         for (;;) {
+        if (limited && !prefix && !max_insns--)
+            return X86EMU_EXEC_LIMIT;
         DB(if (CHECK_IP_FETCH())
            x86emu_check_ip_access();)
             /* If debugging, save the IP and CS values. */
@@ -113,7 +168,7 @@ X86EMU_exec(void)
                    if (M.x86.debug)
                    printk("Service completed successfully\n");}
                 )
-                    return;
+                    return X86EMU_EXEC_HALTED;
             }
             if (((M.x86.intr & INTR_SYNCH) &&
                  (M.x86.intno == 0 || M.x86.intno == 2)) ||
@@ -123,13 +178,134 @@ X86EMU_exec(void)
         }
         op1 = (*sys_rdb) (((u32) M.x86.R_CS << 4) + (M.x86.R_IP++));
         (*x86emu_optab[op1]) (op1);
+        prefix = x86emu_is_prefix(op1);
+        if (!prefix)
+            M.x86.icount++;
         if (M.x86.debug & DEBUG_EXIT) {
             M.x86.debug &= ~DEBUG_EXIT;
-            return;
+            return X86EMU_EXEC_HALTED;
         }
     }
 }
 
+/****************************************************************************
+REMARKS:
+Runs the emulator until the system halts.
+****************************************************************************/
+void
+X86EMU_exec(void)
+{
+    M.x86.intr = 0;
+    x86emu_clear_prefixes();
+    x86emu_run(0);
+}
+
+/****************************************************************************
+PARAMETERS:
+max_insns	- Maximum number of instructions to execute
+
+RETURNS:
+X86EMU_EXEC_HALTED or X86EMU_EXEC_LIMIT, see x86emu_run.
+
+REMARKS:
+Starts the emulator like X86EMU_exec, but returns after at most max_insns
+instructions.
+****************************************************************************/
+int
+X86EMU_exec_limit(u32 max_insns)
+{
+    M.x86.intr = 0;
+    x86emu_clear_prefixes();
+    return x86emu_run(max_insns);
+}
+
+/****************************************************************************
+PARAMETERS:
+max_insns	- Maximum number of instructions to execute
+
+RETURNS:
+X86EMU_EXEC_HALTED or X86EMU_EXEC_LIMIT, see x86emu_run.
+
+REMARKS:
+Continues execution after X86EMU_exec_limit or X86EMU_resume returned
+X86EMU_EXEC_LIMIT.
+****************************************************************************/
+int
+X86EMU_resume(u32 max_insns)
+{
+    return x86emu_run(max_insns);
+}
+
+static void (*flow_hook) (int type);
+static void (*flow_optab[256]) (u8 op1);
+
+/****************************************************************************
+PARAMETERS:
+op1	- Control transfer opcode being executed
+
+REMARKS:
+Executes the original handler of the opcode and reports the transfer to
+the flow hook.  Calls and INTs are only reported if they have pushed a
+return address; INTs handled by the host and other group 0xFF
+instructions are not.
+****************************************************************************/
+static void
+x86emu_flow_op(u8 op1)
+{
+    u16 sp = M.x86.R_SP;
+    u8 rh;
+
+    switch (op1) {
+    case 0xc2:
+    case 0xc3:
+    case 0xca:
+    case 0xcb:
+    case 0xcf:
+        (*flow_optab[op1]) (op1);
+        (*flow_hook) (X86EMU_FLOW_RET);
+        return;
+    case 0xff:
+        rh = ((*sys_rdb) (((u32) M.x86.R_CS << 4) + M.x86.R_IP) >> 3) & 7;
+        (*flow_optab[op1]) (op1);
+        if ((rh == 2 || rh == 3) && M.x86.R_SP != sp)
+            (*flow_hook) (X86EMU_FLOW_CALL);
+        return;
+    default:
+        (*flow_optab[op1]) (op1);
+        if (M.x86.R_SP != sp)
+            (*flow_hook) (X86EMU_FLOW_CALL);
+    }
+}
+
+/****************************************************************************
+PARAMETERS:
+hook	- Function to call after each control transfer, NULL to disable
+
+REMARKS:
+Installs a hook which is called after every near or far CALL and every
+INT (type X86EMU_FLOW_CALL), and after every RET, RETF and IRET (type
+X86EMU_FLOW_RET), with the machine state already updated.  This lets
+the user program track the guest call stack.  The hook is installed by
+replacing the handlers of these opcodes, so the emulator runs at full
+speed without it.
+****************************************************************************/
+void
+X86EMU_setupFlowHook(void (*hook) (int type))
+{
+    static const u8 ops[] = {
+        0x9a, 0xe8, 0xff, 0xcc, 0xcd, 0xce,
+        0xc2, 0xc3, 0xca, 0xcb, 0xcf
+    };
+    unsigned i;
+
+    for (i = 0; i < sizeof(ops); i++) {
+        if (!flow_optab[ops[i]])
+            flow_optab[ops[i]] = x86emu_optab[ops[i]];
+        x86emu_optab[ops[i]] = hook ? x86emu_flow_op : flow_optab[ops[i]];
+    }
+    flow_hook = hook;
+}
+
 /****************************************************************************
 REMARKS:
 Halts the system by setting the halted system flag.
@@ -154,7 +154,20 @@ extern "C" {                    /* Use "C" linkage when in C++ mode */
 /* decode.c */
 
     void X86EMU_exec(void);
+    int X86EMU_exec_limit(u32 max_insns);
+    int X86EMU_resume(u32 max_insns);
     void X86EMU_halt_sys(void);
+    void X86EMU_setupFlowHook(void (*hook) (int type));
+
+/* Return values of X86EMU_exec_limit and X86EMU_resume */
+
+#define X86EMU_EXEC_HALTED      0
+#define X86EMU_EXEC_LIMIT       1
+
+/* Control transfers reported to the flow hook, after they are done */
+
+#define X86EMU_FLOW_CALL        1       /* CALL, or INT into guest code */
+#define X86EMU_FLOW_RET         2       /* RET, RETF or IRET */
 
 #ifdef	DEBUG
 #define	HALT_SYS()	\
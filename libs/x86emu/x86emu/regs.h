@@ -276,6 +276,7 @@ typedef struct {
     u32 mode;
     volatile int intr;          /* mask of pending interrupts */
     int debug;
+    u64 icount;                 /* number of executed instructions */
 #ifdef DEBUG
     int check;
     u16 saved_ip;
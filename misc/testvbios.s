@@ -0,0 +1,877 @@
+/*
+ * A synthetic 1MB real mode memory image with a test Video BIOS.
+ *
+ * The image can be used in place of /dev/mem (v86d -m, testvbe -m) to
+ * run v86d without root privileges or a graphics card.  It contains an
+ * IVT, a BDA, an EBDA, a 32K Video BIOS at C000:0000 and a System BIOS
+ * stub at F000:0000.
+ *
+ * The Video BIOS implements a subset of VBE 3.0:
+ *
+ *  4F00  controller info (mode list and strings in the ROM)
+ *  4F01  mode info for the modes in 'mode_table'
+ *  4F02  set mode (clears the VGA window unless bit 15 is set)
+ *  4F03  get mode
+ *  4F04  save/restore state
+ *  4F07  set/get display start
+ *  4F08  set/get DAC palette format
+ *  4F09  set/get palette data
+ *  4F15  DDC capabilities and EDID
+ *
+ * and the legacy functions 00h (set mode) and 0Fh (get mode).  Mode
+ * sets and palette loads program the VGA registers, just like a real
+ * BIOS would.
+ *
+ * Build with:
+ *  as --32 -o testvbios.o testvbios.s
+ *  objcopy -O binary testvbios.o testvbios.img
+ */
+
+	.code16
+	.text
+
+	.set	VBIOS_SEG, 0xc000
+	.set	SBIOS_SEG, 0xf000
+	.set	EBDA_SEG, 0x9fc0
+
+	.set	LFB_BASE, 0xe0000000
+	.set	VRAM_64K, 256			/* 16MB of video memory */
+
+/* Offsets within the Video BIOS segment are written as 'sym - vbios'. */
+
+/*------------------------------------------------------------------------
+ * Interrupt Vector Table
+ *------------------------------------------------------------------------*/
+	.org	0x0000
+ivt:
+	.rept	0x10
+	.word	dummy_iret - sbios, SBIOS_SEG
+	.endr
+	.word	int10 - vbios, VBIOS_SEG	/* int 10h */
+	.rept	0xff - 0x10
+	.word	dummy_iret - sbios, SBIOS_SEG
+	.endr
+
+/*------------------------------------------------------------------------
+ * BIOS Data Area
+ *------------------------------------------------------------------------*/
+	.org	0x0400
+bda:
+	.org	0x040e
+	.word	EBDA_SEG			/* EBDA segment */
+	.org	0x0413
+	.word	639				/* base memory in KB */
+	.org	0x0449
+	.byte	0x03				/* current video mode */
+	.word	80				/* columns */
+	.word	0x1000				/* page size */
+	.org	0x0463
+	.word	0x03d4				/* CRTC base port */
+
+/*------------------------------------------------------------------------
+ * Extended BIOS Data Area
+ *------------------------------------------------------------------------*/
+	.org	0x9fc00
+ebda:
+	.byte	1				/* size in KB */
+
+/*------------------------------------------------------------------------
+ * Video BIOS
+ *------------------------------------------------------------------------*/
+	.org	0xc0000
+vbios:
+	.byte	0x55, 0xaa
+	.byte	0x40				/* 32K */
+	jmp	post
+
+	.org	vbios + 0x18
+	.word	pcir - vbios			/* PCI data structure */
+
+	.org	vbios + 0x20
+pcir:
+	.ascii	"PCIR"
+	.word	0x1234				/* vendor */
+	.word	0x1111				/* device */
+	.word	0
+	.word	0x18				/* length */
+	.byte	0				/* revision */
+	.byte	0x00, 0x00, 0x03		/* class: VGA */
+	.word	0x40				/* image length, 512 byte units */
+	.word	0x0001				/* code revision */
+	.byte	0				/* x86 code */
+	.byte	0x80				/* last image */
+	.word	0
+
+/*
+ * Initialization, far-called at C000:0003 with AH = bus, AL = devfn.
+ * Like on real hardware, it waits for the "hardware" to settle, both
+ * with INT 15h/86h and with a refresh toggle (port 0x61) delay loop.
+ * There is no refresh toggle in a memory image, so the loop only ends
+ * if the delays are short-circuited (v86_set_fast_delays()).
+ */
+post:
+	pushw	%ds
+	pushw	%ax
+	pushw	%cx
+	pushw	%dx
+
+	/* Hook INT 10h. */
+	xorw	%ax, %ax
+	movw	%ax, %ds
+	movw	$int10 - vbios, 0x40
+	movw	$VBIOS_SEG, 0x42
+
+	pushw	%cs
+	popw	%ds
+	movw	$0x0003, cur_mode - vbios
+	movw	$160, cur_bpl - vbios
+	movb	$1, cur_bypp - vbios
+	movb	$6, dac_bits - vbios
+
+	/* Wait 100 ms. */
+	movb	$0x86, %ah
+	movw	$0x0001, %cx
+	movw	$0x86a0, %dx
+	int	$0x15
+
+	/* Wait 15 ms: 1000 refresh toggles. */
+	movw	$1000, %cx
+1:	inb	$0x61, %al
+	andb	$0x10, %al
+	movb	%al, %ah
+2:	inb	$0x61, %al
+	andb	$0x10, %al
+	cmpb	%al, %ah
+	je	2b
+	loop	1b
+
+	popw	%dx
+	popw	%cx
+	popw	%ax
+	popw	%ds
+	lret
+
+/*
+ * INT 10h entry point.
+ */
+int10:
+	cmpb	$0x4f, %ah
+	je	vbe
+
+	cmpb	$0x00, %ah
+	je	legacy_setmode
+	cmpb	$0x0f, %ah
+	je	legacy_getmode
+	iret
+
+legacy_setmode:
+	pushw	%ds
+	pushw	%bx
+	pushw	%cs
+	popw	%ds
+	xorb	%ah, %ah
+	andb	$0x7f, %al
+	movw	%ax, cur_mode - vbios
+	movw	$0, %bx
+	movw	%bx, disp_x - vbios
+	movw	%bx, disp_y - vbios
+	movw	$0x40, %bx
+	movw	%bx, %ds
+	movb	%al, 0x49
+	popw	%bx
+	popw	%ds
+	iret
+
+legacy_getmode:
+	pushw	%ds
+	movw	$0x40, %ax
+	movw	%ax, %ds
+	movb	0x49, %al
+	movb	0x4a, %ah
+	movb	$0, %bh
+	popw	%ds
+	iret
+
+vbe:
+	cld
+	cmpb	$0x00, %al
+	je	vbe_00
+	cmpb	$0x01, %al
+	je	vbe_01
+	cmpb	$0x02, %al
+	je	vbe_02
+	cmpb	$0x03, %al
+	je	vbe_03
+	cmpb	$0x04, %al
+	je	vbe_04
+	cmpb	$0x07, %al
+	je	vbe_07
+	cmpb	$0x08, %al
+	je	vbe_08
+	cmpb	$0x09, %al
+	je	vbe_09
+	cmpb	$0x15, %al
+	je	vbe_15
+	movw	$0x0100, %ax			/* not supported */
+	iret
+
+vbe_ok:
+	movw	$0x004f, %ax
+	iret
+
+vbe_fail:
+	movw	$0x014f, %ax
+	iret
+
+/*
+ * 4F00: Return VBE controller information in ES:DI.
+ */
+vbe_00:
+	pushw	%ds
+	pushw	%si
+	pushw	%di
+	pushw	%cx
+	pushw	%cs
+	popw	%ds
+	movw	$(vbe_info - vbios), %si
+	movw	$(vbe_info_end - vbe_info) / 2, %cx
+	rep	movsw
+	xorw	%ax, %ax
+	movw	$(512 - (vbe_info_end - vbe_info)) / 2, %cx
+	rep	stosw
+	popw	%cx
+	popw	%di
+	popw	%si
+	popw	%ds
+	jmp	vbe_ok
+
+/*
+ * Find the mode CX in the mode table.  Returns the entry in DS:SI, with
+ * the carry flag set if the mode doesn't exist.  DS has to be CS.
+ */
+find_mode:
+	pushw	%cx
+	andw	$0x1ff, %cx
+	movw	$(mode_table - vbios), %si
+1:	movw	(%si), %ax
+	cmpw	$0xffff, %ax
+	je	2f
+	cmpw	%ax, %cx
+	je	3f
+	addw	$8, %si
+	jmp	1b
+2:	stc
+	popw	%cx
+	ret
+3:	clc
+	popw	%cx
+	ret
+
+/*
+ * Bytes per scan line of the mode at DS:SI, in AX.  Bytes per pixel
+ * in DX.
+ */
+mode_bpl:
+	movzbw	6(%si), %dx
+	addw	$7, %dx
+	shrw	$3, %dx
+	movw	2(%si), %ax
+	pushw	%dx
+	mulw	%dx
+	popw	%dx
+	ret
+
+/*
+ * 4F01: Return mode information for mode CX in ES:DI.
+ */
+vbe_01:
+	pushw	%ds
+	pushw	%si
+	pushw	%di
+	pushw	%cx
+	pushw	%bx
+	pushl	%edx
+	pushw	%cs
+	popw	%ds
+
+	call	find_mode
+	jc	9f
+
+	pushw	%di
+	pushw	%cx
+	xorw	%ax, %ax
+	movw	$128, %cx
+	rep	stosw
+	popw	%cx
+	popw	%di
+
+	movw	$0x009b, %es:0(%di)		/* attributes */
+	movb	$0x07, %es:2(%di)		/* window A */
+	movw	$64, %es:4(%di)			/* granularity */
+	movw	$64, %es:6(%di)			/* window size */
+	movw	$0xa000, %es:8(%di)		/* window A segment */
+
+	call	mode_bpl
+	movw	%ax, %es:0x10(%di)		/* bytes per scan line */
+	movw	%ax, %es:0x32(%di)		/* linear bytes per scan line */
+	movw	%ax, %bx
+
+	movw	2(%si), %ax
+	movw	%ax, %es:0x12(%di)		/* x resolution */
+	movw	4(%si), %ax
+	movw	%ax, %es:0x14(%di)		/* y resolution */
+	movb	$8, %es:0x16(%di)		/* char width */
+	movb	$16, %es:0x17(%di)		/* char height */
+	movb	$1, %es:0x18(%di)		/* planes */
+	movb	6(%si), %al
+	movb	%al, %es:0x19(%di)		/* bits per pixel */
+	movb	$1, %es:0x1a(%di)		/* banks */
+	movb	$0x04, %es:0x1b(%di)		/* packed pixel */
+	cmpb	$8, %al
+	je	1f
+	movb	$0x06, %es:0x1b(%di)		/* direct color */
+1:
+	/* Number of images that fit into the video memory, minus one. */
+	movzwl	4(%si), %eax
+	movzwl	%bx, %ecx
+	imull	%eax, %ecx
+	movl	$VRAM_64K * 65536, %eax
+	xorl	%edx, %edx
+	divl	%ecx
+	decl	%eax
+	cmpl	$255, %eax
+	jbe	2f
+	movl	$255, %eax
+2:	movb	%al, %es:0x1d(%di)		/* image pages */
+	movb	%al, %es:0x34(%di)
+	movb	%al, %es:0x35(%di)
+	movb	$1, %es:0x1e(%di)
+
+	/* Color masks */
+	movw	$(masks_8 - vbios), %bx
+	movb	6(%si), %al
+	cmpb	$16, %al
+	jne	3f
+	movw	$(masks_16 - vbios), %bx
+3:	cmpb	$24, %al
+	jne	4f
+	movw	$(masks_24 - vbios), %bx
+4:	cmpb	$32, %al
+	jne	5f
+	movw	$(masks_32 - vbios), %bx
+5:	pushw	%si
+	pushw	%di
+	movw	%bx, %si
+	addw	$0x1f, %di
+	movw	$8, %cx
+	rep	movsb
+	popw	%di
+	popw	%si
+	pushw	%si
+	pushw	%di
+	movw	%bx, %si
+	addw	$0x36, %di
+	movw	$8, %cx
+	rep	movsb
+	popw	%di
+	popw	%si
+
+	movl	$LFB_BASE, %es:0x28(%di)	/* LFB address */
+	movl	$162000000, %es:0x3e(%di)	/* max pixel clock */
+
+	popl	%edx
+	popw	%bx
+	popw	%cx
+	popw	%di
+	popw	%si
+	popw	%ds
+	jmp	vbe_ok
+
+9:	popl	%edx
+	popw	%bx
+	popw	%cx
+	popw	%di
+	popw	%si
+	popw	%ds
+	jmp	vbe_fail
+
+/*
+ * Write AH to the index AL of the register pair at DX.
+ */
+vga_wr:
+	outw	%ax, %dx
+	ret
+
+/*
+ * 4F02: Set mode BX.
+ */
+vbe_02:
+	pushw	%ds
+	pushw	%es
+	pushw	%si
+	pushw	%di
+	pushw	%cx
+	pushw	%dx
+	pushw	%cs
+	popw	%ds
+
+	/* VGA modes */
+	movw	%bx, %cx
+	andw	$0x1ff, %cx
+	cmpw	$0x100, %cx
+	jae	0f
+	movw	$160, cur_bpl - vbios
+	movb	$1, cur_bypp - vbios
+	jmp	2f
+
+0:	call	find_mode
+	jc	9f
+
+	/* Blank the screen while the mode is being changed. */
+	movw	$0x3da, %dx
+	inb	%dx, %al
+	movw	$0x3c0, %dx
+	movb	$0x00, %al
+	outb	%al, %dx
+
+	/* Sequencer: synchronous reset, 8 dot clocks, chain 4 */
+	movw	$0x3c4, %dx
+	movw	$0x0100, %ax
+	call	vga_wr
+	movw	$0x0101, %ax
+	call	vga_wr
+	movw	$0x0f02, %ax
+	call	vga_wr
+	movw	$0x0e04, %ax
+	call	vga_wr
+	movw	$0x0300, %ax
+	call	vga_wr
+
+	movw	$0x3c2, %dx
+	movb	$0xe3, %al
+	outb	%al, %dx
+
+	/* CRTC: unlock, offset, start address */
+	call	mode_bpl
+	movw	%ax, cur_bpl - vbios
+	movb	%dl, cur_bypp - vbios
+	movw	$0x3d4, %dx
+	pushw	%ax
+	movw	$0x0e11, %ax
+	call	vga_wr
+	popw	%ax
+	shrw	$3, %ax
+	movb	%al, %ah
+	movb	$0x13, %al
+	call	vga_wr
+	movw	$0x000c, %ax
+	call	vga_wr
+	movw	$0x000d, %ax
+	call	vga_wr
+
+	/* Graphics controller: 256 colors, memory map A000 */
+	movw	$0x3ce, %dx
+	movw	$0x4005, %ax
+	call	vga_wr
+	movw	$0x0506, %ax
+	call	vga_wr
+
+	/* Clear the VGA window, unless asked not to. */
+	testw	$0x8000, %bx
+	jnz	1f
+	movw	$0xa000, %ax
+	movw	%ax, %es
+	xorw	%di, %di
+	xorl	%eax, %eax
+	movw	$0x4000, %cx
+	rep	stosl
+1:
+	/* Enable the display again. */
+	movw	$0x3da, %dx
+	inb	%dx, %al
+	movw	$0x3c0, %dx
+	movb	$0x20, %al
+	outb	%al, %dx
+
+2:	movw	%bx, %ax
+	andw	$0x7fff, %ax
+	movw	%ax, cur_mode - vbios
+	xorw	%ax, %ax
+	movw	%ax, disp_x - vbios
+	movw	%ax, disp_y - vbios
+
+	popw	%dx
+	popw	%cx
+	popw	%di
+	popw	%si
+	popw	%es
+	popw	%ds
+	jmp	vbe_ok
+
+9:	popw	%dx
+	popw	%cx
+	popw	%di
+	popw	%si
+	popw	%es
+	popw	%ds
+	jmp	vbe_fail
+
+/*
+ * 4F03: Return the current mode in BX.
+ */
+vbe_03:
+	movw	%cs:cur_mode - vbios, %bx
+	jmp	vbe_ok
+
+/*
+ * 4F04: Save/restore the state.  DL = 0: return the buffer size in BX,
+ * DL = 1: save to ES:BX, DL = 2: restore from ES:BX.
+ */
+vbe_04:
+	cmpb	$0x00, %dl
+	jne	1f
+	movw	$(state_end - state + 63) / 64, %bx
+	jmp	vbe_ok
+
+1:	pushw	%ds
+	pushw	%es
+	pushw	%si
+	pushw	%di
+	pushw	%cx
+	movw	$(state_end - state), %cx
+	cmpb	$0x01, %dl
+	jne	2f
+
+	pushw	%cs
+	popw	%ds
+	movw	$(state - vbios), %si
+	movw	%bx, %di
+	rep	movsb
+	jmp	3f
+
+2:	cmpb	$0x02, %dl
+	jne	9f
+	pushw	%es
+	popw	%ds
+	pushw	%cs
+	popw	%es
+	movw	%bx, %si
+	movw	$(state - vbios), %di
+	rep	movsb
+
+3:	popw	%cx
+	popw	%di
+	popw	%si
+	popw	%es
+	popw	%ds
+	jmp	vbe_ok
+
+9:	popw	%cx
+	popw	%di
+	popw	%si
+	popw	%es
+	popw	%ds
+	jmp	vbe_fail
+
+/*
+ * 4F07: Set (BL = 00h/80h) or get (BL = 01h) the display start.
+ */
+vbe_07:
+	cmpb	$0x01, %bl
+	jne	1f
+	movw	%cs:disp_x - vbios, %cx
+	movw	%cs:disp_y - vbios, %dx
+	xorb	%bh, %bh
+	jmp	vbe_ok
+
+1:	testb	$0x7f, %bl
+	jnz	vbe_fail
+
+	pushw	%ds
+	pushl	%eax
+	pushl	%ecx
+	pushl	%edx
+	pushw	%cs
+	popw	%ds
+	movw	%cx, disp_x - vbios
+	movw	%dx, disp_y - vbios
+
+	/* Start address = (y * bpl + x * bytes per pixel) / 4 */
+	movzwl	%dx, %eax
+	movzwl	cur_bpl - vbios, %edx
+	imull	%edx, %eax
+	movzwl	%cx, %ecx
+	movzbl	cur_bypp - vbios, %edx
+	imull	%edx, %ecx
+	addl	%ecx, %eax
+	shrl	$2, %eax
+
+	movl	%eax, %ecx
+	movw	$0x3d4, %dx
+	movb	$0x0c, %al
+	movb	%ch, %ah
+	call	vga_wr
+	movb	$0x0d, %al
+	movb	%cl, %ah
+	call	vga_wr
+
+	popl	%edx
+	popl	%ecx
+	popl	%eax
+	popw	%ds
+	jmp	vbe_ok
+
+/*
+ * 4F08: Set (BL = 00h) or get (BL = 01h) the DAC width in BH.
+ */
+vbe_08:
+	cmpb	$0x01, %bl
+	je	1f
+	cmpb	$0x00, %bl
+	jne	vbe_fail
+	cmpb	$8, %bh
+	je	2f
+	movb	$6, %bh
+2:	movb	%bh, %cs:dac_bits - vbios
+1:	movb	%cs:dac_bits - vbios, %bh
+	jmp	vbe_ok
+
+/*
+ * 4F09: Set (BL = 00h/80h) or get (BL = 01h) CX palette entries starting
+ * at DX, from/to ES:DI.
+ */
+vbe_09:
+	pushw	%ds
+	pushw	%es
+	pushw	%si
+	pushw	%di
+	pushw	%cx
+	pushw	%dx
+	pushw	%bx
+
+	movw	%dx, %ax
+	addw	%cx, %ax
+	cmpw	$256, %ax
+	ja	9f
+
+	movw	%dx, %si
+	shlw	$2, %si
+	addw	$(palette - vbios), %si
+
+	cmpb	$0x01, %bl
+	jne	1f
+
+	/* Get: copy from the palette to ES:DI. */
+	pushw	%cs
+	popw	%ds
+	shlw	$1, %cx
+	rep	movsw
+	jmp	8f
+
+1:	testb	$0x7f, %bl
+	jnz	9f
+
+	/* Set: copy from ES:DI to the palette and load the DAC. */
+	pushw	%cx
+	pushw	%si
+	pushw	%es
+	popw	%ds
+	pushw	%cs
+	popw	%es
+	xchgw	%si, %di
+	shlw	$1, %cx
+	rep	movsw
+	popw	%si
+	popw	%cx
+
+	pushw	%cs
+	popw	%ds
+	movb	dac_bits - vbios, %bh
+	movb	%dl, %al			/* first entry */
+	movw	$0x3c8, %dx
+	outb	%al, %dx
+	incw	%dx
+2:	movb	2(%si), %al			/* red */
+	call	dac_out
+	movb	1(%si), %al			/* green */
+	call	dac_out
+	movb	(%si), %al			/* blue */
+	call	dac_out
+	addw	$4, %si
+	loop	2b
+
+8:	popw	%bx
+	popw	%dx
+	popw	%cx
+	popw	%di
+	popw	%si
+	popw	%es
+	popw	%ds
+	jmp	vbe_ok
+
+9:	popw	%bx
+	popw	%dx
+	popw	%cx
+	popw	%di
+	popw	%si
+	popw	%es
+	popw	%ds
+	jmp	vbe_fail
+
+/* Write a color component in AL to the DAC, scaled to 6 bits if needed. */
+dac_out:
+	cmpb	$8, %bh
+	je	1f
+	andb	$0x3f, %al
+1:	outb	%al, %dx
+	ret
+
+/*
+ * 4F15: DDC.  BL = 00h: capabilities, BL = 01h: read EDID block DX
+ * into ES:DI.
+ */
+vbe_15:
+	cmpb	$0x00, %bl
+	jne	1f
+	movw	$0x0102, %bx			/* DDC2, 1s per block */
+	jmp	vbe_ok
+
+1:	cmpb	$0x01, %bl
+	jne	vbe_fail
+	testw	%dx, %dx
+	jnz	vbe_fail
+
+	pushw	%ds
+	pushw	%si
+	pushw	%di
+	pushw	%cx
+	pushw	%cs
+	popw	%ds
+	movw	$(edid - vbios), %si
+	movw	$127, %cx
+	xorb	%ah, %ah
+2:	lodsb
+	addb	%al, %ah
+	stosb
+	loop	2b
+	negb	%ah				/* checksum */
+	movb	%ah, %al
+	stosb
+	popw	%cx
+	popw	%di
+	popw	%si
+	popw	%ds
+	jmp	vbe_ok
+
+/*------------------------------------------------------------------------
+ * Video BIOS data
+ *------------------------------------------------------------------------*/
+vbe_info:
+	.ascii	"VESA"
+	.word	0x0300				/* version */
+	.word	oem_string - vbios, VBIOS_SEG
+	.long	0x00000001			/* capabilities */
+	.word	mode_list - vbios, VBIOS_SEG
+	.word	VRAM_64K
+	.word	0x0100				/* OEM software revision */
+	.word	oem_vendor - vbios, VBIOS_SEG
+	.word	oem_product - vbios, VBIOS_SEG
+	.word	oem_rev - vbios, VBIOS_SEG
+vbe_info_end:
+
+oem_string:	.asciz	"v86d Test VBIOS"
+oem_vendor:	.asciz	"v86d"
+oem_product:	.asciz	"Synthetic VGA"
+oem_rev:	.asciz	"1.0"
+
+mode_list:
+	.word	0x101, 0x111, 0x112, 0x114, 0x115, 0x117, 0x118, 0x11a, 0x11b
+	.word	0xffff
+
+/* mode, x resolution, y resolution, bits per pixel */
+mode_table:
+	.word	0x101, 640, 480
+	.byte	8, 0
+	.word	0x111, 640, 480
+	.byte	16, 0
+	.word	0x112, 640, 480
+	.byte	32, 0
+	.word	0x114, 800, 600
+	.byte	16, 0
+	.word	0x115, 800, 600
+	.byte	32, 0
+	.word	0x117, 1024, 768
+	.byte	16, 0
+	.word	0x118, 1024, 768
+	.byte	32, 0
+	.word	0x11a, 1280, 1024
+	.byte	16, 0
+	.word	0x11b, 1280, 1024
+	.byte	32, 0
+	.word	0xffff
+
+/* red, green, blue, reserved: size and position */
+masks_8:	.byte	0, 0, 0, 0, 0, 0, 0, 0
+masks_16:	.byte	5, 11, 6, 5, 5, 0, 0, 0
+masks_24:	.byte	8, 16, 8, 8, 8, 0, 0, 0
+masks_32:	.byte	8, 16, 8, 8, 8, 0, 8, 24
+
+/* 1280x1024@60 monitor, the checksum is calculated by vbe_15 */
+edid:
+	.byte	0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00
+	.byte	0x52, 0x74			/* "TST" */
+	.word	0x0001				/* product */
+	.long	0				/* serial */
+	.byte	1, 30				/* week 1, 2020 */
+	.byte	1, 3				/* EDID 1.3 */
+	.byte	0x80, 34, 27, 0x78, 0x0a
+	.byte	0xee, 0x91, 0xa3, 0x54, 0x4c, 0x99, 0x26, 0x0f, 0x50, 0x54
+	.byte	0x21, 0x08, 0x00
+	.rept	8
+	.byte	0x01, 0x01
+	.endr
+	/* 1280x1024, 108 MHz */
+	.byte	0x30, 0x2a, 0x00, 0x98, 0x51, 0x00, 0x2a, 0x40, 0x30, 0x70
+	.byte	0x13, 0x00, 0x54, 0x0e, 0x11, 0x00, 0x00, 0x1e
+	.byte	0x00, 0x00, 0x00, 0xfc, 0x00
+	.ascii	"v86d test\n   "
+	.byte	0x00, 0x00, 0x00, 0xfd, 0x00, 0x38, 0x4c, 0x1e, 0x53, 0x0f
+	.byte	0x00, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20
+	.byte	0x00, 0x00, 0x00, 0x10, 0x00
+	.rept	13
+	.byte	0x00
+	.endr
+	.byte	0				/* extensions */
+
+/*
+ * Variables.  The Video BIOS is shadowed in RAM, so they can be kept
+ * in the ROM segment.
+ */
+	.org	vbios + 0x7000
+state:
+cur_mode:	.word	0x0003
+cur_bpl:	.word	160
+cur_bypp:	.byte	1
+dac_bits:	.byte	6
+disp_x:		.word	0
+disp_y:		.word	0
+palette:	.fill	256 * 4, 1, 0
+state_end:
+
+	.org	vbios + 0x8000 - 1
+	.byte	0
+
+/*------------------------------------------------------------------------
+ * System BIOS
+ *------------------------------------------------------------------------*/
+	.org	0xf0000
+sbios:
+dummy_iret:
+	iret
+
+	.org	0xffff0
+	ljmp	$SBIOS_SEG, $0
+	.ascii	"01/01/20"
+	.byte	0
+	.byte	0xfc				/* AT */
+	.byte	0
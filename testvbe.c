@@ -12,26 +12,57 @@
 #define reg16(reg) (reg & 0xffff)
 #define failed(tsk) (reg16(tsk.regs.eax) != 0x004f)
 
-int main(int argc, char *argv[])
+#ifdef CONFIG_X86EMU
+#define BACKEND		"x86emu"
+#else
+#define BACKEND		"lrmi"
+#endif
+
+#define MAX_MODES	256
+#define PAN_STEPS	16
+
+static u16 modes[MAX_MODES];
+static int nmodes;
+static u32 errors;
+static char stats[65536];
+
+/*
+ * Run a single task, and account its latency to the function it
+ * was called with.  Returns non-zero if the call failed.
+ */
+static int vbe_call(struct uvesafb_task *tsk, void *buf)
+{
+	struct v86_regs regs = tsk->regs;
+	u64 t;
+
+	t = v86_time_us();
+	if (v86_task(tsk, buf))
+		return -1;
+	v86_stats_add(&regs, v86_time_us() - t);
+	v86_stats_cost(&regs, &v86_cost);
+
+	if (failed((*tsk))) {
+		errors++;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int vbe_info(int print)
 {
 	struct uvesafb_task tsk;
 	struct vbe_ib ib;
 	u16 *s;
 	u8 *t;
 
-	if (v86_init())
-		return -1;
-
 	memset(&tsk, 0, sizeof(tsk));
 	tsk.regs.eax = 0x4f00;
 	tsk.flags = TF_VBEIB;
 	tsk.buf_len = sizeof(ib);
 	strncpy((char*)&ib.vbe_signature, "VBE2", 4);
 
-	if (v86_task(&tsk, (u8*)&ib))
-		return -1;
-
-	if (failed(tsk)) {
+	if (vbe_call(&tsk, &ib)) {
 		fprintf(stderr, "Getting VBE Info Block failed with eax = %.4x\n",
 				reg16(tsk.regs.eax));
 		return -1;
@@ -39,38 +70,431 @@ int main(int argc, char *argv[])
 
 	t = (u8*)&ib;
 
-	printf("VBE Version:     %x.%.2x\n", ((ib.vbe_version & 0xf00) >> 8), (ib.vbe_version & 0xff));
-	printf("OEM String:      %s\n", ib.oem_string_ptr + t);
-	printf("OEM Vendor Name: %s\n", ib.oem_vendor_name_ptr + t);
-	printf("OEM Prod. Name:  %s\n", ib.oem_product_name_ptr + t);
-	printf("OEM Prod. Rev:   %s\n", ib.oem_product_rev_ptr + t);
+	if (print) {
+		printf("VBE Version:     %x.%.2x\n", ((ib.vbe_version & 0xf00) >> 8), (ib.vbe_version & 0xff));
+		printf("OEM String:      %s\n", ib.oem_string_ptr + t);
+		printf("OEM Vendor Name: %s\n", ib.oem_vendor_name_ptr + t);
+		printf("OEM Prod. Name:  %s\n", ib.oem_product_name_ptr + t);
+		printf("OEM Prod. Rev:   %s\n", ib.oem_product_rev_ptr + t);
+	}
+
+	nmodes = 0;
+	for (s = (u16*)(t + ib.mode_list_ptr); *s != 0xffff && nmodes < MAX_MODES; s++)
+		modes[nmodes++] = *s;
+
+	return 0;
+}
+
+static int vbe_modes(int print)
+{
+	int i;
 
-	printf("\n%-6s %-6s mode\n", "ID", "attr");
-	printf("---------------------------\n");
+	if (print) {
+		printf("\n%-6s %-6s mode\n", "ID", "attr");
+		printf("---------------------------\n");
+	}
 
-	for (s = t + ib.mode_list_ptr; *s != 0xffff; s++) {
+	for (i = 0; i < nmodes; i++) {
+		struct uvesafb_task tsk;
 		struct vbe_mode_ib mib;
 
 		memset(&tsk, 0, sizeof(tsk));
 		tsk.regs.eax = 0x4f01;
-		tsk.regs.ecx = *s;
+		tsk.regs.ecx = modes[i];
 		tsk.flags = TF_BUF_RET | TF_BUF_ESDI;
 		tsk.buf_len = sizeof(mib);
 
-		if (v86_task(&tsk, (u8*)&mib))
+		if (vbe_call(&tsk, &mib)) {
+			fprintf(stderr, "Getting Mode Info Block for mode %.4x "
+					"failed with eax = %.4x\n",	modes[i], reg16(tsk.regs.eax));
+			if (print)
+				return -1;
+			continue;
+		}
+
+		if (print)
+			printf("%-6.4x %-6.4x %dx%d-%d %x\n", modes[i], mib.mode_attr,
+				   mib.x_res, mib.y_res, mib.bits_per_pixel, mib.phys_base_ptr);
+	}
+
+	return 0;
+}
+
+/*
+ * Save the hardware state, switch to 'mode', switch back to the
+ * original mode and restore the state (4F04, 4F02, 4F03).
+ */
+static int vbe_modeset(u16 mode)
+{
+	struct uvesafb_task tsk;
+	u8 *state = NULL;
+	int len = 0;
+	u16 old;
+
+	memset(&tsk, 0, sizeof(tsk));
+	tsk.regs.eax = 0x4f03;
+	if (vbe_call(&tsk, NULL))
+		return -1;
+	old = tsk.regs.ebx & 0x7fff;
+
+	/* Size of the state buffer, in 64 byte blocks. */
+	memset(&tsk, 0, sizeof(tsk));
+	tsk.regs.eax = 0x4f04;
+	tsk.regs.ecx = 0x000f;
+	if (!vbe_call(&tsk, NULL))
+		len = (tsk.regs.ebx & 0xffff) * 64;
+
+	if (len) {
+		state = malloc(len);
+		if (!state)
 			return -1;
 
-		if (failed(tsk)) {
-			fprintf(stderr, "Getting Mode Info Block for mode %.4x "
-					"failed with eax = %.4x\n",	*s, reg16(tsk.regs.eax));
+		memset(&tsk, 0, sizeof(tsk));
+		tsk.regs.eax = 0x4f04;
+		tsk.regs.ecx = 0x000f;
+		tsk.regs.edx = 0x0001;
+		tsk.flags = TF_BUF_ESBX | TF_BUF_RET;
+		tsk.buf_len = len;
+		vbe_call(&tsk, state);
+	}
+
+	memset(&tsk, 0, sizeof(tsk));
+	tsk.regs.eax = 0x4f02;
+	tsk.regs.ebx = mode | 0x4000;
+	vbe_call(&tsk, NULL);
+
+	memset(&tsk, 0, sizeof(tsk));
+	tsk.regs.eax = 0x4f03;
+	vbe_call(&tsk, NULL);
+
+	memset(&tsk, 0, sizeof(tsk));
+	tsk.regs.eax = 0x4f02;
+	tsk.regs.ebx = old;
+	vbe_call(&tsk, NULL);
+
+	if (state) {
+		memset(&tsk, 0, sizeof(tsk));
+		tsk.regs.eax = 0x4f04;
+		tsk.regs.ecx = 0x000f;
+		tsk.regs.edx = 0x0002;
+		tsk.flags = TF_BUF_ESBX;
+		tsk.buf_len = len;
+		vbe_call(&tsk, state);
+		free(state);
+	}
+
+	return 0;
+}
+
+/* Move the display start around and read it back (4F07). */
+static void vbe_pan(void)
+{
+	struct uvesafb_task tsk;
+	int i;
+
+	for (i = 0; i < PAN_STEPS; i++) {
+		memset(&tsk, 0, sizeof(tsk));
+		tsk.regs.eax = 0x4f07;
+		tsk.regs.ebx = 0x0000;
+		tsk.regs.ecx = 0;
+		tsk.regs.edx = i;
+		vbe_call(&tsk, NULL);
+
+		memset(&tsk, 0, sizeof(tsk));
+		tsk.regs.eax = 0x4f07;
+		tsk.regs.ebx = 0x0001;
+		vbe_call(&tsk, NULL);
+	}
+}
+
+/* Load a full 256-entry palette and read it back (4F09). */
+static void vbe_palette(void)
+{
+	struct uvesafb_task tsk;
+	u8 pal[256 * 4];
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		pal[i * 4] = i >> 2;
+		pal[i * 4 + 1] = i >> 2;
+		pal[i * 4 + 2] = i >> 2;
+		pal[i * 4 + 3] = 0;
+	}
+
+	memset(&tsk, 0, sizeof(tsk));
+	tsk.regs.eax = 0x4f09;
+	tsk.regs.ebx = 0x0000;
+	tsk.regs.ecx = 256;
+	tsk.regs.edx = 0;
+	tsk.flags = TF_BUF_ESDI;
+	tsk.buf_len = sizeof(pal);
+	vbe_call(&tsk, pal);
+
+	memset(&tsk, 0, sizeof(tsk));
+	tsk.regs.eax = 0x4f09;
+	tsk.regs.ebx = 0x0001;
+	tsk.regs.ecx = 256;
+	tsk.regs.edx = 0;
+	tsk.flags = TF_BUF_ESDI | TF_BUF_RET;
+	tsk.buf_len = sizeof(pal);
+	vbe_call(&tsk, pal);
+}
+
+/*
+ * Print the results next to the ones from an earlier run with the -o
+ * option, e.g. one made with the other backend.
+ */
+static void compare(const char *path)
+{
+	const char *fmt = "%15[^,],%*u,%*u,%llu,%u,%*u,%u";
+	char line[256], func[16], ofunc[16], *l, *p;
+	unsigned long long mean, omean;
+	unsigned int p50, p99, op50, op99;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	printf("\n%-7s %18s %18s %18s\n", "", "mean", "p50", "p99");
+	printf("%-7s %9s %8s %9s %8s %9s %8s\n", "func", BACKEND, "other",
+		   BACKEND, "other", BACKEND, "other");
+
+	for (l = strtok(stats, "\n"); l; l = strtok(NULL, "\n")) {
+		if (sscanf(l, fmt, func, &mean, &p50, &p99) != 4)
+			continue;
+
+		rewind(f);
+		while (fgets(line, sizeof(line), f)) {
+			/* Skip the backend name. */
+			p = strchr(line, ',');
+			if (!p || sscanf(p + 1, fmt, ofunc, &omean, &op50, &op99) != 4 ||
+				strcmp(func, ofunc))
+				continue;
+
+			printf("%-7s %9llu %8llu %9u %8u %9u %8u\n", func, mean, omean,
+				   p50, op50, p99, op99);
+			break;
+		}
+	}
+
+	fclose(f);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: testvbe [options]\n\n"
+		"Without options, print the VBE info and the mode list.\n\n"
+		"  -n <count>  run the benchmark loop <count> times\n"
+		"  -w <count>  number of warmup iterations (default: 1)\n"
+		"  -s <mode>   add a mode set/restore cycle to every iteration\n"
+		"  -p          add a display start (pan) loop to every iteration\n"
+		"  -P          add a palette load loop to every iteration\n"
+		"  -o          print the results as comma-separated values\n"
+		"  -c <file>   compare with the output of an earlier run with -o\n"
+		"  -m <file>   use a memory image instead of /dev/mem\n"
+		"  -M          replay recorded mode sets (see -s)\n"
+		"  -b <b:d.f>  POST the adapter at the given PCI address first\n"
+		"  -R <file>   use an option ROM image as the Video BIOS\n"
+		"  -V <policy> back the VGA window with shared, private or wc memory\n"
+		"              and print the VGA window statistics\n"
+		"  -I <spec>   set port I/O policies and print the port I/O statistics,\n"
+		"              e.g. 0x3c0-0x3df=virtual\n"
+		"  -F <file>   write the folded guest call stacks of the measured\n"
+		"              iterations to <file>\n"
+		"  -f <count>  sample the call stack every <count> instructions\n"
+		"              (default: 1000)\n"
+		"  -Y <file>   name the Video BIOS frames after a symbol map\n"
+		"  -A          count the memory accesses per region and page and\n"
+		"              print them\n"
+		"  -C          print the average cost of the calls\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int iters = 0, warmup = 1, pan = 0, palette = 0, csv = 0, io = 0, mset = 0;
+	int vram = 0, heat = 0, cost = 0;
+	char *cmp = NULL, *l, *prof_path = NULL, *prof_map = NULL;
+	u32 prof_every = 1000;
+	long mode = -1;
+	int i, c, post = -1;
+	unsigned int bus, dev, fn;
+	u64 t;
+
+	while ((c = getopt(argc, argv, "n:w:s:pPoc:m:I:Mb:R:V:F:f:Y:AC")) != -1) {
+		switch (c) {
+		case 'n':
+			iters = atoi(optarg);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		case 's':
+			mode = strtol(optarg, NULL, 16);
+			break;
+		case 'p':
+			pan = 1;
+			break;
+		case 'P':
+			palette = 1;
+			break;
+		case 'o':
+			csv = 1;
+			break;
+		case 'c':
+			cmp = optarg;
+			break;
+		case 'm':
+			if (v86_mem_set_image(optarg))
+				return -1;
+			break;
+		case 'M':
+			if (v86_mset_init())
+				return -1;
+			mset = 1;
+			break;
+		case 'b':
+			if (sscanf(optarg, "%x:%x.%x", &bus, &dev, &fn) != 3) {
+				usage();
+				return -1;
+			}
+			post = (bus << 8) | (dev << 3) | fn;
+			break;
+		case 'R':
+			if (v86_mem_set_rom(optarg))
+				return -1;
+			break;
+		case 'V':
+			if (v86_mem_set_vram(optarg))
+				return -1;
+			vram = 1;
+			break;
+		case 'I':
+			if (v86_pio_config(optarg))
+				return -1;
+			io = 1;
+			break;
+		case 'F':
+			prof_path = optarg;
+			break;
+		case 'f':
+			prof_every = strtoul(optarg, NULL, 0);
+			break;
+		case 'Y':
+			prof_map = optarg;
+			break;
+		case 'A':
+			if (v86_heat_init())
+				return -1;
+			heat = 1;
+			break;
+		case 'C':
+			cost = 1;
+			break;
+		default:
+			usage();
 			return -1;
 		}
+	}
+
+	if (warmup < 0)
+		warmup = 0;
+
+	if (prof_path && v86_prof_init(prof_path, prof_every, prof_map))
+		return -1;
 
-		printf("%-6.4x %-6.4x %dx%d-%d %x\n", *s, mib.mode_attr,
-				mib.x_res, mib.y_res, mib.bits_per_pixel, mib.phys_base_ptr);
+	t = v86_time_us();
+	if (v86_init())
+		return -1;
+
+	if (post >= 0) {
+		t = v86_time_us() - t;
+		if (v86_post(post))
+			return -1;
+
+		v86_post_dump(stats, sizeof(stats));
+		printf("%-6s %10llu us\n%s\n", "load", (unsigned long long)t, stats);
 	}
 
-	v86_cleanup();
+	if (!iters) {
+		if (vbe_info(1) || vbe_modes(1))
+			return -1;
+		v86_cleanup();
+		return 0;
+	}
+
+	if (vbe_info(0))
+		return -1;
+
+	for (i = -warmup; i < iters; i++) {
+		/* Only keep the results of the measured iterations. */
+		if (!i) {
+			v86_stats_reset();
+			v86_pio_reset();
+			v86_prof_reset();
+			v86_heat_reset();
+			errors = 0;
+		}
+
+		if (vbe_info(0))
+			return -1;
+		vbe_modes(0);
+
+		if (mode >= 0)
+			vbe_modeset(mode);
+		if (pan)
+			vbe_pan();
+		if (palette)
+			vbe_palette();
+	}
 
+	v86_stats_dump(stats, sizeof(stats), csv || cmp ? STATS_FMT_CSV : STATS_FMT_TEXT);
+
+	if (csv) {
+		/* Prefix every line with the backend name. */
+		for (l = strtok(stats, "\n"); l; l = strtok(NULL, "\n"))
+			printf("%s,%s\n", l == stats ? "backend" : BACKEND, l);
+	} else if (cmp) {
+		compare(cmp);
+	} else {
+		printf("%s backend, %d iterations, %d modes, %u failed calls\n\n",
+			   BACKEND, iters, nmodes, errors);
+		printf("%s", stats);
+
+		if (cost) {
+			v86_stats_dump(stats, sizeof(stats), STATS_FMT_COST);
+			printf("\n%s", stats);
+		}
+
+		if (io) {
+			v86_pio_dump(stats, sizeof(stats));
+			printf("\n%s", stats);
+		}
+
+		if (mset) {
+			v86_mset_dump(stats, sizeof(stats));
+			printf("\n%s", stats);
+		}
+
+		if (vram) {
+			v86_mem_vram_dump(stats, sizeof(stats));
+			printf("\n%s", stats);
+		}
+
+		if (prof_path) {
+			v86_prof_dump(stats, sizeof(stats));
+			printf("\n%s", stats);
+		}
+
+		if (heat) {
+			v86_heat_dump(stats, sizeof(stats));
+			printf("\n%s", stats);
+		}
+	}
+
+	v86_cleanup();
 	return 0;
 }
@@ -3,88 +3,573 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <time.h>
 #include <fcntl.h>
 
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/poll.h>
 
-#include <linux/netlink.h>
-#include <linux/rtnetlink.h>
-
 #include <arpa/inet.h>
 
 #include "v86.h"
+#include "v86_trace.h"
+
+static volatile sig_atomic_t need_exit;
+static struct v86_xport *xport = &xport_netlink;
+
+#ifdef CONFIG_THREADS
+/*
+ * Requests that can't be answered from the reply cache are queued for
+ * the worker thread, which is the only thread running the emulator.
+ */
+struct req {
+	struct req *next;
+	u64 t;				/* time of arrival */
+	struct cn_msg msg;
+};
+
+static struct req *queue_head, *queue_tail;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t main_thread, worker_thread;
+#endif
+
+/*
+ * Run a task in the emulator, leaving the reply in its place.  Successful
+ * calls without side effects are remembered in the reply cache, unless
+ * 'cache' is 0.  Returns non-zero if the emulator failed.
+ */
+static int task_exec(struct uvesafb_task *tsk, int cache)
+{
+	u8 *buf = (u8*)tsk + sizeof(struct uvesafb_task);
+	struct uvesafb_task *req = NULL;
+	struct v86_regs regs = tsk->regs;
+	int err;
+
+	if (cache && cache_able(tsk)) {
+		req = malloc(sizeof(*tsk) + tsk->buf_len);
+		if (req)
+			memcpy(req, tsk, sizeof(*tsk) + tsk->buf_len);
+	}
+
+	err = v86_task(tsk, buf);
+	v86_stats_cost(&regs, &v86_cost);
+	if (err) {
+		free(req);
+		return 2;
+	}
+
+	if (req && (tsk->regs.eax & 0xffff) == 0x004f)
+		cache_put(req, tsk);
+	free(req);
+	query_note(&regs, tsk, buf);
+
+	return 0;
+}
+
+/* Run a single task and send the reply, see req_dispatch(). */
+int req_exec(struct cn_msg *msg)
+{
+	struct uvesafb_task *tsk = (struct uvesafb_task*)(msg + 1);
+
+	if (task_exec(tsk, 1))
+		return 2;
+
+	xport->send(msg);
+	return 0;
+}
 
-static int need_exit;
-static __u32 seq;
+static void req_done(struct v86_regs *regs, u32 cn_seq, u64 t)
+{
+	v86_stats_add(regs, v86_time_us() - t);
+	v86_trace(TR_REQ_END, 0, regs->eax, cn_seq);
+}
 
-static int netlink_send(int s, struct cn_msg *msg)
+/*
+ * Check that the tasks of a batch fill the message exactly.  Returns
+ * the number of tasks, or 0 if the batch is malformed.
+ */
+static int batch_check(struct cn_msg *msg)
 {
-	struct nlmsghdr *nlh;
-	unsigned int size;
+	struct uvesafb_task *hdr = (struct uvesafb_task*)(msg + 1), *tsk;
+	u8 *p = (u8*)(hdr + 1), *end = (u8*)hdr + msg->len;
+	int i, n = hdr->regs.ecx;
+
+	if (n <= 0 || n > BATCH_MAX_TASKS ||
+		msg->len != sizeof(*hdr) + hdr->buf_len)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		tsk = (struct uvesafb_task*)p;
+		if (end - p < sizeof(*tsk) || tsk->buf_len < 0 ||
+			tsk->buf_len > end - p - sizeof(*tsk) ||
+			tsk->flags & (TF_EXIT | TF_CAPS | TF_BATCH))
+			return 0;
+		p += sizeof(*tsk) + tsk->buf_len;
+	}
+
+	return (p == end) ? n : 0;
+}
+
+/*
+ * Run the tasks of a batch and send the reply.  Every task is accounted
+ * for as a request of its own, starting when the previous one finished
+ * (the first one when the batch arrived at 't').
+ */
+static int batch_exec(struct cn_msg *msg, u64 t)
+{
+	struct uvesafb_task *hdr = (struct uvesafb_task*)(msg + 1), *tsk;
+	struct v86_regs regs;
+	u8 *p = (u8*)(hdr + 1);
+	int i, n;
+
+	n = batch_check(msg);
+	if (!n) {
+		ulog(LOG_WARNING, "Malformed batch of %u bytes dropped.\n", msg->len);
+		hdr->regs.eax = 0x014f;
+		hdr->regs.ecx = 0;
+		xport->send(msg);
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		tsk = (struct uvesafb_task*)p;
+		regs = tsk->regs;
+		v86_trace(TR_REQ_BEGIN, 0, regs.eax, msg->seq);
+
+		if (!cache_get(tsk, sizeof(*tsk) + tsk->buf_len) && task_exec(tsk, 1))
+			return 2;
+
+		req_done(&regs, msg->seq, t);
+		t = v86_time_us();
+		p += sizeof(*tsk) + tsk->buf_len;
+	}
+
+	hdr->regs.eax = 0x004f;
+	xport->send(msg);
+	return 0;
+}
+
+/* Answer a capability query, see TF_CAPS. */
+static void caps_reply(struct cn_msg *msg)
+{
+	struct uvesafb_task *tsk = (struct uvesafb_task*)(msg + 1);
+
+	tsk->regs.eax = 0x004f;
+	tsk->regs.ebx = V86D_CAPS;
+	xport->send(msg);
+}
+
+#ifdef CONFIG_THREADS
+/*
+ * Hand a request over to the worker.  If it can't be queued, it is
+ * failed with AX=0x014f right away, so that the kernel doesn't wait for
+ * a reply that never comes.  Running it here instead would race with
+ * the worker over the emulator.
+ */
+static int queue_push(struct cn_msg *msg, u64 t)
+{
+	struct uvesafb_task *tsk = (struct uvesafb_task*)(msg + 1);
+	struct req *r;
+
+	r = malloc(sizeof(*r) + msg->len);
+	if (!r) {
+		ulog(LOG_ERR, "Failed to allocate memory for a request.\n");
+		tsk->regs.eax = 0x014f;
+		xport->send(msg);
+		return 0;
+	}
+
+	r->next = NULL;
+	r->t = t;
+	memcpy(&r->msg, msg, sizeof(*msg) + msg->len);
+
+	pthread_mutex_lock(&queue_lock);
+	if (queue_tail)
+		queue_tail->next = r;
+	else
+		queue_head = r;
+	queue_tail = r;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	return 0;
+}
+
+static void *worker(void *arg)
+{
+	struct uvesafb_task *tsk;
+	struct v86_regs regs;
+	struct req *r;
+	sigset_t sigs;
 	int err;
-	char buf[CONNECTOR_MAX_MSG_SIZE];
-	struct cn_msg *m;
 
-	size = NLMSG_SPACE(sizeof(struct cn_msg) + msg->len);
+	/* Leave the signals to the main thread. */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
 
-	nlh = (struct nlmsghdr *)buf;
-	nlh->nlmsg_seq = seq++;
-	nlh->nlmsg_pid = getpid();
-	nlh->nlmsg_type = NLMSG_DONE;
-	nlh->nlmsg_len = NLMSG_LENGTH(size - sizeof(*nlh));
-	nlh->nlmsg_flags = 0;
+	rt_thread_setup();
 
-	m = NLMSG_DATA(nlh);
-	memcpy(m, msg, sizeof(*m) + msg->len);
+	while (1) {
+		pthread_mutex_lock(&queue_lock);
+		while (!queue_head && !need_exit)
+			pthread_cond_wait(&queue_cond, &queue_lock);
 
-	err = send(s, nlh, size, 0);
-	if (err == -1)
-		ulog(LOG_ERR, "Failed to send: %s [%d].\n", strerror(errno), errno);
+		if (need_exit) {
+			pthread_mutex_unlock(&queue_lock);
+			break;
+		}
 
-	return err;
+		r = queue_head;
+		queue_head = r->next;
+		if (!queue_head)
+			queue_tail = NULL;
+		pthread_mutex_unlock(&queue_lock);
+
+		tsk = (struct uvesafb_task*)(&r->msg + 1);
+		regs = tsk->regs;
+
+		if (tsk->flags & TF_BATCH) {
+			err = batch_exec(&r->msg, r->t);
+		} else if (cache_get(tsk, r->msg.len)) {
+			/* An identical request has been served in the meantime. */
+			xport->send(&r->msg);
+			err = 0;
+		} else {
+			err = req_exec(&r->msg);
+		}
+
+		if (err) {
+			free(r);
+			need_exit = 1;
+			pthread_kill(main_thread, SIGTERM);
+			break;
+		}
+
+		/* The tasks of a batch are accounted for by batch_exec(). */
+		if (!(tsk->flags & TF_BATCH))
+			req_done(&regs, r->msg.seq, r->t);
+		free(r);
+	}
+
+	return NULL;
 }
 
-int req_exec(int s, struct cn_msg *msg)
+static void worker_stop(void)
+{
+	struct req *r;
+
+	pthread_mutex_lock(&queue_lock);
+	need_exit = 1;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	pthread_join(worker_thread, NULL);
+
+	while ((r = queue_head)) {
+		queue_head = r->next;
+		free(r);
+	}
+}
+#endif
+
+/*
+ * Handle a request from the kernel.  Cache hits and capability queries
+ * are answered right away, everything else, including whole batches,
+ * is passed on to the emulator.  Returns non-zero if v86d should exit.
+ */
+static int req_dispatch(struct cn_msg *msg, u64 t)
 {
 	struct uvesafb_task *tsk = (struct uvesafb_task*)(msg + 1);
-	u8 *buf = (u8*)tsk + sizeof(struct uvesafb_task);
+	struct v86_regs regs;
 
+	/* Too short to carry a task or a batch header, and a reply. */
+	if (msg->len < sizeof(*tsk)) {
+		ulog(LOG_WARNING, "Malformed request of %u bytes dropped.\n", msg->len);
+		return 0;
+	}
+
+	regs = tsk->regs;
 	if (tsk->flags & TF_EXIT)
 		return 1;
 
-	if (v86_task(tsk, buf))
-		return 2;
+	if (tsk->flags & TF_CAPS) {
+		caps_reply(msg);
+		return 0;
+	}
+
+	if (tsk->flags & TF_BATCH) {
+#ifdef CONFIG_THREADS
+		return queue_push(msg, t);
+#else
+		return batch_exec(msg, t);
+#endif
+	}
+
+	/* The buffer is copied in and out of the guest memory. */
+	if (tsk->buf_len < 0 || msg->len != sizeof(*tsk) + tsk->buf_len) {
+		ulog(LOG_WARNING, "Malformed task of %u bytes rejected.\n", msg->len);
+		tsk->regs.eax = 0x014f;
+		xport->send(msg);
+		return 0;
+	}
 
-	netlink_send(s, msg);
+	v86_trace(TR_REQ_BEGIN, 0, regs.eax, msg->seq);
 
+	if (cache_get(tsk, msg->len)) {
+		xport->send(msg);
+		req_done(&regs, msg->seq, t);
+		return 0;
+	}
+
+#ifdef CONFIG_THREADS
+	return queue_push(msg, t);
+#else
+	if (req_exec(msg))
+		return 1;
+
+	req_done(&regs, msg->seq, t);
 	return 0;
+#endif
 }
 
+static void sig_exit(int sig)
+{
+	need_exit = 1;
+}
+
+/*
+ * Called periodically during long BIOS calls.  Serves the control
+ * socket (unless the main thread takes care of it) and aborts the call
+ * if we have been asked to exit.
+ */
+static int v86d_yield(void)
+{
+#ifndef CONFIG_THREADS
+	struct pollfd pfd[CTL_MAX_CLIENTS + 1];
+	int n;
+
+	n = ctl_fds(pfd);
+	if (n && poll(pfd, n, 0) > 0)
+		ctl_handle(pfd, n);
+#endif
+
+	return need_exit;
+}
+
+/* Parse a decimal number in the range min - max. */
+static int parse_int(const char *s, int min, int max, int *val)
+{
+	char *end;
+	long v;
+
+	errno = 0;
+	v = strtol(s, &end, 10);
+	if (errno || end == s || *end || v < min || v > max)
+		return -1;
+
+	*val = v;
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: v86d [-c <control socket>] [-t <trace file>] "
+			"[-T <trace events>]\n"
+			"            [-i <max instructions per call>] "
+			"[-l <max ms per call>] [-r <recording>]\n"
+			"            [-m <memory image>] [-I <port policies>] "
+			"[-u <request socket>]\n"
+			"            [-e <mode enumeration workers>] [-M] "
+			"[-b <bus:dev.fn> [-R <ROM image>]]\n"
+			"            [-V shared|private|wc] [-Q <query socket>] "
+			"[-H [-a <cpu>] [-p <priority>]]\n"
+			"            [-F <folded stacks> [-f <period>] "
+			"[-Y <symbol map>]] [-A]\n"
+			"            [-L <slow task threshold in us>]\n");
+}
 
 int main(int argc, char *argv[])
 {
 	char buf[CONNECTOR_MAX_MSG_SIZE];
-	int len, i, err = 0, s;
-	struct nlmsghdr *reply;
-	struct sockaddr_nl l_local;
+	int i, err = 0;
 	struct cn_msg *data;
-	struct pollfd pfd;
+	struct pollfd pfd[1 + CTL_MAX_CLIENTS + 1 + QUERY_MAX_CLIENTS + 1];
+	char *ctl_path = NULL, *trace_path = NULL, *rec_path = NULL;
+	char *xport_arg = NULL, *query_path = NULL;
+	char *prof_path = NULL, *prof_map = NULL;
+	u32 prof_every = 1000;
+	u32 trace_size = V86_TRACE_DEF_SIZE;
+	u32 limit_insns = 0, limit_ms = 0;
+	int enum_workers = -1, post = -1;
+	int harden = 0, rt_cpu = -1, rt_prio = 0, nctl, val;
+	unsigned int bus, dev, fn;
+	u64 t;
+
+	while ((i = getopt(argc, argv, "c:t:T:i:l:r:m:I:u:e:Mb:R:V:Q:Ha:p:F:f:Y:AL:")) != -1) {
+		switch (i) {
+		case 'c':
+			ctl_path = optarg;
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'T':
+			if (parse_int(optarg, 1, INT_MAX, &val)) {
+				fprintf(stderr, "Invalid trace size: %s\n", optarg);
+				return -1;
+			}
+			trace_size = val;
+			break;
+		case 'i':
+			if (parse_int(optarg, 1, INT_MAX, &val)) {
+				fprintf(stderr, "Invalid instruction limit: %s\n",
+						optarg);
+				return -1;
+			}
+			limit_insns = val;
+			break;
+		case 'l':
+			if (parse_int(optarg, 1, INT_MAX, &val)) {
+				fprintf(stderr, "Invalid time limit: %s\n", optarg);
+				return -1;
+			}
+			limit_ms = val;
+			break;
+		case 'r':
+			rec_path = optarg;
+			break;
+		case 'm':
+			if (v86_mem_set_image(optarg)) {
+				fprintf(stderr, "Failed to open the memory image %s.\n", optarg);
+				return -1;
+			}
+			break;
+		case 'I':
+			if (v86_pio_config(optarg)) {
+				fprintf(stderr, "Invalid port I/O policy: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'u':
+			xport = &xport_unix;
+			xport_arg = optarg;
+			break;
+		case 'e':
+			if (parse_int(optarg, 1, RT_MAX_CPUS, &enum_workers)) {
+				fprintf(stderr, "Invalid number of workers: %s\n",
+						optarg);
+				return -1;
+			}
+			break;
+		case 'M':
+			if (v86_mset_init())
+				return -1;
+			break;
+		case 'b':
+			if (sscanf(optarg, "%x:%x.%x", &bus, &dev, &fn) != 3) {
+				usage();
+				return -1;
+			}
+			post = (bus << 8) | (dev << 3) | fn;
+			break;
+		case 'R':
+			if (v86_mem_set_rom(optarg))
+				return -1;
+			break;
+		case 'V':
+			if (v86_mem_set_vram(optarg))
+				return -1;
+			break;
+		case 'Q':
+			query_path = optarg;
+			break;
+		case 'H':
+			harden = 1;
+			break;
+		case 'a':
+			if (parse_int(optarg, 0, RT_MAX_CPUS - 1, &rt_cpu)) {
+				fprintf(stderr, "Invalid CPU: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'p':
+			if (parse_int(optarg, 1, RT_MAX_PRIO, &rt_prio)) {
+				fprintf(stderr, "Invalid priority: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'F':
+			prof_path = optarg;
+			break;
+		case 'f':
+			if (parse_int(optarg, 1, INT_MAX, &val)) {
+				fprintf(stderr, "Invalid sampling period: %s\n",
+						optarg);
+				return -1;
+			}
+			prof_every = val;
+			break;
+		case 'Y':
+			prof_map = optarg;
+			break;
+		case 'A':
+			if (v86_heat_init())
+				return -1;
+			break;
+		case 'L':
+			if (parse_int(optarg, 1, INT_MAX, &val)) {
+				fprintf(stderr, "Invalid slow task threshold: %s\n",
+						optarg);
+				return -1;
+			}
+			v86_set_slow_log(val);
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (!harden && (rt_cpu >= 0 || rt_prio)) {
+		fprintf(stderr, "-a and -p require -H.\n");
+		return -1;
+	}
 
-	s = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_CONNECTOR);
-	if (s == -1) {
-		perror("socket");
+	if (xport->open(xport_arg))
 		return -1;
+
+	if (ctl_path) {
+		if (ctl_init(ctl_path)) {
+			perror("control socket");
+			xport->close();
+			return -1;
+		}
 	}
 
-	l_local.nl_family = AF_NETLINK;
-	l_local.nl_groups = 1 << (CN_IDX_V86D-1); /* bitmask of requested groups */
-	l_local.nl_pid = 0;
+	if (trace_path && v86_trace_init(trace_path, trace_size)) {
+		fprintf(stderr, "Failed to set up the trace ring at %s.\n", trace_path);
+		ctl_cleanup();
+		xport->close();
+		return -1;
+	}
+
+	if (query_path && query_init(query_path)) {
+		perror("query socket");
+		v86_trace_cleanup();
+		ctl_cleanup();
+		xport->close();
+		return -1;
+	}
 
-	if (bind(s, (struct sockaddr *)&l_local, sizeof(struct sockaddr_nl)) == -1) {
-		perror("bind");
-		close(s);
+	if (prof_path && v86_prof_init(prof_path, prof_every, prof_map)) {
+		fprintf(stderr, "Failed to set up the profiler.\n");
+		query_cleanup();
+		v86_trace_cleanup();
+		ctl_cleanup();
+		xport->close();
 		return -1;
 	}
 
@@ -98,18 +583,63 @@ int main(int argc, char *argv[])
 
 	openlog("v86d", 0, LOG_KERN);
 
+	signal(SIGTERM, sig_exit);
+	signal(SIGINT, sig_exit);
+
 	if (v86_init())
 		return -1;
 
+	if (post >= 0) {
+		if (v86_post(post)) {
+			v86_cleanup();
+			return -1;
+		}
+
+		v86_post_dump(buf, sizeof(buf));
+		ulog(LOG_INFO, "Video BIOS initialized:\n%s", buf);
+	}
+
+	if (rec_path && v86_rec_init(rec_path, REC_RECORD)) {
+		v86_cleanup();
+		return -1;
+	}
+
+	if (limit_insns || limit_ms)
+		v86_set_limits(limit_insns, limit_ms, v86d_yield);
+
+	/* Has to be done before the worker thread is started. */
+	if (enum_workers >= 0)
+		v86_enum_modes(enum_workers);
+
+	/* Ditto, the worker inherits the CPU affinity and the priority. */
+	if (harden && rt_setup(rt_cpu, rt_prio)) {
+		v86_rec_cleanup();
+		v86_cleanup();
+		return -1;
+	}
+
+#ifdef CONFIG_THREADS
+	main_thread = pthread_self();
+	if (pthread_create(&worker_thread, NULL, worker, NULL)) {
+		ulog(LOG_ERR, "Failed to start the worker thread.\n");
+		v86_rec_cleanup();
+		v86_cleanup();
+		return -1;
+	}
+#endif
+
 	memset(buf, 0, sizeof(buf));
-	pfd.fd = s;
 
 	while (!need_exit) {
-		pfd.events = POLLIN;
-		pfd.revents = 0;
-		switch (poll(&pfd, 1, -1)) {
+		pfd[0].fd = xport->fd();
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		nctl = ctl_fds(pfd + 1);
+		i = 1 + nctl + query_fds(pfd + 1 + nctl);
+
+		/* Wake up now and then to drop silent control clients. */
+		switch (poll(pfd, i, ctl_path ? CTL_TIMEOUT : -1)) {
 			case 0:
-				need_exit = 1;
 				continue;
 			case -1:
 				if (errno != EINTR) {
@@ -119,40 +649,35 @@ int main(int argc, char *argv[])
 				continue;
 		}
 
+		ctl_handle(pfd + 1, nctl);
+		query_handle(pfd + 1 + nctl, i - 1 - nctl);
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
 		memset(buf, 0, sizeof(buf));
-		len = recv(s, buf, sizeof(buf), 0);
-		if (len == -1) {
-			perror("recv buf");
+		i = xport->recv(buf, sizeof(buf), &data);
+		t = v86_time_us();
+		if (i == -1) {
 			err = -1;
 			goto out;
 		}
 
-		reply = (struct nlmsghdr *)buf;
-
-		/* Ignore requests coming from outside the kernel. */
-		if (reply->nlmsg_pid != 0) {
-			continue;
-		}
-
-		switch (reply->nlmsg_type) {
-		case NLMSG_ERROR:
-			ulog(LOG_ERR, "Error message received.\n");
-			break;
-
-		case NLMSG_DONE:
-			data = (struct cn_msg *)NLMSG_DATA(reply);
-			if (req_exec(s, data))
-				goto out;
-			break;
-		default:
-			break;
-		}
+		if (i && req_dispatch(data, t))
+			goto out;
 	}
 
 out:
+#ifdef CONFIG_THREADS
+	worker_stop();
+#endif
+	v86_rec_cleanup();
 	v86_cleanup();
 
 	closelog();
-	close(s);
+	query_cleanup();
+	ctl_cleanup();
+	v86_trace_cleanup();
+	xport->close();
 	return err;
 }
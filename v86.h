@@ -7,6 +7,15 @@
 #include <linux/connector.h>
 #include "config.h"
 
+/* klibc doesn't provide pthreads */
+#if defined(CONFIG_THREADS) && defined(CONFIG_KLIBC)
+#undef CONFIG_THREADS
+#endif
+
+#ifdef CONFIG_THREADS
+#include <pthread.h>
+#endif
+
 #undef u8
 #undef u16
 #undef u32
@@ -35,9 +44,27 @@ struct completion;
 
 int v86_init();
 int v86_int(int num, struct v86_regs *regs);
+int v86_call(u16 seg, u16 off, struct v86_regs *regs);
 int v86_task(struct uvesafb_task *tsk, u8 *buf);
+void v86_set_limits(u32 insns, u32 ms, int (*yield)(void));
+void v86_set_fast_delays(int on);
+int v86_post(u16 bdf);
+int v86_post_dump(char *buf, int size);
+u64 v86_time_us(void);
 void v86_cleanup();
 
+int v86_heat_init(void);
+void v86_heat_read(u32 addr, int size);
+void v86_heat_write(u32 addr, int size);
+int v86_heat_dump(char *buf, int size);
+void v86_heat_reset(void);
+
+int v86_prof_init(const char *path, u32 period, const char *map);
+int v86_prof_write(void);
+int v86_prof_dump(char *buf, int size);
+void v86_prof_reset(void);
+void v86_prof_cleanup(void);
+
 #define IVTBDA_BASE			0x00000
 #define IVTBDA_SIZE			0x01000
 #define DEFAULT_STACK_SIZE	0x02000
@@ -51,9 +78,33 @@ void v86_cleanup();
 #define VBIOS_BASE			0xc0000
 
 u32 v86_mem_alloc(int size);
-void v86_mem_free(u32 m);
+u32 v86_mem_alloc_static(int size);
+void v86_mem_reset(void);
 int v86_mem_init(void);
 void v86_mem_cleanup(void);
+void v86_mem_save(void);
+void v86_mem_restore(void);
+int v86_mem_set_loader(int (*load)(u32 addr, u32 size, void *dest));
+int v86_mem_set_image(const char *path);
+int v86_mem_set_rom(const char *path);
+int v86_mem_set_vram(const char *policy);
+void v86_mem_vram_sync(void);
+int v86_mem_vram_dump(char *buf, int size);
+int v86_mem_dump(int (*put)(u32 addr, u32 size, void *data));
+void v86_mem_prefault(void);
+int v86_mem_unshare(void);
+int v86_mem_region(u32 addr);
+int v86_mem_region_shared(int region);
+
+/* Memory regions, see vptr() */
+#define MEM_R_IVTBDA	0
+#define MEM_R_REAL		1
+#define MEM_R_EBDA		2
+#define MEM_R_VRAM		3
+#define MEM_R_VBIOS		4
+#define MEM_R_SBIOS		5
+#define MEM_R_NONE		6		/* not mapped */
+#define MEM_REGIONS		7
 
 u8 v_rdb(u32 addr);
 u16 v_rdw(u32 addr);
@@ -63,6 +114,240 @@ void v_wrw(u32 addr, u16 val);
 void v_wrl(u32 addr, u32 val);
 void *vptr(u32 addr);
 
+/* Reasons for memory writes to be reported (x86emu only). */
+#define MEM_HOOK_MSET	0x01	/* recording a mode set */
+#define MEM_HOOK_VRAM	0x02	/* VGA window not shared, see v86_mem_set_vram() */
+#define MEM_HOOK_HEAT	0x04	/* counting accesses, see v86_heat_init() */
+
+/* VGA window policies */
+#define VRAM_SHARED		0
+#define VRAM_PRIVATE	1
+#define VRAM_WC			2
+
+struct v86_vram_stats {
+	u64 writes;			/* writes to the window */
+	u64 stale;			/* bytes read that the BIOS hadn't written */
+	u64 hw_reads;		/* reads passed to the hardware */
+	u64 flushes;
+	u64 flushed;		/* bytes flushed to the hardware */
+};
+
+extern struct v86_vram_stats vram_stats;
+
+extern int mem_hooks;
+
+extern int v86_tracing;
+
+/*
+ * Cost of the last task run by v86_task().  The times are in TSC cycles:
+ * tsc_emu is spent running BIOS code, tsc_io the part of it spent doing
+ * port I/O, and the rest of tsc_total is the host side of the task, such
+ * as setting up and copying the buffers.
+ */
+struct v86_cost {
+	u64 insns;			/* instructions executed (x86emu only) */
+	u64 ints;			/* software interrupts taken */
+	u64 pio_in;			/* port reads (x86emu only) */
+	u64 pio_out;		/* port writes (x86emu only) */
+	u64 bytes_in;		/* copied into the guest memory */
+	u64 bytes_out;		/* copied out of it */
+	u64 tsc_emu;
+	u64 tsc_io;
+	u64 tsc_total;
+};
+
+extern struct v86_cost v86_cost;
+
+void v86_set_slow_log(u32 us);
+u64 v86_tsc_hz(void);
+
+void v86_stats_add(struct v86_regs *regs, u32 us);
+void v86_stats_cost(struct v86_regs *regs, struct v86_cost *cost);
+void v86_stats_reset(void);
+int v86_stats_dump(char *buf, int size, int fmt);
+
+#define STATS_FMT_TEXT	0
+#define STATS_FMT_CSV	1
+#define STATS_FMT_COST	2		/* average cost per function, as a table */
+
+int cache_able(struct uvesafb_task *tsk);
+int cache_get(struct uvesafb_task *tsk, int len);
+void cache_put(struct uvesafb_task *req, struct uvesafb_task *rep);
+void cache_flush(void);
+
+int v86_enum_modes(int workers);
+
+extern int mset_enabled;
+
+int v86_mset_init(void);
+int v86_mset_start(struct uvesafb_task *tsk, u8 *buf);
+void v86_mset_end(struct uvesafb_task *tsk, u8 *buf, int err);
+void v86_mset_pio(int out, u16 port, int size, u32 val);
+void v86_mset_mem(u32 addr, int size, u32 val);
+int v86_mset_dump(char *buf, int size);
+void v86_mset_flush(void);
+
+/*
+ * Reasons for port I/O to be passed to v86_pio_in/out() instead of
+ * going straight to the hardware (x86emu only).
+ */
+#define PIO_HOOK_REC	0x01	/* recording or replaying */
+#define PIO_HOOK_VIRT	0x02	/* no hardware, see v86_mem_set_image() */
+#define PIO_HOOK_TABLE	0x04	/* port policies set, see v86_pio_config() */
+#define PIO_HOOK_MSET	0x08	/* recording a mode set */
+#define PIO_HOOK_DELAY	0x10	/* see v86_set_fast_delays() */
+#define PIO_HOOK_VRAM	0x20	/* flush the VGA window, see v86_mem_set_vram() */
+
+extern int pio_hooks;
+
+/* Delays skipped by v86_set_fast_delays() */
+struct v86_delays {
+	u32 waits;			/* INT 15h/86h calls */
+	u64 wait_us;		/* time they asked for */
+	u32 refresh;		/* reads of the refresh toggle */
+};
+
+extern struct v86_delays v86_delays;
+
+/* Port I/O policies */
+#define PIO_PASS		0		/* go to the hardware */
+#define PIO_VIRT		1		/* handled by a device model */
+#define PIO_CACHE		2		/* reads served from memory after the first */
+#define PIO_DISCARD		3		/* no hardware access */
+#define PIO_POLICIES	4
+
+#define PIO_PORTS		0x10000
+
+struct pio_port {
+	u8 policy;
+	u8 dev;			/* index of the virtual device, 0 = none */
+	u8 cval;		/* PIO_CACHE, PIO_DISCARD: last value */
+	u8 cvalid;
+};
+
+extern struct pio_port pio_ports[PIO_PORTS];
+
+/*
+ * A virtual device.  Wider accesses are split into byte accesses,
+ * unless the device cares about the access size and sets in/out.  A
+ * device needs either inb/outb or in/out; byte accesses go to in/out
+ * with a size of 1 if there are no inb/outb.
+ */
+struct pio_dev {
+	const char *name;
+	u8 (*inb)(u16 port);
+	void (*outb)(u16 port, u8 val);
+	u32 (*in)(u16 port, int size);
+	void (*out)(u16 port, int size, u32 val);
+};
+
+struct pio_stat {
+	u64 count;
+	u64 cycles;			/* TSC cycles spent doing the accesses */
+};
+
+extern struct pio_stat pio_stats[PIO_POLICIES];
+extern u64 pio_run_cycles;
+
+void pio_stats_add(int policy, u64 cycles);
+void pio_run_add(u64 cycles);
+
+int pio_register(u16 first, u16 last, struct pio_dev *dev);
+int pio_policy(u16 port);
+u32 pio_virt_in(u16 port, int size);
+void pio_virt_out(u16 port, int size, u32 value);
+int pio_cache_in(u16 port, int size, int policy, u32 *value);
+void pio_cache_put(u16 port, int size, u32 value);
+void pio_cache_drop(u16 port, int size);
+int v86_pio_config(const char *spec);
+int v86_pio_dump(char *buf, int size);
+void v86_pio_reset(void);
+int v86_vga_init(void);
+int v86_pci_init(void);
+int v86_pci_dump(char *buf, int size);
+void v86_pci_reset(void);
+
+/* Record/replay modes */
+#define REC_OFF			0
+#define REC_RECORD		1
+#define REC_REPLAY		2
+
+extern int rec_mode;
+
+int v86_rec_init(const char *path, int mode);
+void v86_rec_cleanup(void);
+void v86_rec_task(struct uvesafb_task *tsk, u8 *buf);
+void v86_rec_reply(struct uvesafb_task *tsk, u8 *buf, int err);
+u32 v86_rec_pio(int out, u16 port, int size, u32 val);
+struct uvesafb_task *v86_rec_next(void);
+int v86_rec_check(struct uvesafb_task *tsk, u8 *buf, int failed);
+void v86_rec_rewind(void);
+
+/*
+ * A request transport.  recv() returns 1 and points 'msg' into 'buf' if
+ * a request has been received, 0 if there is nothing to handle and -1
+ * on fatal errors.  fd() is the descriptor to wait on before calling
+ * recv(), and it can change between calls.
+ */
+struct v86_xport {
+	const char *name;
+	int (*open)(const char *arg);
+	int (*fd)(void);
+	int (*recv)(char *buf, int size, struct cn_msg **msg);
+	int (*send)(struct cn_msg *msg);
+	void (*close)(void);
+};
+
+extern struct v86_xport xport_netlink;
+extern struct v86_xport xport_unix;
+
+/*
+ * Protocol extensions, in task flags the kernel doesn't use.  Senders
+ * should only use them after checking the capabilities: a TF_CAPS task
+ * with eax = 0x4fff is answered with eax = 0x004f and the V86D_CAP_*
+ * bits in ebx.  Versions of v86d without the extensions run it as an
+ * ordinary call of the nonexistent VBE function FFh, which fails.
+ *
+ * A TF_BATCH task (eax = 0x4fff, too) is followed by ecx tasks, each
+ * with its own buffer, and buf_len is their total size.  The tasks are
+ * run in order and answered with a single message of the same layout,
+ * every task replaced with its reply.  The header of the reply has
+ * eax = 0x004f and ecx set to the number of tasks, or eax = 0x014f if
+ * the batch is malformed and no task has been run.  A batch has to fit
+ * into CONNECTOR_MAX_MSG_SIZE.
+ */
+#define TF_CAPS			0x40
+#define TF_BATCH		0x80
+
+#define V86D_CAP_BATCH	0x01
+#define V86D_CAPS		V86D_CAP_BATCH
+
+#define BATCH_MAX_TASKS	256
+
+#define CTL_MAX_CLIENTS		4
+#define CTL_TIMEOUT			1000	/* ms */
+
+struct pollfd;
+
+int ctl_init(const char *path);
+int ctl_fds(struct pollfd *pfd);
+void ctl_handle(struct pollfd *pfd, int n);
+void ctl_cleanup(void);
+
+#define QUERY_MAX_CLIENTS	8
+
+int query_init(const char *path);
+int query_fds(struct pollfd *pfd);
+void query_handle(struct pollfd *pfd, int n);
+void query_note(struct v86_regs *req, struct uvesafb_task *tsk, u8 *buf);
+void query_cleanup(void);
+
+#define RT_MAX_CPUS	1024		/* CPU_SETSIZE of glibc */
+#define RT_MAX_PRIO	99		/* SCHED_FIFO on Linux */
+
+int rt_setup(int cpu, int prio);
+void rt_thread_setup(void);
+
 extern int iopl (int __level);
 extern int ioperm (unsigned long int __from, unsigned long int __num,
 					int __turn_on);
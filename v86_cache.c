@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+#include "v86.h"
+
+/*
+ * Reply cache for side-effect-free BIOS calls.  The key is the complete
+ * task (flags, registers and the input buffer), the value is the task
+ * and buffer as they were sent back to the kernel.
+ */
+
+#define CACHE_SLOTS		256
+
+struct cache_ent {
+	u32 hash;
+	int len;		/* length of the request and of the reply */
+	u8 *req;
+	u8 *rep;
+};
+
+static struct cache_ent cache[CACHE_SLOTS];
+
+#ifdef CONFIG_THREADS
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CACHE_LOCK()	pthread_mutex_lock(&cache_lock)
+#define CACHE_UNLOCK()	pthread_mutex_unlock(&cache_lock)
+#else
+#define CACHE_LOCK()	do {} while (0)
+#define CACHE_UNLOCK()	do {} while (0)
+#endif
+
+static u32 fnv1a(u32 h, const void *data, int len)
+{
+	const u8 *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619;
+	}
+
+	return h;
+}
+
+/* Hash the task without the padding that follows the flags field. */
+static u32 cache_hash(struct uvesafb_task *tsk)
+{
+	u32 h = 2166136261u;
+
+	h = fnv1a(h, &tsk->flags, sizeof(tsk->flags));
+	h = fnv1a(h, &tsk->buf_len, sizeof(tsk->buf_len));
+	h = fnv1a(h, &tsk->regs, sizeof(tsk->regs));
+	return fnv1a(h, tsk + 1, tsk->buf_len);
+}
+
+static int cache_match(struct uvesafb_task *a, struct uvesafb_task *b)
+{
+	return a->flags == b->flags && a->buf_len == b->buf_len &&
+		   !memcmp(&a->regs, &b->regs, sizeof(a->regs)) &&
+		   !memcmp(a + 1, b + 1, a->buf_len);
+}
+
+/*
+ * Only calls which neither change the state of the hardware nor depend
+ * on it can be answered from the cache.
+ */
+int cache_able(struct uvesafb_task *tsk)
+{
+	u16 ax = tsk->regs.eax & 0xffff;
+	u8 bl = tsk->regs.ebx & 0xff;
+
+	if (tsk->flags & (TF_EXIT | TF_CAPS | TF_BATCH))
+		return 0;
+
+	switch (ax) {
+	case 0x4f00:		/* controller info */
+	case 0x4f01:		/* mode info */
+		return 1;
+	case 0x4f04:		/* save/restore state: buffer size query */
+	case 0x4f0a:		/* protected mode interface */
+	case 0x4f15:		/* DDC: capabilities */
+		return bl == 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Look up the reply to the task 'tsk', 'len' bytes long including its
+ * buffer.  On a hit, the task is replaced with the cached reply and 1
+ * is returned.  The cn_msg header is left untouched, so that the reply
+ * carries the seq/ack of the request it answers.
+ */
+int cache_get(struct uvesafb_task *tsk, int len)
+{
+	struct cache_ent *e;
+	u32 h;
+	int hit = 0;
+
+	if (!cache_able(tsk) || len != sizeof(*tsk) + tsk->buf_len)
+		return 0;
+
+	h = cache_hash(tsk);
+	e = &cache[h % CACHE_SLOTS];
+
+	CACHE_LOCK();
+	if (e->req && e->hash == h && e->len == len &&
+		cache_match((struct uvesafb_task *)e->req, tsk)) {
+		memcpy(tsk, e->rep, e->len);
+		hit = 1;
+	}
+	CACHE_UNLOCK();
+
+	return hit;
+}
+
+/*
+ * Store the reply 'rep' to the request 'req'.  'req' is the task as
+ * received from the kernel, both are followed by their buffers.
+ */
+void cache_put(struct uvesafb_task *req, struct uvesafb_task *rep)
+{
+	struct cache_ent *e;
+	int len = sizeof(*req) + req->buf_len;
+	u8 *r, *p;
+	u32 h;
+
+	if (rep->buf_len != req->buf_len)
+		return;
+
+	r = malloc(len);
+	p = malloc(len);
+	if (!r || !p) {
+		free(r);
+		free(p);
+		return;
+	}
+
+	memcpy(r, req, len);
+	memcpy(p, rep, len);
+	h = cache_hash(req);
+	e = &cache[h % CACHE_SLOTS];
+
+	CACHE_LOCK();
+	free(e->req);
+	free(e->rep);
+	e->hash = h;
+	e->len = len;
+	e->req = r;
+	e->rep = p;
+	CACHE_UNLOCK();
+}
+
+void cache_flush(void)
+{
+	int i;
+
+	CACHE_LOCK();
+	for (i = 0; i < CACHE_SLOTS; i++) {
+		free(cache[i].req);
+		free(cache[i].rep);
+		cache[i].req = cache[i].rep = NULL;
+	}
+	CACHE_UNLOCK();
+}
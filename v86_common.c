@@ -1,5 +1,6 @@
 #include <string.h>
 #include "v86.h"
+#include "v86_trace.h"
 
 #define addr(t) (((t & 0xffff0000) >> 12) + (t & 0x0000ffff))
 
@@ -30,15 +31,40 @@
 		fsize = 0;								\
 }
 
-int v86_task(struct uvesafb_task *tsk, u8 *buf)
+int pio_hooks;
+int mset_enabled;
+
+struct v86_cost v86_cost;
+
+/* Tasks taking longer than this are logged, 0 = none */
+static u32 slow_us;
+static u64 slow_tsc;
+
+static void v86_task_log(struct uvesafb_task *tsk)
 {
-	u32 lbuf = 0;
+	/* Stay away from syslog when the trace ring is available. */
+	if (trace_ring) {
+		v86_trace(TR_REG, 1, TR_REG_FLAGS, tsk->flags);
+		v86_trace(TR_REG, 4, TR_REG_EAX, tsk->regs.eax);
+		v86_trace(TR_REG, 4, TR_REG_EBX, tsk->regs.ebx);
+		v86_trace(TR_REG, 4, TR_REG_ECX, tsk->regs.ecx);
+		v86_trace(TR_REG, 4, TR_REG_EDX, tsk->regs.edx);
+		v86_trace(TR_REG, 4, TR_REG_ESI, tsk->regs.esi);
+		v86_trace(TR_REG, 4, TR_REG_EDI, tsk->regs.edi);
+		v86_trace(TR_REG, 2, TR_REG_ES, tsk->regs.es);
+		return;
+	}
 
 	ulog(LOG_DEBUG, "task flags: 0x%02x\n", tsk->flags);
 	ulog(LOG_DEBUG, "EAX=0x%08x EBX=0x%08x ECX=0x%08x EDX=0x%08x\n",
 		 tsk->regs.eax, tsk->regs.ebx, tsk->regs.ecx, tsk->regs.edx);
 	ulog(LOG_DEBUG, "ESP=0x%08x EBP=0x%08x ESI=0x%08x EDI=0x%08x\n",
 		 tsk->regs.esp, tsk->regs.ebp, tsk->regs.esi, tsk->regs.edi);
+}
+
+static int v86_task_run(struct uvesafb_task *tsk, u8 *buf)
+{
+	u32 lbuf = 0;
 
 	/* Get the VBE Info Block */
 	if (tsk->flags & TF_VBEIB) {
@@ -54,6 +80,7 @@ int v86_task(struct uvesafb_task *tsk, u8 *buf)
 			return -1;
 		}
 		memcpy(vptr(lbuf), buf, tsk->buf_len);
+		v86_cost.bytes_in += tsk->buf_len;
 		tsk->regs.es  = lbuf >> 4;
 		tsk->regs.edi = 0x0000;
 
@@ -63,6 +90,7 @@ int v86_task(struct uvesafb_task *tsk, u8 *buf)
 		ib = (struct vbe_ib*)buf;
 		bufend = lbuf + sizeof(*ib);
 		memcpy(buf, vptr(lbuf), tsk->buf_len);
+		v86_cost.bytes_out += tsk->buf_len;
 
 		/* The original VBE Info Block is 512 bytes long. */
 		fsize = tsk->buf_len - 512;
@@ -119,7 +147,7 @@ int v86_task(struct uvesafb_task *tsk, u8 *buf)
 		vbeib_get_string(oem_product_name_ptr);
 		vbeib_get_string(oem_product_rev_ptr);
 out_vbeib:
-		v86_mem_free(lbuf);
+		v86_mem_reset();
 	} else {
 		if (tsk->buf_len) {
 			lbuf = v86_mem_alloc(tsk->buf_len);
@@ -128,6 +156,7 @@ out_vbeib:
 				return -1;
 			}
 			memcpy(vptr(lbuf), buf, tsk->buf_len);
+			v86_cost.bytes_in += tsk->buf_len;
 		}
 
 		if (tsk->flags & TF_BUF_ESDI) {
@@ -145,12 +174,161 @@ out_vbeib:
 
 		if (tsk->buf_len && tsk->flags & TF_BUF_RET) {
 			memcpy(buf, vptr(lbuf), tsk->buf_len);
+			v86_cost.bytes_out += tsk->buf_len;
 		}
 out:
-		if (tsk->buf_len)
-			v86_mem_free(lbuf);
+		v86_mem_reset();
+	}
+
+	return 0;
+}
+
+/*
+ * Log tasks taking longer than 'us' microseconds, along with their cost
+ * (see struct v86_cost).  0 turns the log off.
+ */
+void v86_set_slow_log(u32 us)
+{
+	slow_us = us;
+	slow_tsc = (u64)us * v86_tsc_hz() / 1000000;
+}
+
+static void v86_slow_log(struct v86_regs *regs)
+{
+	struct v86_cost *c = &v86_cost;
+	u64 hz = v86_tsc_hz();
+
+	ulog(LOG_WARNING, "Slow task %04x: %llu us, emulation %llu us, "
+		 "port I/O %llu us, host %llu us, %llu insns, %llu ints, "
+		 "%llu/%llu port reads/writes, %llu/%llu bytes in/out\n",
+		 regs->eax & 0xffff,
+		 (unsigned long long)(c->tsc_total * 1000000 / hz),
+		 (unsigned long long)((c->tsc_emu - c->tsc_io) * 1000000 / hz),
+		 (unsigned long long)(c->tsc_io * 1000000 / hz),
+		 (unsigned long long)((c->tsc_total - c->tsc_emu) * 1000000 / hz),
+		 (unsigned long long)c->insns, (unsigned long long)c->ints,
+		 (unsigned long long)c->pio_in, (unsigned long long)c->pio_out,
+		 (unsigned long long)c->bytes_in, (unsigned long long)c->bytes_out);
+}
+
+int v86_task(struct uvesafb_task *tsk, u8 *buf)
+{
+	struct v86_regs regs = tsk->regs;
+	u64 t = v86_rdtsc();
+	int err;
+
+	memset(&v86_cost, 0, sizeof(v86_cost));
+	v86_task_log(tsk);
+
+	if (rec_mode)
+		v86_rec_task(tsk, buf);
+
+	if (mset_enabled && v86_mset_start(tsk, buf)) {
+		err = 0;
+		goto out;
+	}
+
+	err = v86_task_run(tsk, buf);
+
+	if (mset_enabled)
+		v86_mset_end(tsk, buf, err);
+
+	if (rec_mode)
+		v86_rec_reply(tsk, buf, err);
+
+out:
+	v86_cost.tsc_total = v86_rdtsc() - t;
+	if (slow_tsc && v86_cost.tsc_total > slow_tsc)
+		v86_slow_log(&regs);
+
+	return err;
+}
+
+struct v86_delays v86_delays;
+
+#define POST_PHASES	2
+
+static struct {
+	const char *name;
+	u64 us;
+} post_phases[POST_PHASES] = {
+	{ "init" }, { "vbe" },
+};
+
+/*
+ * POST the video adapter at PCI address 'bdf' (bus << 8 | devfn) by
+ * calling the initialization entry point of its option ROM at C000:0003,
+ * the way the system BIOS does for the primary adapter.  This is needed
+ * for secondary adapters and for adapters which lost their state in
+ * suspend.  Unless a ROM image is given with v86_mem_set_rom(), the ROM
+ * already shadowed at C0000 is used.
+ *
+ * Delays are short-circuited during the call.  The time taken by the
+ * initialization and by a first VBE call made to check that the adapter
+ * responds is kept for v86_post_dump().
+ */
+int v86_post(u16 bdf)
+{
+	struct v86_regs regs;
+	struct vbe_ib *ib;
+	u32 lbuf;
+	u64 t;
+	int err;
+
+	memset(&v86_delays, 0, sizeof(v86_delays));
+	memset(&regs, 0, sizeof(regs));
+	regs.eax = bdf;
+	regs.edx = 0xffff;
+
+	v86_set_fast_delays(1);
+	t = v86_time_us();
+	err = v86_call(VBIOS_BASE >> 4, 0x0003, &regs);
+	post_phases[0].us = v86_time_us() - t;
+	v86_set_fast_delays(0);
+
+	if (err) {
+		ulog(LOG_ERR, "Video BIOS initialization failed.\n");
+		return -1;
+	}
+
+	lbuf = v86_mem_alloc(sizeof(*ib));
+	if (!lbuf)
+		return -1;
+
+	ib = vptr(lbuf);
+	memset(ib, 0, sizeof(*ib));
+	memcpy(&ib->vbe_signature, "VBE2", 4);
+
+	memset(&regs, 0, sizeof(regs));
+	regs.eax = 0x4f00;
+	regs.es = lbuf >> 4;
+
+	t = v86_time_us();
+	err = v86_int(0x10, &regs);
+	post_phases[1].us = v86_time_us() - t;
+	v86_mem_reset();
+
+	if (err || (regs.eax & 0xffff) != 0x004f) {
+		ulog(LOG_ERR, "The adapter doesn't respond to VBE calls after POST "
+			 "(eax = %04x).\n", regs.eax & 0xffff);
+		return -1;
 	}
 
 	return 0;
 }
 
+int v86_post_dump(char *buf, int size)
+{
+	int i, len = 0;
+
+	for (i = 0; i < POST_PHASES && len < size; i++)
+		len += snprintf(buf + len, size - len, "%-6s %10llu us\n",
+				post_phases[i].name, (unsigned long long)post_phases[i].us);
+
+	if (len < size)
+		len += snprintf(buf + len, size - len, "\nskipped: %u INT 15h waits "
+				"(%llu us), %u refresh toggle reads\n", v86_delays.waits,
+				(unsigned long long)v86_delays.wait_us, v86_delays.refresh);
+
+	return (len < size) ? len : size - 1;
+}
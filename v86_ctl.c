@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <sys/un.h>
+
+#include "v86.h"
+
+/*
+ * The control socket is a local stream socket accepting one-line text
+ * commands:
+ *
+ *  stats      - print the per-function latency histograms
+ *  stats csv  - same, as comma-separated values
+ *  stats cost - print the average cost of the tasks run per function
+ *  reset      - clear the latency histograms
+ *  trace on   - log every request to syslog
+ *  trace off  - stop logging requests
+ *  flush      - empty the reply cache
+ *  io         - print the port I/O statistics
+ *  io reset   - clear the port I/O statistics
+ *  mset       - print the recorded mode sets
+ *  mset flush - forget the recorded mode sets
+ *  vram       - print the VGA window statistics
+ *  heat       - print the guest memory access counts
+ *  heat reset - clear the memory access counts
+ *  prof       - print the state of the call-stack profiler
+ *  prof write - write the folded stacks collected so far
+ *  prof reset - drop the collected samples
+ *
+ * The connections are served by the main thread from its poll set,
+ * without ever blocking on them: the kernel's requests must not wait
+ * for a slow or silent client.  Every connection carries one command,
+ * clients which haven't sent it within CTL_TIMEOUT are dropped.
+ */
+
+#define CTL_BUF_SIZE	65536
+
+static int ctl_listen = -1;
+static struct {
+	int fd;					/* -1 = free */
+	u64 t;					/* time of accept, in us */
+} ctl_conns[CTL_MAX_CLIENTS];
+static char ctl_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+int ctl_init(const char *path)
+{
+	struct sockaddr_un addr;
+	int s, i;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		ulog(LOG_ERR, "Control socket path too long: %s\n", path);
+		return -1;
+	}
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1) {
+		ulog(LOG_ERR, "Failed to create the control socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+		listen(s, 4) == -1) {
+		ulog(LOG_ERR, "Failed to bind the control socket to %s: %s\n",
+			 path, strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	for (i = 0; i < CTL_MAX_CLIENTS; i++)
+		ctl_conns[i].fd = -1;
+
+	strcpy(ctl_path, path);
+	ctl_listen = s;
+	return 0;
+}
+
+static int ctl_exec(char *cmd, char *out, int size)
+{
+	if (!strcmp(cmd, "stats")) {
+		return v86_stats_dump(out, size, STATS_FMT_TEXT);
+	} else if (!strcmp(cmd, "stats csv")) {
+		return v86_stats_dump(out, size, STATS_FMT_CSV);
+	} else if (!strcmp(cmd, "stats cost")) {
+		return v86_stats_dump(out, size, STATS_FMT_COST);
+	} else if (!strcmp(cmd, "reset")) {
+		v86_stats_reset();
+	} else if (!strcmp(cmd, "trace on")) {
+		v86_tracing = 1;
+	} else if (!strcmp(cmd, "trace off")) {
+		v86_tracing = 0;
+	} else if (!strcmp(cmd, "flush")) {
+		cache_flush();
+	} else if (!strcmp(cmd, "io")) {
+		return v86_pio_dump(out, size);
+	} else if (!strcmp(cmd, "io reset")) {
+		v86_pio_reset();
+	} else if (!strcmp(cmd, "mset")) {
+		return v86_mset_dump(out, size);
+	} else if (!strcmp(cmd, "mset flush")) {
+		v86_mset_flush();
+	} else if (!strcmp(cmd, "vram")) {
+		return v86_mem_vram_dump(out, size);
+	} else if (!strcmp(cmd, "heat")) {
+		return v86_heat_dump(out, size);
+	} else if (!strcmp(cmd, "heat reset")) {
+		v86_heat_reset();
+	} else if (!strcmp(cmd, "prof")) {
+		return v86_prof_dump(out, size);
+	} else if (!strcmp(cmd, "prof write")) {
+		if (v86_prof_write())
+			return snprintf(out, size, "error: failed to write the profile\n");
+	} else if (!strcmp(cmd, "prof reset")) {
+		v86_prof_reset();
+	} else {
+		return snprintf(out, size, "error: unknown command '%s'\n", cmd);
+	}
+
+	return snprintf(out, size, "ok\n");
+}
+
+static void ctl_close(int i)
+{
+	close(ctl_conns[i].fd);
+	ctl_conns[i].fd = -1;
+}
+
+/*
+ * Fill in the descriptors to poll for the control socket, and drop the
+ * connections that have timed out.  Returns their number, at most
+ * CTL_MAX_CLIENTS + 1.
+ */
+int ctl_fds(struct pollfd *pfd)
+{
+	u64 now = v86_time_us();
+	int i, n = 0, free = 0;
+
+	if (ctl_listen == -1)
+		return 0;
+
+	for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+		if (ctl_conns[i].fd != -1 &&
+			now - ctl_conns[i].t > CTL_TIMEOUT * 1000)
+			ctl_close(i);
+
+		if (ctl_conns[i].fd == -1) {
+			free++;
+			continue;
+		}
+		pfd[n].fd = ctl_conns[i].fd;
+		pfd[n].events = POLLIN;
+		pfd[n++].revents = 0;
+	}
+
+	if (free) {
+		pfd[n].fd = ctl_listen;
+		pfd[n].events = POLLIN;
+		pfd[n++].revents = 0;
+	}
+
+	return n;
+}
+
+/* Execute the command sent over connection 'i' and close it. */
+static void ctl_serve(int i)
+{
+	static char out[CTL_BUF_SIZE];
+	char cmd[128];
+	int len;
+
+	len = recv(ctl_conns[i].fd, cmd, sizeof(cmd) - 1, MSG_DONTWAIT);
+	if (len < 0 && errno == EAGAIN)
+		return;
+
+	if (len > 0) {
+		cmd[len] = 0;
+		while (len > 0 && (cmd[len-1] == '\n' || cmd[len-1] == '\r'))
+			cmd[--len] = 0;
+
+		len = ctl_exec(cmd, out, sizeof(out));
+		send(ctl_conns[i].fd, out, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	}
+
+	ctl_close(i);
+}
+
+/* Handle the events reported for the descriptors from ctl_fds(). */
+void ctl_handle(struct pollfd *pfd, int n)
+{
+	int i, j, c;
+
+	for (i = 0; i < n; i++) {
+		if (!pfd[i].revents)
+			continue;
+
+		if (pfd[i].fd != ctl_listen) {
+			for (j = 0; j < CTL_MAX_CLIENTS; j++) {
+				if (ctl_conns[j].fd == pfd[i].fd)
+					ctl_serve(j);
+			}
+			continue;
+		}
+
+		c = accept(ctl_listen, NULL, NULL);
+		if (c == -1)
+			continue;
+
+		for (j = 0; j < CTL_MAX_CLIENTS && ctl_conns[j].fd != -1; j++)
+			;
+		if (j < CTL_MAX_CLIENTS) {
+			ctl_conns[j].fd = c;
+			ctl_conns[j].t = v86_time_us();
+		} else {
+			close(c);
+		}
+	}
+}
+
+void ctl_cleanup(void)
+{
+	int i;
+
+	if (ctl_listen == -1)
+		return;
+
+	for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+		if (ctl_conns[i].fd != -1)
+			ctl_close(i);
+	}
+
+	close(ctl_listen);
+	ctl_listen = -1;
+	unlink(ctl_path);
+}
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "v86.h"
+
+/*
+ * Parallel mode enumeration.  Getting the mode info blocks (4F01) for
+ * a card with a long mode list is the bulk of the work done when uvesafb
+ * is loaded, and every call only reads the Video BIOS and writes its
+ * private buffer.  Right after v86_init(), v86d can fork a number of
+ * workers which share the initialized emulator state copy-on-write,
+ * call 4F01 for a slice of the mode list each and put the results into
+ * a shared table.  The results are then loaded into the reply cache,
+ * from which the kernel's 4F01 requests are answered.
+ *
+ * The requests are built exactly the way uvesafb builds them, since the
+ * cache only matches identical requests.  The workers run on private
+ * copies of the memory mapped from /dev/mem, so that they can't write
+ * over each other's (or the firmware's) BDA and EBDA data.  Calls which
+ * accessed any hardware ports are not cached, as the workers could have
+ * interfered with each other there.
+ */
+
+#define ENUM_MAX_MODES	512
+
+/* Mode info block size, as requested by uvesafb. */
+#define ENUM_MIB_SIZE	256
+
+#define ENUM_PENDING	0
+#define ENUM_OK			1
+#define ENUM_FAILED		2
+
+/* The reply is laid out as a task: 'buf' follows 'tsk' directly. */
+struct enum_ent {
+	u32 state;
+	struct uvesafb_task tsk;
+	u8 buf[ENUM_MIB_SIZE];
+};
+
+static void enum_req(struct uvesafb_task *tsk, u16 mode)
+{
+	memset(tsk, 0, sizeof(*tsk));
+	tsk->regs.eax = 0x4f01;
+	tsk->regs.ecx = mode;
+	tsk->flags = TF_BUF_RET | TF_BUF_ESDI;
+	tsk->buf_len = ENUM_MIB_SIZE;
+}
+
+/* Get the mode list.  Returns the number of modes. */
+static int enum_list(u16 *modes)
+{
+	struct {
+		struct uvesafb_task tsk;
+		struct vbe_ib ib;
+	} r;
+	struct v86_regs regs = { 0 };
+	u16 *m;
+	int n = 0;
+
+	memset(&r, 0, sizeof(r));
+	r.tsk.regs.eax = 0x4f00;
+	r.tsk.flags = TF_VBEIB;
+	r.tsk.buf_len = sizeof(r.ib);
+	memcpy(&r.ib.vbe_signature, "VBE2", 4);
+
+	if (v86_task(&r.tsk, (u8*)&r.ib) || (r.tsk.regs.eax & 0xffff) != 0x004f ||
+		r.ib.mode_list_ptr >= sizeof(r.ib))
+		return 0;
+
+	regs.eax = 0x4f00;
+	query_note(&regs, &r.tsk, (u8*)&r.ib);
+
+	m = (u16*)((u8*)&r.ib + r.ib.mode_list_ptr);
+	while ((u8*)(m + 1) <= (u8*)(&r.ib + 1) && *m != 0xffff &&
+		   n < ENUM_MAX_MODES)
+		modes[n++] = *m++;
+
+	return n;
+}
+
+static void enum_worker(struct enum_ent *tab, u16 *modes, int n, int w,
+						int workers)
+{
+	struct enum_ent *e;
+	u64 io;
+	int i;
+
+	if (v86_mem_unshare())
+		return;
+
+	/* Count the accesses to the hardware ports. */
+	pio_hooks |= PIO_HOOK_TABLE;
+
+	for (i = w; i < n; i += workers) {
+		e = &tab[i];
+		enum_req(&e->tsk, modes[i]);
+		io = pio_stats[PIO_PASS].count;
+
+		if (v86_task(&e->tsk, e->buf) ||
+			(e->tsk.regs.eax & 0xffff) != 0x004f ||
+			pio_stats[PIO_PASS].count != io) {
+			e->state = ENUM_FAILED;
+			continue;
+		}
+
+		e->state = ENUM_OK;
+	}
+}
+
+/*
+ * Enumerate the modes with 'workers' processes (0 = one per CPU) and
+ * load the results into the reply cache.  Has to be called after
+ * v86_init() and before any threads are started.  Returns the number
+ * of cached modes, or -1 on error.
+ */
+int v86_enum_modes(int workers)
+{
+	struct {
+		struct uvesafb_task tsk;
+		u8 buf[ENUM_MIB_SIZE];
+	} req;
+	struct enum_ent *tab;
+	u16 modes[ENUM_MAX_MODES];
+	int n, i, cached = 0;
+	pid_t pid;
+	u64 t;
+
+	if (rec_mode != REC_OFF) {
+		ulog(LOG_WARNING, "Parallel mode enumeration is disabled while "
+			 "recording.\n");
+		return -1;
+	}
+
+	if (workers <= 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers <= 0)
+		workers = 1;
+
+	t = v86_time_us();
+	n = enum_list(modes);
+	if (!n)
+		return -1;
+
+	tab = mmap(NULL, n * sizeof(*tab), PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (tab == MAP_FAILED) {
+		ulog(LOG_ERR, "Failed to allocate the mode table: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (workers > n)
+		workers = n;
+
+	for (i = 0; i < workers; i++) {
+		pid = fork();
+		if (pid == 0) {
+			enum_worker(tab, modes, n, i, workers);
+			_exit(0);
+		} else if (pid == -1) {
+			ulog(LOG_ERR, "Failed to start an enumeration worker: %s\n",
+				 strerror(errno));
+			break;
+		}
+	}
+
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+
+	for (i = 0; i < n; i++) {
+		if (tab[i].state != ENUM_OK)
+			continue;
+
+		enum_req(&req.tsk, modes[i]);
+		memset(req.buf, 0, sizeof(req.buf));
+		cache_put(&req.tsk, &tab[i].tsk);
+		query_note(&req.tsk.regs, &tab[i].tsk, tab[i].buf);
+		cached++;
+	}
+
+	munmap(tab, n * sizeof(*tab));
+
+	ulog(LOG_INFO, "Enumerated %d of %d modes in %llu us with %d workers.\n",
+		 cached, n, (unsigned long long)(v86_time_us() - t), workers);
+
+	return cached;
+}
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <string.h>
+#include <x86emu.h>
+#include "v86.h"
+#include "v86_x86emu.h"
+
+/*
+ * Memory access heatmap (x86emu only).  Every guest memory access is
+ * counted as a read, a write or an instruction fetch, per memory region
+ * and per 4 kB page of the first megabyte.  This shows which regions
+ * are worth shadowing or virtualizing, and how many accesses go to the
+ * uncached /dev/mem mappings.
+ *
+ * Fetches are the reads at the instruction pointer, i.e. of opcodes,
+ * ModR/M bytes and immediates.  Only the accesses made while the
+ * emulator runs are counted, so those made by v86d itself, such as
+ * copying the task buffers, reading the IVT, walking the mode list or
+ * replaying recorded mode sets, are not.
+ *
+ * With CONFIG_THREADS, the counters are updated by the worker thread
+ * and dumped or reset by the main thread (control and query sockets),
+ * hence the lock.
+ */
+
+#define HEAT_PAGES		(0x110000 >> 12)	/* up to FFFF:FFFF */
+
+struct heat_count {
+	u64 reads;
+	u64 writes;
+	u64 fetches;
+};
+
+static struct heat_count heat_regions[MEM_REGIONS];
+static struct heat_count heat_pages[HEAT_PAGES];
+static struct heat_count heat_last[MEM_REGIONS];
+static u32 heat_calls, heat_last_eax;
+static int heat_last_num, heat_last_valid;
+static int heat_running;
+
+#ifdef CONFIG_THREADS
+static pthread_mutex_t heat_lock = PTHREAD_MUTEX_INITIALIZER;
+#define HEAT_LOCK()		pthread_mutex_lock(&heat_lock)
+#define HEAT_UNLOCK()	pthread_mutex_unlock(&heat_lock)
+#else
+#define HEAT_LOCK()		do {} while (0)
+#define HEAT_UNLOCK()	do {} while (0)
+#endif
+
+static const char *region_names[MEM_REGIONS] = {
+	"ivt/bda", "real", "ebda", "vram", "vbios", "sbios", "unmapped",
+};
+
+/* Count the accesses made by BIOS calls from now on. */
+int v86_heat_init(void)
+{
+	v86_heat_reset();
+	mem_hooks |= MEM_HOOK_HEAT;
+	return 0;
+}
+
+/* Start counting a new call, see v86_run(). */
+void v86_heat_start(int num, struct v86_regs *regs)
+{
+	HEAT_LOCK();
+	memset(heat_last, 0, sizeof(heat_last));
+	heat_last_num = num;
+	heat_last_eax = regs->eax;
+	heat_last_valid = 1;
+	heat_calls++;
+	HEAT_UNLOCK();
+	heat_running = 1;
+}
+
+/* Stop counting when the emulator returns. */
+void v86_heat_stop(void)
+{
+	heat_running = 0;
+}
+
+static inline int heat_page(u32 addr)
+{
+	return (addr >> 12) < HEAT_PAGES ? addr >> 12 : HEAT_PAGES - 1;
+}
+
+void v86_heat_read(u32 addr, int size)
+{
+	u32 ip = ((u32)X86_CS << 4) + X86_IP;
+	int r;
+
+	if (!heat_running)
+		return;
+
+	r = v86_mem_region(addr);
+
+	HEAT_LOCK();
+	/* Opcodes are read with IP already incremented, immediates before. */
+	if (addr == ip || addr + 1 == ip) {
+		heat_regions[r].fetches++;
+		heat_pages[heat_page(addr)].fetches++;
+		heat_last[r].fetches++;
+	} else {
+		heat_regions[r].reads++;
+		heat_pages[heat_page(addr)].reads++;
+		heat_last[r].reads++;
+	}
+	HEAT_UNLOCK();
+}
+
+void v86_heat_write(u32 addr, int size)
+{
+	int r;
+
+	if (!heat_running)
+		return;
+
+	r = v86_mem_region(addr);
+
+	HEAT_LOCK();
+	heat_regions[r].writes++;
+	heat_pages[heat_page(addr)].writes++;
+	heat_last[r].writes++;
+	HEAT_UNLOCK();
+}
+
+static int heat_line(char *buf, int size, const char *name, const char *info,
+					 struct heat_count *c)
+{
+	return snprintf(buf, size, "%-8s %-8s %12llu %12llu %12llu\n", name, info,
+					(unsigned long long)c->reads, (unsigned long long)c->writes,
+					(unsigned long long)c->fetches);
+}
+
+static inline int heat_zero(struct heat_count *c)
+{
+	return !c->reads && !c->writes && !c->fetches;
+}
+
+int v86_heat_dump(char *buf, int size)
+{
+	char page[8];
+	int len, i, r;
+
+	if (!(mem_hooks & MEM_HOOK_HEAT))
+		return snprintf(buf, size, "memory accesses: not counted\n");
+
+	HEAT_LOCK();
+	len = snprintf(buf, size, "memory accesses in %u calls:\n"
+				   "%-8s %-8s %12s %12s %12s\n", heat_calls,
+				   "region", "mapping", "reads", "writes", "fetches");
+
+	for (i = 0; i < MEM_REGIONS && len < size; i++) {
+		if (heat_zero(&heat_regions[i]))
+			continue;
+		len += heat_line(buf + len, size - len, region_names[i],
+						 v86_mem_region_shared(i) ? "/dev/mem" : "private",
+						 &heat_regions[i]);
+	}
+
+	if (len < size)
+		len += snprintf(buf + len, size - len, "\n%-8s %-8s %12s %12s %12s\n",
+						"page", "region", "reads", "writes", "fetches");
+
+	for (i = 0; i < HEAT_PAGES && len < size; i++) {
+		if (heat_zero(&heat_pages[i]))
+			continue;
+		/* The EBDA usually starts in the middle of a page. */
+		r = v86_mem_region(i << 12);
+		if (r == MEM_R_NONE)
+			r = v86_mem_region((i << 12) + 0xfff);
+
+		snprintf(page, sizeof(page), "%05x", i << 12);
+		len += heat_line(buf + len, size - len, page, region_names[r],
+						 &heat_pages[i]);
+	}
+
+	if (heat_last_valid && len < size) {
+		if (heat_last_num == 0x10 && (heat_last_eax & 0xff00) == 0x4f00)
+			len += snprintf(buf + len, size - len, "\nlast call, %04x:\n",
+							heat_last_eax & 0xffff);
+		else if (heat_last_num >= 0)
+			len += snprintf(buf + len, size - len, "\nlast call, int %02x:\n",
+							heat_last_num);
+		else
+			len += snprintf(buf + len, size - len, "\nlast call, far call:\n");
+
+		for (i = 0; i < MEM_REGIONS && len < size; i++) {
+			if (heat_zero(&heat_last[i]))
+				continue;
+			len += heat_line(buf + len, size - len, region_names[i], "",
+							 &heat_last[i]);
+		}
+	}
+	HEAT_UNLOCK();
+
+	return (len < size) ? len : size - 1;
+}
+
+void v86_heat_reset(void)
+{
+	HEAT_LOCK();
+	memset(heat_regions, 0, sizeof(heat_regions));
+	memset(heat_pages, 0, sizeof(heat_pages));
+	memset(heat_last, 0, sizeof(heat_last));
+	heat_calls = 0;
+	heat_last_valid = 0;
+	HEAT_UNLOCK();
+}
@@ -1,6 +1,7 @@
 #include <string.h>
 #include <lrmi.h>
 #include "v86.h"
+#include "v86_trace.h"
 
 /* Memory access functions */
 u8 v_rdb(u32 addr) {
@@ -71,10 +72,26 @@ void rconv_LRMI_to_v86(struct LRMI_regs *rs, struct v86_regs *rd)
 	rd->gs  = rs->gs;
 }
 
+/* Exit counters at the last v86_pio_reset() */
+static struct LRMI_stats stats_base;
+
 int v86_init() {
 	int err = LRMI_init();
 
-	ioperm(0, 1024, 1);
+	/*
+	 * IOPL doesn't apply to port I/O in vm86 mode, only the I/O bitmap
+	 * does.  Accesses to ports which are not enabled there exit to LRMI
+	 * to be emulated one instruction at a time, so enable all of them:
+	 * above 0x3ff are the PCI configuration ports and the I/O BARs of
+	 * the card.  ioperm() only covers the first 1024 ports on kernels
+	 * older than 2.6.8.
+	 *
+	 * No port is ever taken out of the bitmap again: the accesses that
+	 * exit are still carried out on the hardware by LRMI itself, so
+	 * there is no place to intercept them, see v86_pio_config().
+	 */
+	if (ioperm(0, 0x10000, 1))
+		ioperm(0, 1024, 1);
 	iopl(3);
 
 	return (err == 1) ? 0 : 1;
@@ -85,25 +102,229 @@ void v86_cleanup()
 	/* dummy function */
 }
 
+/*
+ * There is no way to count the instructions executed in vm86 mode,
+ * and all signals are blocked while we're in it, so call limits are
+ * not supported with LRMI.
+ */
+void v86_set_limits(u32 insns, u32 ms, int (*yield)(void))
+{
+	if (insns || ms)
+		ulog(LOG_WARNING, "Call limits are not supported with LRMI.\n");
+}
+
+/*
+ * Port I/O is done directly by the BIOS code in vm86 mode, so it can't
+ * be recorded, replayed or virtualized, and neither can the memory image
+ * be loaded from a file.
+ */
+int v86_mem_set_loader(int (*load)(u32 addr, u32 size, void *dest))
+{
+	ulog(LOG_ERR, "Replay is not supported with LRMI.\n");
+	return -1;
+}
+
+int v86_mem_set_image(const char *path)
+{
+	ulog(LOG_ERR, "Memory images are not supported with LRMI.\n");
+	return -1;
+}
+
+int v86_mem_set_rom(const char *path)
+{
+	ulog(LOG_ERR, "ROM images are not supported with LRMI.\n");
+	return -1;
+}
+
+int v86_mem_set_vram(const char *policy)
+{
+	ulog(LOG_ERR, "VGA window policies are not supported with LRMI.\n");
+	return -1;
+}
+
+int v86_mem_vram_dump(char *buf, int size)
+{
+	return snprintf(buf, size, "VGA window: shared\n");
+}
+
+int v86_mem_dump(int (*put)(u32 addr, u32 size, void *data))
+{
+	ulog(LOG_ERR, "Recording is not supported with LRMI.\n");
+	return -1;
+}
+
+int v86_heat_init(void)
+{
+	ulog(LOG_ERR, "Memory access counting is not supported with LRMI.\n");
+	return -1;
+}
+
+int v86_heat_dump(char *buf, int size)
+{
+	return snprintf(buf, size, "memory accesses: not supported\n");
+}
+
+void v86_heat_reset(void)
+{
+}
+
+int v86_prof_init(const char *path, u32 period, const char *map)
+{
+	ulog(LOG_ERR, "Profiling is not supported with LRMI.\n");
+	return -1;
+}
+
+int v86_prof_write(void)
+{
+	return 0;
+}
+
+int v86_prof_dump(char *buf, int size)
+{
+	return snprintf(buf, size, "profiling: not supported\n");
+}
+
+void v86_prof_reset(void)
+{
+}
+
+void v86_prof_cleanup(void)
+{
+}
+
+/* LRMI's fixed mappings are covered by mlockall(). */
+void v86_mem_prefault(void)
+{
+}
+
+void v86_set_fast_delays(int on)
+{
+	if (on)
+		ulog(LOG_WARNING, "Delays can't be short-circuited with LRMI.\n");
+}
+
+/*
+ * There is no port I/O interception with LRMI: all ports are passed
+ * through to the hardware, and the policy table doesn't exist.
+ */
+int v86_pio_config(const char *spec)
+{
+	ulog(LOG_ERR, "Port I/O policies are not supported with LRMI, "
+		 "all ports are passed through.\n");
+	return -1;
+}
+
+/*
+ * Port I/O is only intercepted for the ports that are not enabled in
+ * the I/O bitmap, and the only cost that can be measured is the number
+ * of exits from vm86 mode.
+ */
+int v86_pio_dump(char *buf, int size)
+{
+	struct LRMI_stats s;
+	int len;
+
+	LRMI_get_stats(&s);
+	len = snprintf(buf, size, "vm86 exits: %u, reflected interrupts: %u, "
+				   "emulated I/O instructions: %u\n",
+				   s.entries - stats_base.entries, s.intx - stats_base.intx,
+				   s.io - stats_base.io);
+
+	return (len < size) ? len : size - 1;
+}
+
+void v86_pio_reset(void)
+{
+	LRMI_get_stats(&stats_base);
+}
+
+/*
+ * Port accesses can't be counted, so there would be no telling which
+ * calls were disturbed by the other workers.
+ */
+int v86_enum_modes(int workers)
+{
+	ulog(LOG_WARNING, "Parallel mode enumeration is not supported with LRMI.\n");
+	return -1;
+}
+
+int v86_mset_init(void)
+{
+	ulog(LOG_ERR, "Mode set replay is not supported with LRMI.\n");
+	return -1;
+}
+
+int v86_mset_start(struct uvesafb_task *tsk, u8 *buf)
+{
+	return 0;
+}
+
+void v86_mset_end(struct uvesafb_task *tsk, u8 *buf, int err)
+{
+}
+
+int v86_mset_dump(char *buf, int size)
+{
+	return snprintf(buf, size, "mode set replay is not supported with LRMI\n");
+}
+
+void v86_mset_flush(void)
+{
+}
+
 /*
  * Perform a simulated interrupt call.
  */
 int v86_int(int num, struct v86_regs *regs)
 {
 	struct LRMI_regs r;
+	struct LRMI_stats s0, s1;
+	u64 t;
 	int err;
 
 	rconv_v86_to_LRMI(regs, &r);
+	v86_trace(TR_INT_ENTER, 0, num, r.eax);
+	v86_trace(TR_EMU_ENTER, 0, 0, 0);
+	LRMI_get_stats(&s0);
+	t = v86_rdtsc();
 	err = LRMI_int(num, &r);
+	v86_cost.tsc_emu += v86_rdtsc() - t;
+	LRMI_get_stats(&s1);
+	v86_cost.ints += s1.intx - s0.intx;
+	v86_trace(TR_EMU_EXIT, 0, 0, 0);
+	v86_trace(TR_INT_EXIT, 0, num, r.eax);
+	rconv_LRMI_to_v86(&r, regs);
+
+	return (err == 1) ? 0 : 1;
+}
+
+/*
+ * Perform a far call to seg:off.
+ */
+int v86_call(u16 seg, u16 off, struct v86_regs *regs)
+{
+	struct LRMI_regs r;
+	int err;
+
+	rconv_v86_to_LRMI(regs, &r);
+	r.cs = seg;
+	r.ip = off;
+	v86_trace(TR_EMU_ENTER, 0, 0, 0);
+	err = LRMI_call(&r);
+	v86_trace(TR_EMU_EXIT, 0, 0, 0);
 	rconv_LRMI_to_v86(&r, regs);
 
 	return (err == 1) ? 0 : 1;
 }
 
-inline void v86_mem_free(u32 m) {
-	LRMI_free_real((void*)m);
+void v86_mem_reset(void) {
+	LRMI_reset_task();
+}
+
+u32 v86_mem_alloc(int size) {
+	return (u32)LRMI_alloc_task(size);
 }
 
-inline u32 v86_mem_alloc(int size) {
+u32 v86_mem_alloc_static(int size) {
 	return (u32)LRMI_alloc_real(size);
 }
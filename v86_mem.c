@@ -1,12 +1,11 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include "v86.h"
 
-#define REAL_MEM_BLOCKS	0x100
-
 u8 *mem_low;		/* 0x000000 - 0x001000 */
 u8 *mem_real;		/* 0x010000 - 0x09ffff */
 u8 *mem_vbios;		/* 0x0c0000 - 0x0cxxxx */
@@ -14,20 +13,58 @@ u8 *mem_sbios;		/* 0x0f0000 - 0x0fffff */
 u8 *mem_vram;		/* 0x0a0000 - 0xbfffff */
 u8 *mem_ebda;		/* usually: 0x9fc00 - 0x9ffff */
 
+static u8 saved_low[IVTBDA_SIZE];
+static u8 *saved_ebda;
+
+int mem_hooks;
+
+/*
+ * Backing of the VGA window, see v86_mem_set_vram().  With VRAM_PRIVATE,
+ * vram_bits has a bit set for every byte the BIOS has written.  With
+ * VRAM_WC, it marks the bytes not yet flushed to the real window at
+ * vram_hw, and vram_lo/vram_hi bound them.
+ */
+static int vram_policy = VRAM_SHARED;
+static u8 *vram_hw;
+static u8 vram_bits[VRAM_SIZE / 8];
+static u32 vram_lo = VRAM_SIZE, vram_hi;
+static u64 vram_reported;
+struct v86_vram_stats vram_stats;
+
+/* vram_stats is dumped by the main thread (control socket). */
+#ifdef CONFIG_THREADS
+static pthread_mutex_t vram_lock = PTHREAD_MUTEX_INITIALIZER;
+#define VRAM_LOCK()		pthread_mutex_lock(&vram_lock)
+#define VRAM_UNLOCK()	pthread_mutex_unlock(&vram_lock)
+#else
+#define VRAM_LOCK()		do {} while (0)
+#define VRAM_UNLOCK()	do {} while (0)
+#endif
+
+static const char *vram_names[] = { "shared", "private", "wc" };
+
+/* Option ROM image loaded at C0000, see v86_mem_set_rom(). */
+static const char *mem_rom;
+
+/* Source of the memory image in place of /dev/mem, see v86_mem_set_loader(). */
+static int (*mem_loader)(u32 addr, u32 size, void *dest);
+
 static u32 ebda_start;
 static u32 ebda_size;
 static u32 ebda_diff;
 static u32 vbios_size;
 
-struct mem_block {
-	unsigned int size : 20;
-	unsigned int free : 1;
-};
-
+/*
+ * The real mode memory is handed out by two bump allocators working
+ * from the opposite ends of the region.  Long-lived blocks (the stack,
+ * the halt stub) are taken from the top and are never freed.  Task
+ * buffers are taken from the bottom and are all released at once by
+ * v86_mem_reset() when the task is done.
+ */
 static struct {
 	int ready;
-	int count;
-	struct mem_block blocks[REAL_MEM_BLOCKS];
+	u32 task_top;		/* first free byte of the task arena */
+	u32 static_base;	/* lowest byte used by long-lived blocks */
 } mem_info = { 0 };
 
 void *vptr(u32 addr) {
@@ -52,33 +89,162 @@ void *vptr(u32 addr) {
 	}
 }
 
+/*
+ * Classify an address the same way vptr() does.  Returns one of the
+ * MEM_R_* constants.
+ */
+int v86_mem_region(u32 addr)
+{
+	if (addr >= REAL_MEM_BASE && addr < REAL_MEM_BASE + REAL_MEM_SIZE)
+		return MEM_R_REAL;
+	else if (addr >= VBIOS_BASE && addr < VBIOS_BASE + vbios_size)
+		return MEM_R_VBIOS;
+	else if (addr >= SBIOS_BASE && addr < SBIOS_BASE + SBIOS_SIZE)
+		return MEM_R_SBIOS;
+	else if (addr >= VRAM_BASE && addr < VRAM_BASE + VRAM_SIZE)
+		return MEM_R_VRAM;
+	else if (addr < IVTBDA_SIZE)
+		return MEM_R_IVTBDA;
+	else if (mem_ebda && addr >= ebda_start && addr < ebda_start + ebda_size)
+		return MEM_R_EBDA;
+	else
+		return MEM_R_NONE;
+}
+
+/*
+ * Returns non-zero if the region is mapped from /dev/mem, where the
+ * accesses go to the (possibly uncached) hardware.
+ */
+int v86_mem_region_shared(int region)
+{
+	if (mem_loader || region == MEM_R_REAL || region == MEM_R_NONE)
+		return 0;
+	if (region == MEM_R_VRAM)
+		return vram_policy == VRAM_SHARED;
+	if (region == MEM_R_VBIOS)
+		return !mem_rom;
+	return 1;
+}
+
+static inline int vram_bit(u32 off)
+{
+	return vram_bits[off >> 3] & (1 << (off & 7));
+}
+
+/*
+ * A read from the VGA window.  'val' has been read from the shadow.
+ * With VRAM_WC, the pending writes are flushed first and the value is
+ * read from the hardware, since VGA reads also load the latches.  With
+ * VRAM_PRIVATE, the bytes the BIOS hasn't written itself would have
+ * come from the real VRAM, which is reported by v86_mem_vram_sync().
+ */
+static u32 vram_read(u32 off, int size, u32 val)
+{
+	int i;
+
+	if (vram_policy == VRAM_WC) {
+		v86_mem_vram_sync();
+		if (off + size > VRAM_SIZE)
+			size = VRAM_SIZE - off;
+		memcpy(&val, vram_hw + off, size);
+		VRAM_LOCK();
+		vram_stats.hw_reads++;
+		VRAM_UNLOCK();
+		return val;
+	}
+
+	VRAM_LOCK();
+	for (i = 0; i < size && off + i < VRAM_SIZE; i++) {
+		if (!vram_bit(off + i))
+			vram_stats.stale++;
+	}
+	VRAM_UNLOCK();
+
+	return val;
+}
+
+static void vram_write(u32 off, int size)
+{
+	int i;
+
+	for (i = 0; i < size && off + i < VRAM_SIZE; i++)
+		vram_bits[(off + i) >> 3] |= 1 << ((off + i) & 7);
+
+	if (off < vram_lo)
+		vram_lo = off;
+	if (off + i > vram_hi)
+		vram_hi = off + i;
+	VRAM_LOCK();
+	vram_stats.writes++;
+	VRAM_UNLOCK();
+}
+
+static u32 mem_hook_read(u32 addr, int size)
+{
+	u32 val = 0;
+
+	if (mem_hooks & MEM_HOOK_HEAT)
+		v86_heat_read(addr, size);
+
+	memcpy(&val, vptr(addr), size);
+
+	if ((mem_hooks & MEM_HOOK_VRAM) && addr - VRAM_BASE < VRAM_SIZE)
+		val = vram_read(addr - VRAM_BASE, size, val);
+
+	return val;
+}
+
 /* We don't care about memory accesses at boundaries of different memory
  * regions, since our v86 memory is non contiguous anyway. */
 u8 v_rdb(u32 addr) {
+	if (mem_hooks)
+		return mem_hook_read(addr, 1);
 	return *(u8*) vptr(addr);
 }
 
 u16 v_rdw(u32 addr) {
+	if (mem_hooks)
+		return mem_hook_read(addr, 2);
 	return *(u16*) vptr(addr);
 }
 
 u32 v_rdl(u32 addr) {
+	if (mem_hooks)
+		return mem_hook_read(addr, 4);
 	return *(u32*) vptr(addr);
 }
 
+static void mem_hook_write(u32 addr, int size, u32 val)
+{
+	if (mem_hooks & MEM_HOOK_HEAT)
+		v86_heat_write(addr, size);
+
+	if ((mem_hooks & MEM_HOOK_VRAM) && addr - VRAM_BASE < VRAM_SIZE)
+		vram_write(addr - VRAM_BASE, size);
+
+	if (mem_hooks & MEM_HOOK_MSET)
+		v86_mset_mem(addr, size, val);
+}
+
 void v_wrb(u32 addr, u8 val) {
 	u8 *t = vptr(addr);
 	*t = val;
+	if (mem_hooks)
+		mem_hook_write(addr, 1, val);
 }
 
 void v_wrw(u32 addr, u16 val) {
 	u16 *t = vptr(addr);
 	*t = val;
+	if (mem_hooks)
+		mem_hook_write(addr, 2, val);
 }
 
 void v_wrl(u32 addr, u32 val) {
 	u32 *t = vptr(addr);
 	*t = val;
+	if (mem_hooks)
+		mem_hook_write(addr, 4, val);
 }
 
 static void *map_file(void *start, size_t length, int prot, int flags, char *name, long offset)
@@ -105,6 +271,34 @@ static void *map_file(void *start, size_t length, int prot, int flags, char *nam
 	return m;
 }
 
+/*
+ * Map a region of the physical memory, or a private copy of it filled
+ * in by the memory loader.
+ */
+static void *map_phys(u32 addr, size_t length)
+{
+	void *m;
+
+	if (!mem_loader)
+		return map_file(NULL, length, PROT_READ | PROT_WRITE,
+						MAP_SHARED, "/dev/mem", addr);
+
+	m = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == (void *)-1) {
+		ulog(LOG_ERR, "mmap for %x failed with: %s\n", addr, strerror(errno));
+		return NULL;
+	}
+
+	if (mem_loader(addr, length, m)) {
+		ulog(LOG_ERR, "Failed to load the memory at %x.\n", addr);
+		munmap(m, length);
+		return NULL;
+	}
+
+	return m;
+}
+
 static int real_mem_init(void)
 {
 	if (mem_info.ready)
@@ -116,9 +310,8 @@ static int real_mem_init(void)
 		return 1;
 
 	mem_info.ready = 1;
-	mem_info.count = 1;
-	mem_info.blocks[0].size = REAL_MEM_SIZE;
-	mem_info.blocks[0].free = 1;
+	mem_info.task_top = REAL_MEM_BASE;
+	mem_info.static_base = REAL_MEM_BASE + REAL_MEM_SIZE;
 
 	return 0;
 }
@@ -131,77 +324,78 @@ static void real_mem_deinit(void)
 	}
 }
 
-static void insert_block(int i)
-{
-	memmove(mem_info.blocks + i + 1, mem_info.blocks + i,
-			(mem_info.count - i) * sizeof(struct mem_block));
-	mem_info.count++;
-}
-
-static void delete_block(int i)
-{
-	mem_info.count--;
-	memmove(mem_info.blocks + i, mem_info.blocks + i + 1,
-		 (mem_info.count - i) * sizeof(struct mem_block));
-}
-
+/*
+ * Allocate a buffer that will only be used for the duration of the
+ * current task.
+ */
 u32 v86_mem_alloc(int size)
 {
-	int i;
-	u32 r = REAL_MEM_BASE;
+	u32 r;
 
 	if (!mem_info.ready)
 		return 0;
 
-	if (mem_info.count == REAL_MEM_BLOCKS)
+	size = (size + 15) & ~15;
+
+	if (size > mem_info.static_base - mem_info.task_top)
 		return 0;
 
-	size = (size + 15) & ~15;
+	r = mem_info.task_top;
+	mem_info.task_top += size;
 
-	for (i = 0; i < mem_info.count; i++) {
-		if (mem_info.blocks[i].free && size < mem_info.blocks[i].size) {
-			insert_block(i);
+	return r;
+}
 
-			mem_info.blocks[i].size = size;
-			mem_info.blocks[i].free = 0;
-			mem_info.blocks[i + 1].size -= size;
+/*
+ * Allocate a block that stays valid until v86_mem_cleanup().
+ */
+u32 v86_mem_alloc_static(int size)
+{
+	if (!mem_info.ready)
+		return 0;
 
-			return r;
-		}
+	size = (size + 15) & ~15;
 
-		r += mem_info.blocks[i].size;
-	}
+	if (size > mem_info.static_base - mem_info.task_top)
+		return 0;
 
-	return 0;
+	mem_info.static_base -= size;
+
+	return mem_info.static_base;
 }
 
-void v86_mem_free(u32 m)
+/*
+ * Release all buffers allocated with v86_mem_alloc().
+ */
+void v86_mem_reset(void)
 {
-	int i;
-	u32 r = REAL_MEM_BASE;
+	mem_info.task_top = REAL_MEM_BASE;
+}
 
-	if (!mem_info.ready)
-		return;
+/*
+ * Save and restore the IVT, the BDA and the EBDA.  This is used to roll
+ * back the memory state of aborted calls.  The VGA window is too big to
+ * be saved for every call, and writes to it, like port writes, may have
+ * already reached the hardware, so it is left alone.
+ */
+void v86_mem_save(void)
+{
+	memcpy(saved_low, mem_low, IVTBDA_SIZE);
 
-	i = 0;
-	while (m != r) {
-		r += mem_info.blocks[i].size;
-		i++;
-		if (i == mem_info.count)
-			return;
+	if (mem_ebda) {
+		if (!saved_ebda)
+			saved_ebda = malloc(ebda_size);
+		if (saved_ebda)
+			memcpy(saved_ebda, mem_ebda + ebda_diff, ebda_size);
 	}
+}
 
-	mem_info.blocks[i].free = 1;
-
-	if (i + 1 < mem_info.count && mem_info.blocks[i + 1].free) {
-		mem_info.blocks[i].size += mem_info.blocks[i + 1].size;
-		delete_block(i + 1);
-	}
+void v86_mem_restore(void)
+{
+	memcpy(mem_low, saved_low, IVTBDA_SIZE);
 
-	if (i - 1 >= 0 && mem_info.blocks[i - 1].free) {
-		mem_info.blocks[i - 1].size += mem_info.blocks[i].size;
-		delete_block(i);
-	}
+	if (mem_ebda && saved_ebda)
+		memcpy(mem_ebda + ebda_diff, saved_ebda, ebda_size);
 }
 
 static int get_bytes_from_phys(u32 addr, int num_bytes, void *dest)
@@ -211,6 +405,9 @@ static int get_bytes_from_phys(u32 addr, int num_bytes, void *dest)
 	u32 diff = 0;
 	u32 t;
 
+	if (mem_loader)
+		return mem_loader(addr, num_bytes, dest);
+
 	t = addr & -getpagesize();
 	if (t) {
 		diff = addr - t;
@@ -218,8 +415,7 @@ static int get_bytes_from_phys(u32 addr, int num_bytes, void *dest)
 		size += diff;
 	}
 
-	mem_tmp = map_file(NULL, size, PROT_READ | PROT_WRITE,
-					MAP_SHARED, "/dev/mem", addr);
+	mem_tmp = map_phys(addr, size);
 	if (!mem_tmp)
 		return -1;
 
@@ -228,6 +424,71 @@ static int get_bytes_from_phys(u32 addr, int num_bytes, void *dest)
 	return 0;
 }
 
+/*
+ * Load the option ROM image into a private copy of the whole C0000 -
+ * DFFFF area, which leaves the initialization code room to grow.
+ */
+static int load_rom(void)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(mem_rom, O_RDONLY);
+	if (fd == -1) {
+		ulog(LOG_ERR, "Open '%s' failed with: %s\n", mem_rom, strerror(errno));
+		return 1;
+	}
+
+	vbios_size = SBIOS_BASE - VBIOS_BASE;
+	mem_vbios = mmap(NULL, vbios_size, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem_vbios == (void *)-1) {
+		mem_vbios = NULL;
+		close(fd);
+		return 1;
+	}
+
+	len = read(fd, mem_vbios, vbios_size);
+	close(fd);
+
+	if (len < 3 || mem_vbios[0] != 0x55 || mem_vbios[1] != 0xAA) {
+		ulog(LOG_ERR, "%s is not an option ROM image.", mem_rom);
+		return 1;
+	}
+
+	ulog(LOG_DEBUG, "VBIOS loaded from %s, %d bytes\n", mem_rom, (int)len);
+	return 0;
+}
+
+/*
+ * Set up the shadow of the VGA window.  It starts out zeroed; with
+ * VRAM_WC, the real window is mapped as well.
+ */
+static u8 *vram_map(void)
+{
+	u8 *m;
+
+	if (vram_policy == VRAM_WC) {
+		vram_hw = map_phys(VRAM_BASE, VRAM_SIZE);
+		if (!vram_hw)
+			return NULL;
+	}
+
+	m = mmap(NULL, VRAM_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == (void *)-1) {
+		ulog(LOG_ERR, "mmap for the VGA window shadow failed with: %s\n",
+			 strerror(errno));
+		return NULL;
+	}
+
+	memset(vram_bits, 0, sizeof(vram_bits));
+	vram_lo = VRAM_SIZE;
+	vram_hi = 0;
+	vram_reported = vram_stats.stale;
+	return m;
+}
+
 int v86_mem_init(void)
 {
 	u8 tmp[4];
@@ -240,8 +501,7 @@ int v86_mem_init(void)
 	 * modes will not work correctly on some cards (e.g. nVidia GeForce
 	 * 8600M, PCI ID 10de:0425).
 	 */
-	mem_low = map_file(NULL, IVTBDA_SIZE, PROT_READ | PROT_WRITE,
-					MAP_SHARED, "/dev/mem", IVTBDA_BASE);
+	mem_low = map_phys(IVTBDA_BASE, IVTBDA_SIZE);
 	if (!mem_low) {
 		real_mem_deinit();
 		return 1;
@@ -270,20 +530,31 @@ int v86_mem_init(void)
 			ebda_diff = ebda_start - t;
 		}
 
-		mem_ebda = map_file(NULL, ebda_size + ebda_diff, PROT_READ | PROT_WRITE, MAP_SHARED, "/dev/mem", ebda_start - ebda_diff);
+		mem_ebda = map_phys(ebda_start - ebda_diff, ebda_size + ebda_diff);
 		if (!mem_ebda) {
 			ulog(LOG_WARNING, "Failed to mmap EBDA.  Proceeding without it.");
 		}
 	}
 
 	/* Map the Video RAM */
-	mem_vram = map_file(NULL, VRAM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, "/dev/mem", VRAM_BASE);
+	if (vram_policy == VRAM_SHARED)
+		mem_vram = map_phys(VRAM_BASE, VRAM_SIZE);
+	else
+		mem_vram = vram_map();
 	if (!mem_vram) {
 		ulog(LOG_ERR, "Failed to mmap the Video RAM.");
 		v86_mem_cleanup();
 		return 1;
 	}
 
+	if (mem_rom) {
+		if (load_rom()) {
+			v86_mem_cleanup();
+			return 1;
+		}
+		goto sbios;
+	}
+
 	/* Map the Video BIOS */
 	get_bytes_from_phys(VBIOS_BASE, 4, tmp);
 	if (tmp[0] != 0x55 || tmp[1] != 0xAA) {
@@ -299,8 +570,7 @@ int v86_mem_init(void)
 	 * There is at least one case where mapping them without this flag causes
 	 * a segfault during the emulation: https://bugs.gentoo.org/show_bug.cgi?id=245254
 	 */
-	mem_vbios = map_file(NULL, vbios_size, PROT_READ | PROT_WRITE,
-							MAP_SHARED, "/dev/mem", VBIOS_BASE);
+	mem_vbios = map_phys(VBIOS_BASE, vbios_size);
 
 	if (!mem_vbios) {
 		ulog(LOG_ERR, "Failed to mmap the Video BIOS.");
@@ -308,9 +578,9 @@ int v86_mem_init(void)
 		return 1;
 	}
 
+sbios:
 	/* Map the system BIOS */
-	mem_sbios = map_file(NULL, SBIOS_SIZE, PROT_READ | PROT_WRITE,
-					MAP_SHARED, "/dev/mem", SBIOS_BASE);
+	mem_sbios = map_phys(SBIOS_BASE, SBIOS_SIZE);
 	if (!mem_sbios) {
 		ulog(LOG_ERR, "Failed to mmap the System BIOS as %5x.", SBIOS_BASE);
 		v86_mem_cleanup();
@@ -320,6 +590,298 @@ int v86_mem_init(void)
 	return 0;
 }
 
+/*
+ * Use 'load' to fill in the memory regions instead of mapping them from
+ * /dev/mem.  'load' copies 'size' bytes of the memory image starting at
+ * the physical address 'addr' to 'dest' and returns non-zero if the
+ * image doesn't cover that range.  Has to be called before v86_init().
+ */
+int v86_mem_set_loader(int (*load)(u32 addr, u32 size, void *dest))
+{
+	mem_loader = load;
+	return 0;
+}
+
+/*
+ * Pass the contents of all mapped memory regions to 'put'.
+ */
+int v86_mem_dump(int (*put)(u32 addr, u32 size, void *data))
+{
+	if (!mem_low || put(IVTBDA_BASE, IVTBDA_SIZE, mem_low))
+		return 1;
+
+	if (mem_ebda && put(ebda_start, ebda_size, mem_ebda + ebda_diff))
+		return 1;
+
+	if (put(VRAM_BASE, VRAM_SIZE, mem_vram) ||
+		put(VBIOS_BASE, vbios_size, mem_vbios) ||
+		put(SBIOS_BASE, SBIOS_SIZE, mem_sbios))
+		return 1;
+
+	return 0;
+}
+
+static int mem_image = -1;
+
+static int mem_image_load(u32 addr, u32 size, void *dest)
+{
+	ssize_t len;
+
+	len = pread(mem_image, dest, size, addr);
+	if (len != size) {
+		if (len < 0) {
+			ulog(LOG_ERR, "Reading the memory image at %05x failed with: %s\n",
+				 addr, strerror(errno));
+		} else {
+			ulog(LOG_ERR, "The memory image ends before %05x.\n",
+				 addr + size);
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Use the first megabyte of memory from the image file at 'path' in
+ * place of /dev/mem.  The image has to cover all of it.  There is no
+ * hardware behind such an image, so port I/O is virtualized as well.
+ * Has to be called before v86_init().
+ */
+int v86_mem_set_image(const char *path)
+{
+	mem_image = open(path, O_RDONLY);
+	if (mem_image == -1) {
+		ulog(LOG_ERR, "Open '%s' failed with: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	pio_hooks |= PIO_HOOK_VIRT;
+	return v86_mem_set_loader(mem_image_load);
+}
+
+/*
+ * Use the option ROM image at 'path' (e.g. the 'rom' file of a PCI
+ * device in sysfs) as the Video BIOS, in place of the one at C0000.
+ * Has to be called before v86_init().
+ */
+int v86_mem_set_rom(const char *path)
+{
+	mem_rom = path;
+	return 0;
+}
+
+/*
+ * Choose how the VGA window (A0000-BFFFF) is backed:
+ *
+ *  shared  - mapped from /dev/mem, every access goes to the hardware
+ *  private - private memory, the writes never reach the hardware
+ *  wc      - the writes are combined in private memory and flushed to
+ *            the hardware before every port write, every read from the
+ *            window and at the end of every call
+ *
+ * The window is usually mapped uncached, so the screen clears and font
+ * uploads done by mode sets are very slow with 'shared'.  'private' is
+ * only safe if the console doesn't use the legacy window (e.g. with
+ * uvesafb, which uses the linear framebuffer).  Reads of bytes that
+ * weren't written by the BIOS itself are counted and logged then, as
+ * their values would have come from the real VRAM.  Has to be called
+ * before v86_init().
+ */
+int v86_mem_set_vram(const char *policy)
+{
+	int i;
+
+	for (i = 0; i < sizeof(vram_names) / sizeof(*vram_names); i++) {
+		if (!strcmp(policy, vram_names[i]))
+			break;
+	}
+
+	if (i == sizeof(vram_names) / sizeof(*vram_names)) {
+		ulog(LOG_ERR, "Unknown VGA window policy '%s'.\n", policy);
+		return -1;
+	}
+
+	vram_policy = i;
+	mem_hooks &= ~MEM_HOOK_VRAM;
+	pio_hooks &= ~PIO_HOOK_VRAM;
+
+	if (vram_policy != VRAM_SHARED)
+		mem_hooks |= MEM_HOOK_VRAM;
+	if (vram_policy == VRAM_WC)
+		pio_hooks |= PIO_HOOK_VRAM;
+
+	return 0;
+}
+
+/*
+ * Called at the end of every call and before every port write.  Flushes
+ * the pending writes to the real window with 32-bit stores (VRAM_WC), or
+ * reports the reads of bytes the BIOS hadn't written (VRAM_PRIVATE).
+ */
+void v86_mem_vram_sync(void)
+{
+	volatile u8 *hw = vram_hw;
+	u32 i, start;
+
+	if (vram_policy == VRAM_PRIVATE) {
+		if (vram_stats.stale != vram_reported) {
+			ulog(LOG_WARNING, "The BIOS read %llu bytes of the VGA window "
+				 "that it hadn't written.\n",
+				 (unsigned long long)(vram_stats.stale - vram_reported));
+			vram_reported = vram_stats.stale;
+		}
+		return;
+	}
+
+	if (vram_policy != VRAM_WC || vram_lo >= vram_hi)
+		return;
+
+	for (i = vram_lo; i < vram_hi; ) {
+		if (!vram_bits[i >> 3]) {
+			i = (i | 7) + 1;
+			continue;
+		}
+		if (!vram_bit(i)) {
+			i++;
+			continue;
+		}
+
+		/* A run of pending bytes. */
+		for (start = i; i < vram_hi && vram_bit(i); i++)
+			vram_bits[i >> 3] &= ~(1 << (i & 7));
+
+		VRAM_LOCK();
+		vram_stats.flushed += i - start;
+		VRAM_UNLOCK();
+		for (; start & 3 && start < i; start++)
+			hw[start] = mem_vram[start];
+		for (; start + 4 <= i; start += 4)
+			*(volatile u32 *)(hw + start) = *(u32 *)(mem_vram + start);
+		for (; start < i; start++)
+			hw[start] = mem_vram[start];
+	}
+
+	vram_lo = VRAM_SIZE;
+	vram_hi = 0;
+	VRAM_LOCK();
+	vram_stats.flushes++;
+	VRAM_UNLOCK();
+}
+
+int v86_mem_vram_dump(char *buf, int size)
+{
+	int len;
+
+	VRAM_LOCK();
+	len = snprintf(buf, size, "VGA window: %s, %llu writes",
+				   vram_names[vram_policy],
+				   (unsigned long long)vram_stats.writes);
+
+	if (vram_policy == VRAM_WC)
+		len += snprintf(buf + len, size - len, ", %llu flushes of %llu bytes, "
+						"%llu reads", (unsigned long long)vram_stats.flushes,
+						(unsigned long long)vram_stats.flushed,
+						(unsigned long long)vram_stats.hw_reads);
+	else if (vram_policy == VRAM_PRIVATE)
+		len += snprintf(buf + len, size - len, ", %llu bytes read that the "
+						"BIOS hadn't written",
+						(unsigned long long)vram_stats.stale);
+	VRAM_UNLOCK();
+
+	len += snprintf(buf + len, size - len, "\n");
+	return (len < size) ? len : size - 1;
+}
+
+/*
+ * Touch every page of a private region for writing, so that neither a
+ * zero page nor a shared copy is left to be replaced on the first write.
+ */
+static void prefault(u8 *p, u32 size)
+{
+	volatile u8 *v = p;
+	u32 i;
+
+	if (!p)
+		return;
+
+	for (i = 0; i < size; i += 4096)
+		v[i] = v[i];
+}
+
+/*
+ * Fault in all the memory the guest can touch, for v86d -H.  Mappings
+ * of /dev/mem are populated by mmap() itself and are never touched
+ * here, as reads of the real VGA window are not free of side effects.
+ */
+void v86_mem_prefault(void)
+{
+	prefault(mem_real, REAL_MEM_SIZE);
+
+	if (vram_policy != VRAM_SHARED || mem_loader)
+		prefault(mem_vram, VRAM_SIZE);
+	if (mem_rom || mem_loader)
+		prefault(mem_vbios, vbios_size);
+
+	if (!mem_loader)
+		return;
+
+	prefault(mem_low, IVTBDA_SIZE);
+	prefault(mem_ebda, ebda_size + ebda_diff);
+	prefault(mem_sbios, SBIOS_SIZE);
+}
+
+/*
+ * Replace the mapping of 'len' bytes at '*m' with private memory.  The
+ * contents are copied over unless 'copy' is 0, in which case the new
+ * memory is zeroed.
+ */
+static int mem_unshare(u8 **m, size_t len, int copy)
+{
+	u8 *p;
+
+	if (!*m)
+		return 0;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == (void *)-1) {
+		ulog(LOG_ERR, "mmap of a private copy failed with: %s\n",
+			 strerror(errno));
+		return -1;
+	}
+
+	if (copy)
+		memcpy(p, *m, len);
+	munmap(*m, len);
+	*m = p;
+	return 0;
+}
+
+/*
+ * Turn all mappings of /dev/mem into private copies, so that writes of
+ * the guest never reach the real memory.  This is for processes that
+ * run BIOS calls in parallel with v86d (see v86_enum.c).  The real VGA
+ * window isn't read, as that is not free of side effects: it is
+ * replaced by zeroed memory, which also takes the writes flushed by
+ * VRAM_WC.  Returns 0 on success.
+ */
+int v86_mem_unshare(void)
+{
+	if (mem_loader)
+		return 0;
+
+	if (mem_unshare(&mem_low, IVTBDA_SIZE, 1) ||
+		mem_unshare(&mem_ebda, ebda_size + ebda_diff, 1) ||
+		mem_unshare(&mem_sbios, SBIOS_SIZE, 1) ||
+		(!mem_rom && mem_unshare(&mem_vbios, vbios_size, 1)) ||
+		(vram_policy == VRAM_SHARED && mem_unshare(&mem_vram, VRAM_SIZE, 0)) ||
+		mem_unshare(&vram_hw, VRAM_SIZE, 0))
+		return -1;
+
+	return 0;
+}
+
 void v86_mem_cleanup(void)
 {
 	if (mem_low)
@@ -327,16 +889,25 @@ void v86_mem_cleanup(void)
 
 	if (mem_ebda)
 		munmap(mem_ebda, ebda_size + ebda_diff);
+	free(saved_ebda);
+	saved_ebda = NULL;
 
 	if (mem_vram)
 		munmap(mem_vram, VRAM_SIZE);
 
+	if (vram_hw)
+		munmap(vram_hw, VRAM_SIZE);
+	vram_hw = NULL;
+
 	if (mem_vbios)
 		munmap(mem_vbios, vbios_size);
 
 	if (mem_sbios)
 		munmap(mem_sbios, SBIOS_SIZE);
 
+	/* Allow v86_mem_init() to be called again. */
+	mem_low = mem_ebda = mem_vram = mem_vbios = mem_sbios = NULL;
+
 	real_mem_deinit();
 }
 
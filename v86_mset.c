@@ -0,0 +1,376 @@
+#include <stdlib.h>
+#include <string.h>
+#include "v86.h"
+#include "v86_x86emu.h"
+
+/*
+ * Mode set replay.  The first successful 4F02 call for a given request
+ * and starting state is run in the emulator as usual, but all the port
+ * accesses and the memory writes it makes outside of the real mode
+ * scratch area (BDA, VRAM, EBDA, ...) are recorded, in order.  Later
+ * identical calls made from the same starting state don't run any BIOS
+ * code: the writes are replayed and the recorded reply is returned.
+ *
+ * The starting state is the video data area of the BDA.  Port reads
+ * made during replay are compared with the recorded values, and the
+ * call is emulated in full if any of them differ, except for ports
+ * whose value changes on its own (status registers, timers).  By then,
+ * some of the writes have already been replayed: the video data area
+ * is restored to the starting state and the stale recording is dropped,
+ * so that the emulated call is recorded again.
+ *
+ * Memory writes are coalesced into runs of consecutive bytes.  Runs in
+ * the VGA window are replayed one byte at a time, which is what the
+ * VGA write logic expects.
+ */
+
+#define MSET_MAX_OPS	65536
+#define MSET_MAX_DATA	(1 << 20)
+#define MSET_MAX_TRACES	64
+
+#define MSET_IN			1
+#define MSET_OUT		2
+#define MSET_MEM		3
+
+struct mset_op {
+	u8 type;
+	u8 size;		/* port access size */
+	u16 port;
+	u32 addr;		/* MSET_MEM: physical address */
+	u32 len;		/* MSET_MEM: length of the run */
+	u32 val;		/* value, or offset of the run in 'data' */
+};
+
+/* The part of the BDA describing the current video mode. */
+#define MSET_BDA_START	0x449
+#define MSET_BDA_LEN	(0x48b - MSET_BDA_START)
+
+struct mset {
+	struct mset *next;
+	u8 bda[MSET_BDA_LEN];
+	struct uvesafb_task *req;		/* followed by the buffer */
+	struct uvesafb_task *rep;		/* followed by the buffer */
+	struct mset_op *ops;
+	int nops;
+	u8 *data;
+	u32 dlen;
+	u32 dsize;		/* allocated size of 'data' */
+	u32 hits;
+};
+
+static struct mset *msets;
+static struct mset *mset_cur;		/* being recorded */
+static int mset_count;
+
+#ifdef CONFIG_THREADS
+static pthread_mutex_t mset_lock = PTHREAD_MUTEX_INITIALIZER;
+#define MSET_LOCK()		pthread_mutex_lock(&mset_lock)
+#define MSET_UNLOCK()	pthread_mutex_unlock(&mset_lock)
+#else
+#define MSET_LOCK()		do {} while (0)
+#define MSET_UNLOCK()	do {} while (0)
+#endif
+static u32 mset_replayed, mset_recorded, mset_mismatch, mset_dropped;
+
+int v86_mset_init(void)
+{
+	mset_enabled = 1;
+	return 0;
+}
+
+static void mset_free(struct mset *m)
+{
+	free(m->req);
+	free(m->rep);
+	free(m->ops);
+	free(m->data);
+	free(m);
+}
+
+static int mset_match(struct mset *m, struct uvesafb_task *tsk, u8 *buf)
+{
+	struct uvesafb_task *r = m->req;
+
+	return r->flags == tsk->flags && r->buf_len == tsk->buf_len &&
+		   !memcmp(&r->regs, &tsk->regs, sizeof(r->regs)) &&
+		   !memcmp(r + 1, buf, tsk->buf_len) &&
+		   !memcmp(m->bda, vptr(MSET_BDA_START), MSET_BDA_LEN);
+}
+
+static struct mset_op *mset_op_add(void)
+{
+	struct mset *m = mset_cur;
+
+	if (m->nops == MSET_MAX_OPS)
+		return NULL;
+
+	if (!(m->nops & 1023)) {
+		struct mset_op *t;
+
+		t = realloc(m->ops, (m->nops + 1024) * sizeof(*t));
+		if (!t)
+			return NULL;
+		m->ops = t;
+	}
+
+	return &m->ops[m->nops++];
+}
+
+/* Stop recording the current call, it won't be replayed. */
+static void mset_abort(void)
+{
+	mset_free(mset_cur);
+	mset_cur = NULL;
+	pio_hooks &= ~PIO_HOOK_MSET;
+	mem_hooks &= ~MEM_HOOK_MSET;
+	mset_dropped++;
+}
+
+void v86_mset_pio(int out, u16 port, int size, u32 val)
+{
+	struct mset_op *op;
+
+	if (!mset_cur)
+		return;
+
+	op = mset_op_add();
+	if (!op) {
+		mset_abort();
+		return;
+	}
+
+	op->type = out ? MSET_OUT : MSET_IN;
+	op->size = size;
+	op->port = port;
+	op->val = val;
+}
+
+void v86_mset_mem(u32 addr, int size, u32 val)
+{
+	struct mset *m = mset_cur;
+	struct mset_op *op;
+	u8 *t;
+
+	/* The stack and the task buffers are not part of the state. */
+	if (!m || (addr >= REAL_MEM_BASE && addr < REAL_MEM_BASE + REAL_MEM_SIZE))
+		return;
+
+	if (m->dlen + size > m->dsize) {
+		if (m->dsize == MSET_MAX_DATA) {
+			mset_abort();
+			return;
+		}
+
+		t = realloc(m->data, m->dsize + 0x10000);
+		if (!t) {
+			mset_abort();
+			return;
+		}
+		m->data = t;
+		m->dsize += 0x10000;
+	}
+
+	op = m->nops ? &m->ops[m->nops - 1] : NULL;
+	if (!op || op->type != MSET_MEM || op->addr + op->len != addr) {
+		op = mset_op_add();
+		if (!op) {
+			mset_abort();
+			return;
+		}
+		op->type = MSET_MEM;
+		op->addr = addr;
+		op->len = 0;
+		op->val = m->dlen;
+	}
+
+	memcpy(m->data + m->dlen, &val, size);
+	m->dlen += size;
+	op->len += size;
+}
+
+static int mset_volatile(u16 port)
+{
+	switch (port) {
+	case 0x3ba:		/* input status 1 */
+	case 0x3da:
+	case 0x3c2:		/* input status 0 */
+	case 0x40: case 0x41: case 0x42: case 0x43:
+	case 0x61:
+	case 0x80:
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Replay the writes made by 'm'.  Returns non-zero if a port read
+ * returned a different value than during the recording.
+ */
+static int mset_replay(struct mset *m)
+{
+	struct mset_op *op;
+	u8 *p;
+	u32 i;
+
+	for (op = m->ops; op < m->ops + m->nops; op++) {
+		switch (op->type) {
+		case MSET_OUT:
+			v86_pio_out(op->port, op->size, op->val);
+			break;
+
+		case MSET_IN:
+			if (v86_pio_in(op->port, op->size) != op->val &&
+				!mset_volatile(op->port)) {
+				ulog(LOG_DEBUG, "Mode set replay: port %x read back a "
+					 "different value.\n", op->port);
+				return 1;
+			}
+			break;
+
+		case MSET_MEM:
+			p = vptr(op->addr);
+			if (op->addr < VRAM_BASE || op->addr >= VRAM_BASE + VRAM_SIZE) {
+				/* Contiguous in our mapping as well? */
+				if (vptr(op->addr + op->len - 1) == p + op->len - 1) {
+					memcpy(p, m->data + op->val, op->len);
+					break;
+				}
+			}
+			for (i = 0; i < op->len; i++)
+				v_wrb(op->addr + i, m->data[op->val + i]);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Called before a task is run.  Returns 1 if the task has been
+ * completed by replaying an earlier mode set, 0 if it has to be run.
+ */
+int v86_mset_start(struct uvesafb_task *tsk, u8 *buf)
+{
+	struct mset *m, **pm;
+
+	if ((tsk->regs.eax & 0xffff) != 0x4f02 || rec_mode != REC_OFF)
+		return 0;
+
+	MSET_LOCK();
+	for (pm = &msets; (m = *pm); pm = &m->next) {
+		if (!mset_match(m, tsk, buf))
+			continue;
+
+		if (mset_replay(m)) {
+			/* m->bda is the state from before the call, see mset_match(). */
+			memcpy(vptr(MSET_BDA_START), m->bda, MSET_BDA_LEN);
+			*pm = m->next;
+			mset_free(m);
+			mset_count--;
+			mset_mismatch++;
+			m = NULL;
+			break;
+		}
+
+		if (mem_hooks & MEM_HOOK_VRAM)
+			v86_mem_vram_sync();
+
+		memcpy(tsk, m->rep, sizeof(*tsk));
+		memcpy(buf, m->rep + 1, tsk->buf_len);
+		m->hits++;
+		mset_replayed++;
+		MSET_UNLOCK();
+		return 1;
+	}
+	MSET_UNLOCK();
+
+	/* Record the call, unless it's already known. */
+	if (m || mset_count == MSET_MAX_TRACES)
+		return 0;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return 0;
+
+	m->req = malloc(sizeof(*tsk) + tsk->buf_len);
+	if (!m->req) {
+		free(m);
+		return 0;
+	}
+
+	memcpy(m->req, tsk, sizeof(*tsk));
+	memcpy(m->req + 1, buf, tsk->buf_len);
+	memcpy(m->bda, vptr(MSET_BDA_START), MSET_BDA_LEN);
+
+	mset_cur = m;
+	pio_hooks |= PIO_HOOK_MSET;
+	mem_hooks |= MEM_HOOK_MSET;
+	return 0;
+}
+
+/* Called after a task has been run in the emulator. */
+void v86_mset_end(struct uvesafb_task *tsk, u8 *buf, int err)
+{
+	struct mset *m = mset_cur;
+
+	if (!m)
+		return;
+
+	mset_cur = NULL;
+	pio_hooks &= ~PIO_HOOK_MSET;
+	mem_hooks &= ~MEM_HOOK_MSET;
+
+	if (err || (tsk->regs.eax & 0xffff) != 0x004f) {
+		mset_free(m);
+		return;
+	}
+
+	m->rep = malloc(sizeof(*tsk) + tsk->buf_len);
+	if (!m->rep) {
+		mset_free(m);
+		return;
+	}
+
+	memcpy(m->rep, tsk, sizeof(*tsk));
+	memcpy(m->rep + 1, buf, tsk->buf_len);
+
+	MSET_LOCK();
+	m->next = msets;
+	msets = m;
+	mset_count++;
+	mset_recorded++;
+	MSET_UNLOCK();
+}
+
+int v86_mset_dump(char *buf, int size)
+{
+	struct mset *m;
+	int len;
+
+	MSET_LOCK();
+	len = snprintf(buf, size, "recorded %u, replayed %u, mismatched %u, "
+				   "dropped %u\n", mset_recorded, mset_replayed,
+				   mset_mismatch, mset_dropped);
+
+	for (m = msets; m && len < size; m = m->next)
+		len += snprintf(buf + len, size - len, "mode %04x: %d ops, "
+				"%u bytes, %u hits\n", m->req->regs.ebx & 0xffff,
+				m->nops, m->dlen, m->hits);
+	MSET_UNLOCK();
+
+	return (len < size) ? len : size - 1;
+}
+
+void v86_mset_flush(void)
+{
+	struct mset *m;
+
+	MSET_LOCK();
+	while ((m = msets)) {
+		msets = m->next;
+		mset_free(m);
+	}
+	mset_count = 0;
+	MSET_UNLOCK();
+}
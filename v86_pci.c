@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include "v86.h"
+
+/*
+ * Virtual PCI configuration mechanism #1.  With the PIO_VIRT policy
+ * for ports 0xcf8 - 0xcff (e.g. '-I 0xcf8-0xcff=virtual'), the address
+ * written to 0xcf8 is latched here and the data port accesses are
+ * served from /sys/bus/pci/devices/<domain 0 bdf>/config.
+ *
+ * The kernel serializes the sysfs accesses with its own config space
+ * accesses, so an address/data pair can't be torn by another CPU
+ * writing to 0xcf8 in between, and writes reach the device exactly as
+ * the BIOS made them.  The read-only fields of the header (IDs, class
+ * code, header type, ...) are read once per function and served from
+ * memory afterwards, and functions which don't exist are remembered
+ * as such, which makes bus scans cheap.
+ *
+ * Without hardware (see v86_mem_set_image()), there are no devices.
+ */
+
+#define PCI_ADDR		0xcf8
+#define PCI_DATA		0xcfc
+#define PCI_ENABLE		0x80000000
+
+#define PCI_HDR_SIZE	64
+#define PCI_MAX_FUNCS	254
+
+/* pci_state[] values, other values are indices into pci_funcs + 1 */
+#define PCI_UNKNOWN		0
+#define PCI_ABSENT		0xff
+
+struct pci_func {
+	int fd;
+	u64 ro;					/* bytes of 'hdr' that are read-only */
+	u8 hdr[PCI_HDR_SIZE];
+};
+
+static u32 pci_addr;
+static u8 pci_state[0x10000];
+static struct pci_func pci_funcs[PCI_MAX_FUNCS];
+static int pci_nfuncs;
+
+static struct {
+	u64 reads;
+	u64 cached;				/* reads served from the header cache */
+	u64 writes;
+	u64 absent;				/* accesses to functions that don't exist */
+} pci_stats;
+
+/*
+ * Held around the accesses, which count in pci_stats and may add to
+ * pci_funcs, since the main thread dumps and resets the statistics.
+ */
+#ifdef CONFIG_THREADS
+static pthread_mutex_t pci_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PCI_LOCK()		pthread_mutex_lock(&pci_lock)
+#define PCI_UNLOCK()	pthread_mutex_unlock(&pci_lock)
+#else
+#define PCI_LOCK()		do {} while (0)
+#define PCI_UNLOCK()	do {} while (0)
+#endif
+
+/* Vendor/device ID, revision/class code, header type, capability
+ * pointer, interrupt pin. */
+#define PCI_RO_COMMON	(0xfULL | (0xfULL << 0x08) | (1ULL << 0x0e) | \
+						 (1ULL << 0x34) | (1ULL << 0x3d))
+/* Subsystem IDs, in type 0 headers only. */
+#define PCI_RO_TYPE0	(0xfULL << 0x2c)
+
+static struct pci_func *pci_lookup(u16 bdf)
+{
+	struct pci_func *f;
+	char path[64];
+	int fd;
+
+	if (pci_state[bdf] == PCI_ABSENT)
+		return NULL;
+	if (pci_state[bdf] != PCI_UNKNOWN)
+		return &pci_funcs[pci_state[bdf] - 1];
+
+	if (pio_hooks & PIO_HOOK_VIRT || pci_nfuncs == PCI_MAX_FUNCS) {
+		pci_state[bdf] = PCI_ABSENT;
+		return NULL;
+	}
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/0000:%02x:%02x.%x/config",
+			 bdf >> 8, (bdf >> 3) & 0x1f, bdf & 7);
+
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			ulog(LOG_WARNING, "Failed to open %s: %s\n", path, strerror(errno));
+		pci_state[bdf] = PCI_ABSENT;
+		return NULL;
+	}
+
+	f = &pci_funcs[pci_nfuncs];
+	if (pread(fd, f->hdr, PCI_HDR_SIZE, 0) != PCI_HDR_SIZE) {
+		close(fd);
+		pci_state[bdf] = PCI_ABSENT;
+		return NULL;
+	}
+
+	f->fd = fd;
+	f->ro = PCI_RO_COMMON;
+	if ((f->hdr[0x0e] & 0x7f) == 0)
+		f->ro |= PCI_RO_TYPE0;
+
+	pci_state[bdf] = ++pci_nfuncs;
+	return f;
+}
+
+static u32 pci_read(u16 bdf, u8 reg, int size)
+{
+	struct pci_func *f;
+	u32 val = 0xffffffff;
+	u64 mask;
+
+	PCI_LOCK();
+	pci_stats.reads++;
+
+	f = pci_lookup(bdf);
+	if (!f) {
+		pci_stats.absent++;
+		PCI_UNLOCK();
+		return val;
+	}
+
+	mask = (reg + size <= PCI_HDR_SIZE) ? ((1ULL << size) - 1) << reg : 0;
+	if (mask && (f->ro & mask) == mask) {
+		memcpy(&val, f->hdr + reg, size);
+		pci_stats.cached++;
+	} else if (pread(f->fd, &val, size, reg) != size) {
+		val = 0xffffffff;
+	}
+	PCI_UNLOCK();
+
+	return val;
+}
+
+static void pci_write(u16 bdf, u8 reg, int size, u32 val)
+{
+	struct pci_func *f;
+
+	PCI_LOCK();
+	pci_stats.writes++;
+
+	f = pci_lookup(bdf);
+	if (!f) {
+		pci_stats.absent++;
+		PCI_UNLOCK();
+		return;
+	}
+
+	if (pwrite(f->fd, &val, size, reg) != size)
+		ulog(LOG_DEBUG, "PCI config write to %02x:%02x.%x/%02x failed.\n",
+			 bdf >> 8, (bdf >> 3) & 0x1f, bdf & 7, reg);
+	PCI_UNLOCK();
+}
+
+/*
+ * Only 32-bit accesses to 0xcf8 reach the address register.  Narrower
+ * ones go to other registers on real chipsets (e.g. the reset control
+ * at 0xcf9) and are ignored.
+ */
+static u32 pci_in(u16 port, int size)
+{
+	u32 mask = (size == 4) ? 0xffffffff : (1 << (size * 8)) - 1;
+
+	if (port < PCI_DATA)
+		return (port == PCI_ADDR && size == 4) ? pci_addr : mask;
+
+	if (!(pci_addr & PCI_ENABLE))
+		return mask;
+
+	return pci_read(pci_addr >> 8, (pci_addr & 0xfc) + (port & 3), size) & mask;
+}
+
+static void pci_out(u16 port, int size, u32 val)
+{
+	if (port < PCI_DATA) {
+		if (port == PCI_ADDR && size == 4)
+			pci_addr = val;
+		return;
+	}
+
+	if (pci_addr & PCI_ENABLE)
+		pci_write(pci_addr >> 8, (pci_addr & 0xfc) + (port & 3), size, val);
+}
+
+static struct pio_dev pci_dev = {
+	.name = "pci",
+	.in = pci_in,
+	.out = pci_out,
+};
+
+/* Attach the model to the configuration ports. */
+int v86_pci_init(void)
+{
+	static int registered;
+
+	pci_addr = 0;
+
+	if (registered)
+		return 0;
+
+	registered = 1;
+	return pio_register(PCI_ADDR, PCI_DATA + 3, &pci_dev);
+}
+
+int v86_pci_dump(char *buf, int size)
+{
+	int len = 0;
+
+	PCI_LOCK();
+	if (pci_stats.reads || pci_stats.writes)
+		len = snprintf(buf, size, "\npci: %llu reads (%llu cached), "
+					   "%llu writes, %llu to absent functions, %d functions\n",
+					   (unsigned long long)pci_stats.reads,
+					   (unsigned long long)pci_stats.cached,
+					   (unsigned long long)pci_stats.writes,
+					   (unsigned long long)pci_stats.absent, pci_nfuncs);
+	PCI_UNLOCK();
+
+	return (len < size) ? len : size - 1;
+}
+
+void v86_pci_reset(void)
+{
+	PCI_LOCK();
+	memset(&pci_stats, 0, sizeof(pci_stats));
+	PCI_UNLOCK();
+}
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "v86.h"
+
+/*
+ * Port I/O policy table.  Every port is either passed through to the
+ * hardware, handled by a virtual device (PIO_VIRT), read from the
+ * hardware once and then served from memory (PIO_CACHE), or not
+ * accessed at all (PIO_DISCARD).  Virtual ports without a device
+ * behave like an empty bus: reads return all ones and writes are
+ * dropped.  Discarded writes are remembered, reads return the last
+ * value written (all ones before that), like the POST code latch of
+ * port 0x80 does.  Writes to cached ports go to the hardware and drop
+ * the cached value.
+ *
+ * Writes to port 0x80 (POST codes, I/O delays) and 0xed (I/O delays)
+ * are discarded by default.  All other ports are passed through.
+ *
+ * The table is consulted by the port accessors for every access, but
+ * only the policy byte of the port; everything else happens on the
+ * slow path, which is also taken for all ports when pio_hooks != 0.
+ * Without hardware (PIO_HOOK_VIRT), all ports are treated as virtual.
+ */
+
+#define PIO_MAX_DEVS	16
+
+struct pio_port pio_ports[PIO_PORTS] = {
+	[0x80] = { .policy = PIO_DISCARD },
+	[0xed] = { .policy = PIO_DISCARD },
+};
+
+static struct pio_dev *pio_devs[PIO_MAX_DEVS];
+static int pio_ndevs = 1;
+
+struct pio_stat pio_stats[PIO_POLICIES];
+u64 pio_run_cycles;		/* TSC cycles spent in the emulator */
+
+/*
+ * The statistics are updated by the worker thread and dumped or reset
+ * by the main thread (control socket).
+ */
+#ifdef CONFIG_THREADS
+static pthread_mutex_t pio_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PIO_LOCK()		pthread_mutex_lock(&pio_lock)
+#define PIO_UNLOCK()	pthread_mutex_unlock(&pio_lock)
+#else
+#define PIO_LOCK()		do {} while (0)
+#define PIO_UNLOCK()	do {} while (0)
+#endif
+
+static const char *pio_names[PIO_POLICIES] = {
+	"pass", "virtual", "cached", "discard",
+};
+
+/*
+ * Attach 'dev' to the ports first - last.  The policy of the ports is
+ * not changed.
+ */
+int pio_register(u16 first, u16 last, struct pio_dev *dev)
+{
+	u32 i;
+
+	if (pio_ndevs == PIO_MAX_DEVS)
+		return -1;
+
+	pio_devs[pio_ndevs] = dev;
+	for (i = first; i <= last; i++)
+		pio_ports[i].dev = pio_ndevs;
+	pio_ndevs++;
+
+	return 0;
+}
+
+/* The policy to apply to an access to 'port'. */
+int pio_policy(u16 port)
+{
+	if (pio_hooks & PIO_HOOK_VIRT)
+		return PIO_VIRT;
+
+	return pio_ports[port].policy;
+}
+
+/*
+ * A byte access to a device, which may only handle sized accesses: the
+ * split accesses below can run into such a device from a lower port.
+ */
+static u8 pio_dev_inb(struct pio_dev *dev, u16 port)
+{
+	if (!dev)
+		return 0xff;
+	return dev->inb ? dev->inb(port) : dev->in(port, 1);
+}
+
+static void pio_dev_outb(struct pio_dev *dev, u16 port, u8 value)
+{
+	if (!dev)
+		return;
+	if (dev->outb)
+		dev->outb(port, value);
+	else
+		dev->out(port, 1, value);
+}
+
+/*
+ * Read from a virtual port.  Accesses wider than a byte are split into
+ * byte accesses to consecutive ports, which is what the ISA bus does,
+ * unless the device handles them itself.
+ */
+u32 pio_virt_in(u16 port, int size)
+{
+	struct pio_dev *dev;
+	u32 value = 0;
+	int i;
+
+	dev = pio_devs[pio_ports[port].dev];
+	if (dev && dev->in)
+		return dev->in(port, size);
+
+	for (i = 0; i < size; i++) {
+		dev = pio_devs[pio_ports[(u16)(port + i)].dev];
+		value |= (u32)pio_dev_inb(dev, port + i) << (i * 8);
+	}
+
+	return value;
+}
+
+void pio_virt_out(u16 port, int size, u32 value)
+{
+	struct pio_dev *dev;
+	int i;
+
+	dev = pio_devs[pio_ports[port].dev];
+	if (dev && dev->out) {
+		dev->out(port, size, value);
+		return;
+	}
+
+	for (i = 0; i < size; i++) {
+		dev = pio_devs[pio_ports[(u16)(port + i)].dev];
+		pio_dev_outb(dev, port + i, value >> (i * 8));
+	}
+}
+
+/*
+ * Serve a read of a PIO_CACHE or PIO_DISCARD port from memory.  Returns
+ * 0 if the read has to go to the hardware.
+ */
+int pio_cache_in(u16 port, int size, int policy, u32 *value)
+{
+	struct pio_port *p;
+	u32 v = 0;
+	int i;
+
+	for (i = 0; i < size; i++) {
+		p = &pio_ports[(u16)(port + i)];
+		if (p->cvalid)
+			v |= (u32)p->cval << (i * 8);
+		else if (policy == PIO_DISCARD)
+			v |= (u32)0xff << (i * 8);
+		else
+			return 0;
+	}
+
+	*value = v;
+	return 1;
+}
+
+/* Account a port access that took 'cycles' TSC cycles. */
+void pio_stats_add(int policy, u64 cycles)
+{
+	PIO_LOCK();
+	pio_stats[policy].count++;
+	pio_stats[policy].cycles += cycles;
+	PIO_UNLOCK();
+}
+
+/* Account a run of the emulator that took 'cycles' TSC cycles. */
+void pio_run_add(u64 cycles)
+{
+	PIO_LOCK();
+	pio_run_cycles += cycles;
+	PIO_UNLOCK();
+}
+
+/* Remember the value read from or written to a port. */
+void pio_cache_put(u16 port, int size, u32 value)
+{
+	struct pio_port *p;
+	int i;
+
+	for (i = 0; i < size; i++) {
+		p = &pio_ports[(u16)(port + i)];
+		p->cval = value >> (i * 8);
+		p->cvalid = 1;
+	}
+}
+
+void pio_cache_drop(u16 port, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++)
+		pio_ports[(u16)(port + i)].cvalid = 0;
+}
+
+static int pio_policy_parse(const char *name)
+{
+	int i;
+
+	if (!strcmp(name, "passthrough"))
+		return PIO_PASS;
+
+	for (i = 0; i < PIO_POLICIES; i++) {
+		if (!strcmp(name, pio_names[i]))
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Set the policy of a group of ports.  'spec' is a comma-separated list
+ * of <port>[-<port>]=<policy> entries, e.g. "0x3c0-0x3df=virtual", where
+ * <policy> is one of pass, virtual, cached and discard.
+ * Configuring the table makes all port accesses take the slow path, so
+ * that they can be accounted for.
+ */
+int v86_pio_config(const char *spec)
+{
+	char buf[256], *s, *t, *end;
+	unsigned long first, last, i;
+	int policy;
+
+	if (strlen(spec) >= sizeof(buf))
+		return -1;
+	strcpy(buf, spec);
+
+	for (s = strtok(buf, ","); s; s = strtok(NULL, ",")) {
+		t = strchr(s, '=');
+		if (!t)
+			goto err;
+		*t++ = 0;
+
+		/* strtoul() would take an empty number as 0 and skip blanks. */
+		policy = pio_policy_parse(t);
+		if (!isdigit((unsigned char)*s))
+			goto err;
+		first = strtoul(s, &end, 0);
+		last = first;
+		if (*end == '-') {
+			if (!isdigit((unsigned char)end[1]))
+				goto err;
+			last = strtoul(end + 1, &end, 0);
+		}
+
+		if (policy < 0 || *end || first > last || last >= PIO_PORTS)
+			goto err;
+
+		for (i = first; i <= last; i++) {
+			pio_ports[i].policy = policy;
+			pio_ports[i].cvalid = 0;
+		}
+	}
+
+	pio_hooks |= PIO_HOOK_TABLE;
+	return 0;
+
+err:
+	ulog(LOG_ERR, "Invalid port I/O policy: %s\n", spec);
+	return -1;
+}
+
+/*
+ * Print the number of port accesses and the average number of TSC
+ * cycles they took, for every policy, followed by the split of the time
+ * spent running BIOS code between port I/O and the emulation itself,
+ * and an estimate of the time saved by the cached and discarded
+ * accesses.  Cached reads that had to go to the hardware are counted
+ * as passed through.  Returns the length of the output.
+ */
+int v86_pio_dump(char *buf, int size)
+{
+	struct pio_stat *st;
+	u64 io = 0, removed, pass;
+	int i, len;
+
+	PIO_LOCK();
+	len = snprintf(buf, size, "%-8s %12s %12s\n", "policy", "accesses",
+				   "cycles/acc");
+
+	for (i = 0; i < PIO_POLICIES && len < size; i++) {
+		st = &pio_stats[i];
+		len += snprintf(buf + len, size - len, "%-8s %12llu %12llu\n",
+				pio_names[i], (unsigned long long)st->count,
+				(unsigned long long)(st->count ? st->cycles / st->count : 0));
+		io += st->cycles;
+	}
+
+	if (len < size)
+		len += snprintf(buf + len, size - len,
+				"\ncycles: total %llu, port I/O %llu, emulation %llu\n",
+				(unsigned long long)pio_run_cycles, (unsigned long long)io,
+				(unsigned long long)(pio_run_cycles > io ? pio_run_cycles - io : 0));
+
+	st = &pio_stats[PIO_PASS];
+	removed = pio_stats[PIO_CACHE].count + pio_stats[PIO_DISCARD].count;
+	pass = st->count ? st->cycles / st->count : 0;
+	if (len < size && removed)
+		len += snprintf(buf + len, size - len,
+				"removed: %llu accesses, ~%llu cycles at %llu cycles/acc\n",
+				(unsigned long long)removed,
+				(unsigned long long)(removed * pass),
+				(unsigned long long)pass);
+	PIO_UNLOCK();
+
+	if (len < size)
+		len += v86_pci_dump(buf + len, size - len);
+
+	return (len < size) ? len : size - 1;
+}
+
+void v86_pio_reset(void)
+{
+	PIO_LOCK();
+	memset(pio_stats, 0, sizeof(pio_stats));
+	pio_run_cycles = 0;
+	PIO_UNLOCK();
+	v86_pci_reset();
+}
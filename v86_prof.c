@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <x86emu.h>
+#include "v86.h"
+#include "v86_x86emu.h"
+
+/*
+ * Sampling profiler of the guest code (x86emu only).  The guest call
+ * stack is tracked through the emulator's flow hook: every CALL or INT
+ * into guest code pushes a frame named after its target, every RET or
+ * IRET pops the frames whose return address lies below the new stack
+ * pointer, which also copes with BIOS code that unwinds the stack by
+ * hand.  Every 'period' instructions the current stack is sampled.
+ *
+ * The samples are written in the folded stack format, one line per
+ * distinct stack ("4f02;rom+01a2;rom+0455 17"), which flame graph tools
+ * read directly.  The root frame is the VBE function (or the interrupt)
+ * the call was made for.  Frames in the video BIOS are named by their
+ * offset in the ROM, or after the symbol from the map file covering it.
+ */
+
+#define PROF_SHADOW		256		/* tracked call depth */
+#define PROF_DEPTH		32		/* frames kept per sample */
+#define PROF_STACKS		2048	/* distinct stacks */
+
+struct prof_stack {
+	u32 hash;
+	u32 count;
+	u32 depth;				/* 0 = free slot */
+	u32 frames[PROF_DEPTH];	/* [0] is the root */
+};
+
+struct prof_sym {
+	u32 off;
+	char *name;
+};
+
+u32 prof_period;
+
+static const char *prof_path;
+static struct prof_stack prof_tab[PROF_STACKS];
+static u32 prof_samples, prof_dropped;
+
+static struct {
+	u32 entry;				/* linear address of the callee */
+	u32 sp;					/* linear address of the return address */
+} shadow[PROF_SHADOW];
+static int shadow_depth;
+static u32 prof_root;
+
+static struct prof_sym *syms;
+static int nsyms;
+
+#ifdef CONFIG_THREADS
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PROF_LOCK()		pthread_mutex_lock(&prof_lock)
+#define PROF_UNLOCK()	pthread_mutex_unlock(&prof_lock)
+#else
+#define PROF_LOCK()		do {} while (0)
+#define PROF_UNLOCK()	do {} while (0)
+#endif
+
+/* Root frames are not linear addresses, see v86_prof_enter(). */
+#define ROOT_VBE		0x80000000
+#define ROOT_INT		0x40000000
+#define ROOT_CALL		0x20000000
+
+static inline u32 stack_ptr(void)
+{
+	return ((u32)X86_SS << 4) + X86_SP;
+}
+
+static void prof_flow(int type)
+{
+	u32 sp = stack_ptr();
+
+	if (type == X86EMU_FLOW_RET) {
+		while (shadow_depth && shadow[shadow_depth - 1].sp < sp)
+			shadow_depth--;
+		return;
+	}
+
+	/* Frames beyond PROF_SHADOW are dropped; they return above them. */
+	if (shadow_depth < PROF_SHADOW) {
+		shadow[shadow_depth].entry = ((u32)X86_CS << 4) + X86_IP;
+		shadow[shadow_depth++].sp = sp;
+	}
+}
+
+/*
+ * Start tracking a new call.  'num' is the interrupt number, or -1 for
+ * a far call.
+ */
+void v86_prof_enter(int num, struct v86_regs *regs)
+{
+	shadow_depth = 0;
+
+	if (num == 0x10 && (regs->eax & 0xff00) == 0x4f00)
+		prof_root = ROOT_VBE | (regs->eax & 0xffff);
+	else if (num >= 0)
+		prof_root = ROOT_INT | (num << 8) | ((regs->eax >> 8) & 0xff);
+	else
+		prof_root = ROOT_CALL;
+}
+
+/* Record the current guest call stack. */
+void v86_prof_sample(void)
+{
+	struct prof_stack *s;
+	u32 frames[PROF_DEPTH], hash = 2166136261u;
+	int depth, i, n;
+
+	frames[0] = prof_root;
+	depth = shadow_depth + 1 < PROF_DEPTH ? shadow_depth + 1 : PROF_DEPTH;
+	for (i = 1; i < depth; i++)
+		frames[i] = shadow[i - 1].entry;
+
+	for (i = 0; i < depth; i++)
+		hash = (hash ^ frames[i]) * 16777619u;
+
+	PROF_LOCK();
+	prof_samples++;
+	for (n = 0; n < PROF_STACKS; n++) {
+		s = &prof_tab[(hash + n) % PROF_STACKS];
+
+		if (!s->depth) {
+			s->hash = hash;
+			s->depth = depth;
+			memcpy(s->frames, frames, depth * sizeof(u32));
+			break;
+		}
+
+		if (s->hash == hash && s->depth == depth &&
+			!memcmp(s->frames, frames, depth * sizeof(u32)))
+			break;
+	}
+
+	if (n < PROF_STACKS)
+		s->count++;
+	else
+		prof_dropped++;
+	PROF_UNLOCK();
+}
+
+static int sym_cmp(const void *a, const void *b)
+{
+	const struct prof_sym *x = a, *y = b;
+
+	return (x->off > y->off) - (x->off < y->off);
+}
+
+/*
+ * Load a symbol map: one "<hex ROM offset> <name>" per line, lines
+ * starting with '#' are ignored.
+ */
+static int prof_load_map(const char *path)
+{
+	char line[256], name[128];
+	struct prof_sym *n;
+	unsigned int off;
+	int size = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		ulog(LOG_ERR, "Failed to open the symbol map %s: %s\n", path,
+			 strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%x %127s", &off, name) != 2)
+			continue;
+
+		if (nsyms == size) {
+			size = size ? size * 2 : 256;
+			n = realloc(syms, size * sizeof(*syms));
+			if (!n)
+				break;
+			syms = n;
+		}
+
+		syms[nsyms].off = off;
+		syms[nsyms++].name = strdup(name);
+	}
+	fclose(f);
+
+	qsort(syms, nsyms, sizeof(*syms), sym_cmp);
+	ulog(LOG_DEBUG, "Loaded %d symbols from %s\n", nsyms, path);
+	return 0;
+}
+
+static void prof_name(FILE *f, u32 frame)
+{
+	int lo = 0, hi = nsyms, mid;
+	u32 off;
+
+	if (frame & ROOT_VBE) {
+		fprintf(f, "%04x", frame & 0xffff);
+		return;
+	} else if (frame & ROOT_INT) {
+		fprintf(f, "int%02x.%02x", (frame >> 8) & 0xff, frame & 0xff);
+		return;
+	} else if (frame & ROOT_CALL) {
+		fprintf(f, "call");
+		return;
+	}
+
+	if (frame < VBIOS_BASE || frame >= SBIOS_BASE) {
+		fprintf(f, "%05x", frame);
+		return;
+	}
+
+	/* Find the last symbol at or below the offset. */
+	off = frame - VBIOS_BASE;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (syms[mid].off <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo)
+		fprintf(f, "rom+%04x", off);
+	else if (syms[lo - 1].off == off)
+		fprintf(f, "%s", syms[lo - 1].name);
+	else
+		fprintf(f, "%s+%x", syms[lo - 1].name, off - syms[lo - 1].off);
+}
+
+/*
+ * Sample the guest call stack every 'period' instructions, and write
+ * the folded stacks to 'path' with v86_prof_write().  'map' is an
+ * optional symbol map.
+ */
+int v86_prof_init(const char *path, u32 period, const char *map)
+{
+	if (!period) {
+		ulog(LOG_ERR, "The profiling period must not be 0.\n");
+		return -1;
+	}
+
+	if (map && prof_load_map(map))
+		return -1;
+
+	prof_path = path;
+	prof_period = period;
+	X86EMU_setupFlowHook(prof_flow);
+	return 0;
+}
+
+/* Write the samples collected so far to the output file. */
+int v86_prof_write(void)
+{
+	FILE *f;
+	int i, j;
+
+	if (!prof_path)
+		return 0;
+
+	f = fopen(prof_path, "w");
+	if (!f) {
+		ulog(LOG_ERR, "Failed to open %s: %s\n", prof_path, strerror(errno));
+		return -1;
+	}
+
+	PROF_LOCK();
+	for (i = 0; i < PROF_STACKS; i++) {
+		if (!prof_tab[i].count)
+			continue;
+
+		for (j = 0; j < prof_tab[i].depth; j++) {
+			if (j)
+				fputc(';', f);
+			prof_name(f, prof_tab[i].frames[j]);
+		}
+		fprintf(f, " %u\n", prof_tab[i].count);
+	}
+	PROF_UNLOCK();
+
+	return fclose(f) ? -1 : 0;
+}
+
+int v86_prof_dump(char *buf, int size)
+{
+	int len, i, stacks = 0;
+
+	if (!prof_path)
+		return snprintf(buf, size, "profiling: off\n");
+
+	PROF_LOCK();
+	for (i = 0; i < PROF_STACKS; i++)
+		stacks += prof_tab[i].depth != 0;
+
+	len = snprintf(buf, size, "profiling: every %u instructions, %u samples, "
+				   "%d stacks, %u dropped\n", prof_period, prof_samples,
+				   stacks, prof_dropped);
+	PROF_UNLOCK();
+
+	return (len < size) ? len : size - 1;
+}
+
+void v86_prof_reset(void)
+{
+	PROF_LOCK();
+	memset(prof_tab, 0, sizeof(prof_tab));
+	prof_samples = prof_dropped = 0;
+	PROF_UNLOCK();
+}
+
+void v86_prof_cleanup(void)
+{
+	int i;
+
+	if (!prof_path)
+		return;
+
+	v86_prof_write();
+	X86EMU_setupFlowHook(NULL);
+	prof_path = NULL;
+	prof_period = 0;
+
+	for (i = 0; i < nsyms; i++)
+		free(syms[i].name);
+	free(syms);
+	syms = NULL;
+	nsyms = 0;
+}
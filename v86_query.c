@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <sys/un.h>
+
+#include "v86.h"
+#include "v86q.h"
+
+/*
+ * Query socket.  v86d keeps a copy of the controller info, the mode
+ * info blocks and the EDID it has obtained for the kernel (or during
+ * the mode enumeration), and answers queries from other programs from
+ * it, without running any BIOS code.  See v86q.h for the protocol and
+ * the client library.
+ *
+ * The socket is served by the main thread, up to QUERY_MAX_CLIENTS
+ * connections at a time, each carrying any number of queries.
+ */
+
+#define QUERY_MAX_MODES		256
+
+static struct {
+	int info_len;			/* 0 = not known yet */
+	u8 info[sizeof(struct vbe_ib)];
+	int nmodes;
+	u16 modes[QUERY_MAX_MODES];
+	int nmibs;
+	struct {
+		u16 mode;
+		u8 mib[V86Q_MIB_SIZE];
+	} mibs[QUERY_MAX_MODES];
+	int edid_valid;
+	u8 edid[V86Q_EDID_SIZE];
+} qtab;
+
+#ifdef CONFIG_THREADS
+static pthread_mutex_t query_lock = PTHREAD_MUTEX_INITIALIZER;
+#define QUERY_LOCK()	pthread_mutex_lock(&query_lock)
+#define QUERY_UNLOCK()	pthread_mutex_unlock(&query_lock)
+#else
+#define QUERY_LOCK()	do {} while (0)
+#define QUERY_UNLOCK()	do {} while (0)
+#endif
+
+static int q_listen = -1;
+static int q_conns[QUERY_MAX_CLIENTS];
+static char q_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+static void note_info(struct uvesafb_task *tsk, u8 *buf)
+{
+	struct vbe_ib *ib = (struct vbe_ib *)qtab.info;
+	u16 *m;
+	int len = tsk->buf_len;
+
+	if (len > sizeof(qtab.info))
+		len = sizeof(qtab.info);
+
+	memset(qtab.info, 0, sizeof(qtab.info));
+	memcpy(qtab.info, buf, len);
+	qtab.info_len = len;
+	qtab.nmodes = 0;
+
+	if (ib->mode_list_ptr >= len)
+		return;
+
+	m = (u16 *)(qtab.info + ib->mode_list_ptr);
+	while ((u8 *)(m + 1) <= qtab.info + len && *m != 0xffff &&
+		   qtab.nmodes < QUERY_MAX_MODES)
+		qtab.modes[qtab.nmodes++] = *m++;
+}
+
+static void note_mode(u16 mode, struct uvesafb_task *tsk, u8 *buf)
+{
+	int i, len = tsk->buf_len;
+
+	for (i = 0; i < qtab.nmibs; i++) {
+		if (qtab.mibs[i].mode == mode)
+			break;
+	}
+
+	if (i == QUERY_MAX_MODES)
+		return;
+	if (i == qtab.nmibs)
+		qtab.nmibs++;
+
+	if (len > V86Q_MIB_SIZE)
+		len = V86Q_MIB_SIZE;
+
+	qtab.mibs[i].mode = mode;
+	memset(qtab.mibs[i].mib, 0, V86Q_MIB_SIZE);
+	memcpy(qtab.mibs[i].mib, buf, len);
+}
+
+/*
+ * Remember the result of a successful task.  'req' are the registers
+ * the task was started with, 'tsk' and 'buf' the reply.
+ */
+void query_note(struct v86_regs *req, struct uvesafb_task *tsk, u8 *buf)
+{
+	if ((tsk->regs.eax & 0xffff) != 0x004f)
+		return;
+
+	QUERY_LOCK();
+	switch (req->eax & 0xffff) {
+	case 0x4f00:
+		if (tsk->flags & TF_VBEIB)
+			note_info(tsk, buf);
+		break;
+
+	case 0x4f01:
+		note_mode(req->ecx & 0xffff, tsk, buf);
+		break;
+
+	case 0x4f15:
+		/* Read EDID, controller 0, block 0 */
+		if ((req->ebx & 0xff) == 1 && !(req->ecx & 0xffff) &&
+			!(req->edx & 0xffff) && tsk->buf_len >= V86Q_EDID_SIZE) {
+			memcpy(qtab.edid, buf, V86Q_EDID_SIZE);
+			qtab.edid_valid = 1;
+		}
+		break;
+	}
+	QUERY_UNLOCK();
+}
+
+/* Fill in the reply data.  Returns its length or a negative errno. */
+static int query_exec(struct v86q_req *req, u8 *out, int size)
+{
+	int i, len = -ENOENT;
+
+	if (req->type == V86Q_STATS)
+		return v86_stats_dump((char *)out, size, STATS_FMT_TEXT);
+	if (req->type == V86Q_COST)
+		return v86_stats_dump((char *)out, size, STATS_FMT_COST);
+
+	QUERY_LOCK();
+	switch (req->type) {
+	case V86Q_INFO:
+		if (qtab.info_len) {
+			len = qtab.info_len;
+			memcpy(out, qtab.info, len);
+		}
+		break;
+
+	case V86Q_MODES:
+		if (qtab.info_len) {
+			len = qtab.nmodes * sizeof(u16);
+			memcpy(out, qtab.modes, len);
+		}
+		break;
+
+	case V86Q_MODE:
+		for (i = 0; i < qtab.nmibs; i++) {
+			if (qtab.mibs[i].mode == req->arg) {
+				len = V86Q_MIB_SIZE;
+				memcpy(out, qtab.mibs[i].mib, len);
+				break;
+			}
+		}
+		break;
+
+	case V86Q_EDID:
+		if (qtab.edid_valid) {
+			len = V86Q_EDID_SIZE;
+			memcpy(out, qtab.edid, len);
+		}
+		break;
+
+	default:
+		len = -EINVAL;
+	}
+	QUERY_UNLOCK();
+
+	return len;
+}
+
+int query_init(const char *path)
+{
+	struct sockaddr_un addr;
+	int i;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		ulog(LOG_ERR, "Query socket path too long: %s\n", path);
+		return -1;
+	}
+
+	q_listen = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (q_listen == -1) {
+		ulog(LOG_ERR, "Failed to create the query socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (bind(q_listen, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+		listen(q_listen, 4) == -1) {
+		ulog(LOG_ERR, "Failed to bind the query socket to %s: %s\n",
+			 path, strerror(errno));
+		close(q_listen);
+		q_listen = -1;
+		return -1;
+	}
+
+	for (i = 0; i < QUERY_MAX_CLIENTS; i++)
+		q_conns[i] = -1;
+
+	strcpy(q_path, path);
+	return 0;
+}
+
+/*
+ * Fill in the descriptors to poll: the listening socket, unless all
+ * connection slots are taken, and the connections.  Returns their
+ * number, at most QUERY_MAX_CLIENTS + 1.
+ */
+int query_fds(struct pollfd *pfd)
+{
+	int i, n = 0, free = 0;
+
+	if (q_listen == -1)
+		return 0;
+
+	for (i = 0; i < QUERY_MAX_CLIENTS; i++) {
+		if (q_conns[i] == -1) {
+			free++;
+			continue;
+		}
+		pfd[n].fd = q_conns[i];
+		pfd[n].events = POLLIN;
+		pfd[n++].revents = 0;
+	}
+
+	if (free) {
+		pfd[n].fd = q_listen;
+		pfd[n].events = POLLIN;
+		pfd[n++].revents = 0;
+	}
+
+	return n;
+}
+
+static void query_serve(int *c)
+{
+	static u8 out[sizeof(struct v86q_rep) + V86Q_MAX_REPLY];
+	struct v86q_rep *rep = (struct v86q_rep *)out;
+	struct v86q_req req;
+	int len;
+
+	len = recv(*c, &req, sizeof(req), MSG_DONTWAIT);
+	if (len <= 0) {
+		if (len == 0 || errno != EAGAIN) {
+			close(*c);
+			*c = -1;
+		}
+		return;
+	}
+
+	if (len != sizeof(req)) {
+		len = -EINVAL;
+	} else {
+		len = query_exec(&req, out + sizeof(*rep), V86Q_MAX_REPLY);
+	}
+
+	rep->status = (len < 0) ? len : 0;
+	rep->len = (len < 0) ? 0 : len;
+
+	if (send(*c, out, sizeof(*rep) + rep->len, MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+		close(*c);
+		*c = -1;
+	}
+}
+
+/* Handle the events reported for the descriptors from query_fds(). */
+void query_handle(struct pollfd *pfd, int n)
+{
+	int i, j, c;
+
+	for (i = 0; i < n; i++) {
+		if (!pfd[i].revents)
+			continue;
+
+		if (pfd[i].fd != q_listen) {
+			for (j = 0; j < QUERY_MAX_CLIENTS; j++) {
+				if (q_conns[j] == pfd[i].fd)
+					query_serve(&q_conns[j]);
+			}
+			continue;
+		}
+
+		c = accept(q_listen, NULL, NULL);
+		if (c == -1)
+			continue;
+
+		for (j = 0; j < QUERY_MAX_CLIENTS && q_conns[j] != -1; j++)
+			;
+		if (j < QUERY_MAX_CLIENTS)
+			q_conns[j] = c;
+		else
+			close(c);
+	}
+}
+
+void query_cleanup(void)
+{
+	int i;
+
+	if (q_listen == -1)
+		return;
+
+	for (i = 0; i < QUERY_MAX_CLIENTS; i++) {
+		if (q_conns[i] != -1)
+			close(q_conns[i]);
+		q_conns[i] = -1;
+	}
+
+	close(q_listen);
+	unlink(q_path);
+	q_listen = -1;
+}
@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "v86.h"
+
+/*
+ * Record and replay of BIOS sessions.
+ *
+ * A recording starts with an image of the memory regions shared with
+ * the BIOS (IVT/BDA, EBDA, VGA memory, Video BIOS, System BIOS), taken
+ * before the first call.  It is followed by every task passed to
+ * v86_task(), the value of every port read and write made while the
+ * task was running, and the reply to the task.
+ *
+ * In replay mode, the memory regions are loaded from the recording
+ * instead of /dev/mem, port reads return the recorded values and port
+ * writes never reach the hardware.  This makes it possible to re-run
+ * a session captured on a real machine anywhere, and to check that the
+ * replies are still the same.
+ *
+ * File layout: a struct rec_hdr, followed by records made up of
+ * a struct rec_ent and 'len' bytes of data:
+ *
+ *  REC_MEM      u32 physical address, region contents
+ *  REC_TASK     struct uvesafb_task, task buffer
+ *  REC_REPLY    struct uvesafb_task, task buffer
+ *  REC_PIO_IN   arg = port, len = access size, value
+ *  REC_PIO_OUT  arg = port, len = access size, value
+ *  REC_FAILED   no data, the task failed and there was no reply
+ *
+ * Version 1 recordings lack REC_FAILED and are still accepted.
+ */
+
+#define REC_MAGIC		0x43523638	/* "86RC" */
+#define REC_VERSION		2
+
+#define REC_MEM			1
+#define REC_TASK		2
+#define REC_REPLY		3
+#define REC_PIO_IN		4
+#define REC_PIO_OUT		5
+#define REC_FAILED		6
+
+struct rec_hdr {
+	u32 magic;
+	u32 version;
+} __attribute__ ((packed));
+
+struct rec_ent {
+	u16 type;
+	u16 arg;
+	u32 len;
+} __attribute__ ((packed));
+
+struct rec_mem {
+	struct rec_mem *next;
+	u32 addr;
+	u32 len;
+	u8 data[0];
+};
+
+int rec_mode = REC_OFF;
+
+static FILE *rec_file;
+static long rec_start;				/* offset of the first task */
+static long rec_size;				/* replay: size of the recording */
+static struct rec_mem *rec_mem;
+static int rec_diverged;			/* I/O mismatches in the current task */
+static u32 rec_task_no;				/* replay: number of the current task */
+static u16 rec_task_ax;				/* replay: AX of the current task */
+
+static int rec_write(u16 type, u16 arg, const void *data, u32 len,
+					 const void *data2, u32 len2)
+{
+	struct rec_ent e;
+
+	e.type = type;
+	e.arg = arg;
+	e.len = len + len2;
+
+	if (fwrite(&e, sizeof(e), 1, rec_file) != 1 ||
+		(len && fwrite(data, len, 1, rec_file) != 1) ||
+		(len2 && fwrite(data2, len2, 1, rec_file) != 1)) {
+		ulog(LOG_ERR, "Failed to write to the recording, recording stopped.\n");
+		rec_mode = REC_OFF;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read the next record.  The data is returned in a malloc'ed buffer,
+ * which has to be freed by the caller.  Returns NULL at the end of
+ * the recording.
+ */
+static u8 *rec_read(struct rec_ent *e)
+{
+	u8 *data;
+
+	if (fread(e, sizeof(*e), 1, rec_file) != 1)
+		return NULL;
+
+	if (e->len > rec_size - ftell(rec_file)) {
+		ulog(LOG_ERR, "Truncated record of %u bytes in the recording.\n",
+			 e->len);
+		return NULL;
+	}
+
+	data = malloc(e->len ? e->len : 1);
+	if (!data)
+		return NULL;
+
+	if (e->len && fread(data, e->len, 1, rec_file) != 1) {
+		free(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+static int rec_put_mem(u32 addr, u32 size, void *data)
+{
+	return rec_write(REC_MEM, 0, &addr, sizeof(addr), data, size);
+}
+
+/*
+ * Memory loader used in replay mode.  The parts of the requested range
+ * that are not present in the recording are zeroed.  Returns non-zero if
+ * the recording doesn't cover any part of the range.
+ */
+static int rec_load_mem(u32 addr, u32 size, void *dest)
+{
+	struct rec_mem *m;
+	u32 start, end;
+	int found = 0;
+
+	memset(dest, 0, size);
+
+	for (m = rec_mem; m; m = m->next) {
+		start = (m->addr > addr) ? m->addr : addr;
+		end = (m->addr + m->len < addr + size) ? m->addr + m->len : addr + size;
+
+		if (start >= end)
+			continue;
+
+		memcpy((u8*)dest + start - addr, m->data + start - m->addr, end - start);
+		found = 1;
+	}
+
+	return !found;
+}
+
+static int rec_init_replay(void)
+{
+	struct rec_mem *m;
+	struct rec_ent e;
+	long pos;
+	u8 *data;
+
+	while (1) {
+		pos = ftell(rec_file);
+		data = rec_read(&e);
+		if (!data || e.type != REC_MEM || e.len < 4)
+			break;
+
+		m = malloc(sizeof(*m) + e.len - 4);
+		if (!m) {
+			free(data);
+			return -1;
+		}
+
+		m->addr = *(u32*)data;
+		m->len = e.len - 4;
+		memcpy(m->data, data + 4, m->len);
+		m->next = rec_mem;
+		rec_mem = m;
+		free(data);
+	}
+
+	free(data);
+	rec_start = pos;
+	fseek(rec_file, rec_start, SEEK_SET);
+
+	if (!rec_mem) {
+		ulog(LOG_ERR, "The recording doesn't contain a memory image.\n");
+		return -1;
+	}
+
+	return v86_mem_set_loader(rec_load_mem);
+}
+
+/*
+ * Start recording to or replaying from 'path'.  Recording has to be
+ * started after v86_init(), so that the memory image can be saved.
+ * Replay has to be started before v86_init(), so that the memory image
+ * is used in place of the physical memory.
+ */
+int v86_rec_init(const char *path, int mode)
+{
+	struct rec_hdr hdr;
+
+	rec_file = fopen(path, (mode == REC_RECORD) ? "w" : "r");
+	if (!rec_file) {
+		ulog(LOG_ERR, "Failed to open the recording %s.\n", path);
+		return -1;
+	}
+
+	rec_mode = mode;
+	pio_hooks |= PIO_HOOK_REC;
+
+	if (mode == REC_RECORD) {
+		hdr.magic = REC_MAGIC;
+		hdr.version = REC_VERSION;
+
+		if (fwrite(&hdr, sizeof(hdr), 1, rec_file) != 1 ||
+			v86_mem_dump(rec_put_mem) || rec_mode == REC_OFF)
+			goto err;
+	} else {
+		if (fseek(rec_file, 0, SEEK_END) ||
+			(rec_size = ftell(rec_file)) == -1 ||
+			fseek(rec_file, 0, SEEK_SET) ||
+			fread(&hdr, sizeof(hdr), 1, rec_file) != 1 ||
+			hdr.magic != REC_MAGIC || hdr.version < 1 ||
+			hdr.version > REC_VERSION) {
+			ulog(LOG_ERR, "%s is not a v86d recording.\n", path);
+			goto err;
+		}
+
+		if (rec_init_replay())
+			goto err;
+	}
+
+	return 0;
+
+err:
+	v86_rec_cleanup();
+	return -1;
+}
+
+void v86_rec_cleanup(void)
+{
+	struct rec_mem *m;
+
+	while ((m = rec_mem)) {
+		rec_mem = m->next;
+		free(m);
+	}
+
+	if (rec_file) {
+		fclose(rec_file);
+		rec_file = NULL;
+	}
+
+	rec_mode = REC_OFF;
+	pio_hooks &= ~PIO_HOOK_REC;
+}
+
+/*
+ * Record a task before it is run (when recording), or mark the start
+ * of a replayed task.
+ */
+void v86_rec_task(struct uvesafb_task *tsk, u8 *buf)
+{
+	rec_diverged = 0;
+
+	if (rec_mode == REC_RECORD)
+		rec_write(REC_TASK, 0, tsk, sizeof(*tsk), buf, tsk->buf_len);
+}
+
+/*
+ * Record the reply to a task, or the fact that it failed, so that the
+ * replies stay matched to their tasks on replay.
+ */
+void v86_rec_reply(struct uvesafb_task *tsk, u8 *buf, int err)
+{
+	if (rec_mode != REC_RECORD)
+		return;
+
+	if (err)
+		rec_write(REC_FAILED, 0, NULL, 0, NULL, 0);
+	else
+		rec_write(REC_REPLY, 0, tsk, sizeof(*tsk), buf, tsk->buf_len);
+	fflush(rec_file);
+}
+
+/*
+ * Record a port access, or serve it from the recording.  Returns the
+ * value read from or written to the port.
+ *
+ * If a replayed task does not access the ports in the same order as
+ * the recorded one did, reads return all ones and the task is reported
+ * as diverged by v86_rec_check().
+ */
+u32 v86_rec_pio(int out, u16 port, int size, u32 val)
+{
+	struct rec_ent e;
+	u32 rval = 0;
+	int n;
+
+	if (rec_mode == REC_RECORD) {
+		rec_write(out ? REC_PIO_OUT : REC_PIO_IN, port, &val, size, NULL, 0);
+		return val;
+	}
+
+	/* This is the hot path of a replay: no seeking, no allocations. */
+	n = fread(&e, 1, sizeof(e), rec_file);
+	if (n != sizeof(e) || e.type != (out ? REC_PIO_OUT : REC_PIO_IN) ||
+		e.arg != port || e.len != size) {
+		/* Leave the record for the next access or for the reply. */
+		fseek(rec_file, -n, SEEK_CUR);
+		rec_diverged++;
+		return out ? val : 0xffffffff;
+	}
+
+	/* The recording is truncated. */
+	if (fread(&rval, size, 1, rec_file) != 1) {
+		rec_diverged++;
+		return out ? val : 0xffffffff;
+	}
+
+	if (out && rval != val)
+		rec_diverged++;
+
+	return out ? val : rval;
+}
+
+/*
+ * Get the next task from the recording.  The task is followed by its
+ * buffer and has to be freed by the caller.  Returns NULL at the end
+ * of the recording, or at a task whose buffer doesn't match the length
+ * of its record.
+ */
+struct uvesafb_task *v86_rec_next(void)
+{
+	struct uvesafb_task *tsk;
+	struct rec_ent e;
+	u8 *data;
+
+	while ((data = rec_read(&e))) {
+		if (e.type != REC_TASK) {
+			free(data);
+			continue;
+		}
+
+		tsk = (struct uvesafb_task *)data;
+		if (e.len < sizeof(*tsk) || tsk->buf_len < 0 ||
+			e.len != sizeof(*tsk) + tsk->buf_len) {
+			ulog(LOG_ERR, "Replay: malformed task record of %u bytes after "
+				 "task %u.\n", e.len, rec_task_no);
+			free(data);
+			return NULL;
+		}
+
+		rec_task_no++;
+		rec_task_ax = tsk->regs.eax;
+		return tsk;
+	}
+
+	return NULL;
+}
+
+/*
+ * Compare the reply to the last task returned by v86_rec_next() with
+ * the recorded one.  'failed' is non-zero if the task failed.  Returns
+ * 0 if the replies are identical (or the task failed during recording
+ * as well) and the task made the same port accesses as the recorded one.
+ */
+int v86_rec_check(struct uvesafb_task *tsk, u8 *buf, int failed)
+{
+	struct uvesafb_task *rep;
+	struct rec_ent e;
+	u8 *data;
+	int err = 0;
+
+	while ((data = rec_read(&e))) {
+		if (e.type == REC_REPLY || e.type == REC_FAILED)
+			break;
+
+		/* Port accesses that were not replayed. */
+		if (e.type == REC_PIO_IN || e.type == REC_PIO_OUT)
+			rec_diverged++;
+
+		free(data);
+	}
+
+	if (!data) {
+		ulog(LOG_WARNING, "Replay: no recorded reply to task %u (AX=%04x).\n",
+			 rec_task_no, rec_task_ax);
+		return 1;
+	}
+
+	if (failed || e.type == REC_FAILED) {
+		if (failed != (e.type == REC_FAILED)) {
+			ulog(LOG_WARNING, "Replay: task %u (AX=%04x) %s, but it %s when "
+				 "recorded.\n", rec_task_no, rec_task_ax,
+				 failed ? "failed" : "succeeded",
+				 failed ? "succeeded" : "failed");
+			err = 1;
+		}
+		free(data);
+		return err;
+	}
+
+	rep = (struct uvesafb_task *)data;
+
+	if (rec_diverged) {
+		ulog(LOG_WARNING, "Replay: task %u (AX=%04x) made %d port accesses "
+			 "that differ from the recording.\n", rec_task_no, rec_task_ax,
+			 rec_diverged);
+		err = 1;
+	}
+
+	if (e.len != sizeof(*tsk) + tsk->buf_len ||
+		memcmp(&rep->regs, &tsk->regs, sizeof(tsk->regs)) ||
+		memcmp(rep + 1, buf, tsk->buf_len)) {
+		ulog(LOG_WARNING, "Replay: the reply to task %u (AX=%04x) differs "
+			 "from the recording.\n", rec_task_no, rec_task_ax);
+		err = 1;
+	}
+
+	free(data);
+	return err;
+}
+
+/*
+ * Go back to the first recorded task.  The memory image is reloaded
+ * by the next v86_init().
+ */
+void v86_rec_rewind(void)
+{
+	if (rec_file)
+		fseek(rec_file, rec_start, SEEK_SET);
+	rec_task_no = 0;
+}
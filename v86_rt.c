@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "v86.h"
+
+/*
+ * Latency-hardened mode (v86d -H).  v86d is on the kernel's synchronous
+ * path for mode sets and panning, so page faults on the guest memory
+ * and competition for the CPU show up directly as framebuffer latency.
+ *
+ * All current and future mappings are locked into memory, the guest
+ * memory regions and the stack of the thread running the tasks are
+ * touched once, and optionally the process is pinned to a CPU and runs
+ * with SCHED_FIFO priority.  Has to be called before any threads are
+ * started, as they inherit the CPU affinity and the scheduling policy.
+ */
+
+/* Stack touched up front, for the deepest BIOS call paths. */
+#define RT_STACK_PREFAULT	(256 * 1024)
+
+static int rt_active;
+
+static void rt_stack_prefault(void)
+{
+	volatile u8 buf[RT_STACK_PREFAULT];
+	int i;
+
+	for (i = 0; i < sizeof(buf); i += 4096)
+		buf[i] = 0;
+}
+
+int rt_setup(int cpu, int prio)
+{
+	struct sched_param sp;
+	u64 t = v86_time_us();
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		ulog(LOG_ERR, "mlockall failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	v86_mem_prefault();
+#ifndef CONFIG_THREADS
+	rt_stack_prefault();
+#endif
+	rt_active = 1;
+
+	if (cpu >= 0) {
+#ifdef CONFIG_KLIBC
+		ulog(LOG_WARNING, "CPU pinning is not supported with klibc.\n");
+#else
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			ulog(LOG_ERR, "Failed to pin v86d to CPU %d: %s\n", cpu,
+				 strerror(errno));
+			return -1;
+		}
+#endif
+	}
+
+	if (prio > 0) {
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = prio;
+		if (sched_setscheduler(0, SCHED_FIFO, &sp)) {
+			ulog(LOG_ERR, "Failed to set SCHED_FIFO priority %d: %s\n", prio,
+				 strerror(errno));
+			return -1;
+		}
+	}
+
+	ulog(LOG_INFO, "Memory locked and prefaulted in %llu us, CPU %d, "
+		 "priority %d.\n", (unsigned long long)(v86_time_us() - t), cpu, prio);
+	return 0;
+}
+
+/*
+ * Touch the stack of the thread the tasks run on, which is the worker
+ * thread if there is one.  Does nothing unless rt_setup() was called.
+ */
+void rt_thread_setup(void)
+{
+	if (rt_active)
+		rt_stack_prefault();
+}
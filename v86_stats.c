@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "v86.h"
+#include "v86_trace.h"
+
+/*
+ * Log-linear latency histograms, in the spirit of HdrHistogram.  Every
+ * power of two is split into HIST_SUB sub-buckets, which gives a relative
+ * error of about 6% over the whole range of 1 us - 71 min.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(HIST_SUB + (32 - HIST_SUB_BITS) * HIST_SUB)
+#define HIST_KEYS		64
+
+struct hist {
+	u32 key;		/* (AX << 8) | subfunction */
+	u32 min;
+	u32 max;
+	u64 count;
+	u64 sum;
+	u32 buckets[HIST_BUCKETS];
+	u64 ncost;		/* tasks run, i.e. not answered from a cache */
+	struct v86_cost cost;	/* their total cost */
+};
+
+static struct {
+	int count;
+	u32 dropped;
+	struct hist h[HIST_KEYS];
+} stats;
+
+int v86_tracing;
+
+#ifdef CONFIG_THREADS
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#define STATS_LOCK()	pthread_mutex_lock(&stats_lock)
+#define STATS_UNLOCK()	pthread_mutex_unlock(&stats_lock)
+#else
+#define STATS_LOCK()	do {} while (0)
+#define STATS_UNLOCK()	do {} while (0)
+#endif
+
+/* Monotonic time in microseconds. */
+u64 v86_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * The TSC frequency, measured against the monotonic clock on the first
+ * call, which takes 20 ms.  Returns 0 if it can't be measured.
+ */
+u64 v86_tsc_hz(void)
+{
+	static u64 hz;
+	struct timespec ts = { 0, 20000000 };
+	u64 t0, t1, c0, c1;
+
+	if (hz)
+		return hz;
+
+	t0 = v86_time_us();
+	c0 = v86_rdtsc();
+	nanosleep(&ts, NULL);
+	t1 = v86_time_us();
+	c1 = v86_rdtsc();
+
+	if (t1 != t0)
+		hz = (c1 - c0) * 1000000 / (t1 - t0);
+	return hz;
+}
+
+static int hist_index(u32 v)
+{
+	int m;
+
+	if (v < HIST_SUB)
+		return v;
+
+	m = 31 - __builtin_clz(v);
+	return HIST_SUB + (m - HIST_SUB_BITS) * HIST_SUB +
+		   (v >> (m - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+/* The highest value that falls into the i-th bucket. */
+static u32 hist_value(int i)
+{
+	int shift, sub;
+
+	if (i < HIST_SUB)
+		return i;
+
+	shift = (i - HIST_SUB) / HIST_SUB;
+	sub = (i - HIST_SUB) % HIST_SUB;
+	return (((u64)(HIST_SUB + sub + 1)) << shift) - 1;
+}
+
+static u32 hist_percentile(struct hist *h, int permille)
+{
+	u64 target, acc = 0;
+	int i;
+
+	target = (h->count * permille + 999) / 1000;
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		acc += h->buckets[i];
+		if (acc >= target)
+			return (hist_value(i) < h->max) ? hist_value(i) : h->max;
+	}
+
+	return h->max;
+}
+
+/*
+ * Only some of the VBE functions use BL as a subfunction number.
+ */
+static u32 stats_key(struct v86_regs *regs)
+{
+	u32 ax = regs->eax & 0xffff;
+	u32 sub = 0;
+
+	switch (ax) {
+	case 0x4f04: case 0x4f06: case 0x4f07: case 0x4f08:
+	case 0x4f09: case 0x4f0a: case 0x4f10: case 0x4f15:
+		sub = regs->ebx & 0xff;
+		break;
+	}
+
+	return (ax << 8) | sub;
+}
+
+static struct hist *stats_find(u32 key)
+{
+	int i;
+
+	for (i = 0; i < stats.count; i++) {
+		if (stats.h[i].key == key)
+			return &stats.h[i];
+	}
+
+	if (stats.count == HIST_KEYS)
+		return NULL;
+
+	i = stats.count++;
+	memset(&stats.h[i], 0, sizeof(stats.h[i]));
+	stats.h[i].key = key;
+	stats.h[i].min = ~0;
+	return &stats.h[i];
+}
+
+/*
+ * Record the end-to-end time of a single request.  'regs' are the
+ * registers the request was submitted with.
+ */
+void v86_stats_add(struct v86_regs *regs, u32 us)
+{
+	struct hist *h;
+	u32 key = stats_key(regs);
+
+	/* klibc doesn't provide setlogmask(), so bypass ulog() here. */
+	if (v86_tracing)
+		syslog(LOG_INFO, "%04x.%02x: %u us\n", key >> 8, key & 0xff, us);
+
+	STATS_LOCK();
+	h = stats_find(key);
+	if (!h) {
+		stats.dropped++;
+		STATS_UNLOCK();
+		return;
+	}
+
+	h->count++;
+	h->sum += us;
+	if (us < h->min)
+		h->min = us;
+	if (us > h->max)
+		h->max = us;
+	h->buckets[hist_index(us)]++;
+	STATS_UNLOCK();
+}
+
+/*
+ * Add the cost of a task run by v86_task() to the function it was
+ * called with.
+ */
+void v86_stats_cost(struct v86_regs *regs, struct v86_cost *c)
+{
+	struct hist *h;
+
+	STATS_LOCK();
+	h = stats_find(stats_key(regs));
+	if (h) {
+		h->ncost++;
+		h->cost.insns += c->insns;
+		h->cost.ints += c->ints;
+		h->cost.pio_in += c->pio_in;
+		h->cost.pio_out += c->pio_out;
+		h->cost.bytes_in += c->bytes_in;
+		h->cost.bytes_out += c->bytes_out;
+		h->cost.tsc_emu += c->tsc_emu;
+		h->cost.tsc_io += c->tsc_io;
+		h->cost.tsc_total += c->tsc_total;
+	}
+	STATS_UNLOCK();
+}
+
+/* Average of 'sum' TSC cycles over 'n' tasks, in microseconds. */
+static u64 cost_us(u64 sum, u64 n, u64 hz)
+{
+	return hz ? sum / n * 1000000 / hz : 0;
+}
+
+/*
+ * Print the average cost of the tasks run for every function.  'hz' is
+ * the TSC frequency.
+ */
+static int stats_dump_cost(char *buf, int size, u64 hz)
+{
+	struct v86_cost *c;
+	struct hist *h;
+	u64 n;
+	int i, len;
+
+	len = snprintf(buf, size, "%-7s %8s %9s %6s %7s %7s %6s %6s %8s %8s %8s %8s\n",
+				   "func", "runs", "insns", "ints", "pio-in", "pio-out",
+				   "in", "out", "us", "emu-us", "io-us", "host-us");
+
+	for (i = 0; i < stats.count && len < size; i++) {
+		h = &stats.h[i];
+		if (!h->ncost)
+			continue;
+
+		c = &h->cost;
+		n = h->ncost;
+		len += snprintf(buf + len, size - len,
+				"%04x.%02x %8llu %9llu %6llu %7llu %7llu %6llu %6llu "
+				"%8llu %8llu %8llu %8llu\n", h->key >> 8, h->key & 0xff,
+				(unsigned long long)n, (unsigned long long)(c->insns / n),
+				(unsigned long long)(c->ints / n),
+				(unsigned long long)(c->pio_in / n),
+				(unsigned long long)(c->pio_out / n),
+				(unsigned long long)(c->bytes_in / n),
+				(unsigned long long)(c->bytes_out / n),
+				(unsigned long long)cost_us(c->tsc_total, n, hz),
+				(unsigned long long)cost_us(c->tsc_emu - c->tsc_io, n, hz),
+				(unsigned long long)cost_us(c->tsc_io, n, hz),
+				(unsigned long long)cost_us(c->tsc_total - c->tsc_emu, n, hz));
+	}
+
+	return (len < size) ? len : size - 1;
+}
+
+void v86_stats_reset(void)
+{
+	STATS_LOCK();
+	stats.count = 0;
+	stats.dropped = 0;
+	STATS_UNLOCK();
+}
+
+/*
+ * Print the histogram summaries into 'buf', either as a table or
+ * as comma-separated values (STATS_FMT_CSV).  Returns the length of
+ * the output.
+ */
+int v86_stats_dump(char *buf, int size, int fmt)
+{
+	const char *hdr, *row;
+	struct hist *h;
+	int i, len;
+
+	if (fmt == STATS_FMT_COST) {
+		/* Calibrate the TSC before taking the lock. */
+		u64 hz = v86_tsc_hz();
+
+		STATS_LOCK();
+		len = stats_dump_cost(buf, size, hz);
+		STATS_UNLOCK();
+		return len;
+	}
+
+	if (fmt == STATS_FMT_CSV) {
+		hdr = "%s,%s,%s,%s,%s,%s,%s,%s,%s\n";
+		row = "%04x.%02x,%llu,%u,%llu,%u,%u,%u,%u,%u\n";
+	} else {
+		hdr = "%-7s %8s %8s %8s %8s %8s %8s %8s %8s\n";
+		row = "%04x.%02x %8llu %8u %8llu %8u %8u %8u %8u %8u\n";
+	}
+
+	STATS_LOCK();
+	len = snprintf(buf, size, hdr, "func", "count", "min", "mean", "p50",
+				   "p90", "p99", "p99.9", "max");
+
+	for (i = 0; i < stats.count && len < size; i++) {
+		h = &stats.h[i];
+		/* Created by v86_stats_cost() for a task that isn't done yet. */
+		if (!h->count)
+			continue;
+
+		len += snprintf(buf + len, size - len, row,
+				h->key >> 8, h->key & 0xff, (unsigned long long)h->count,
+				h->min, (unsigned long long)(h->sum / h->count),
+				hist_percentile(h, 500), hist_percentile(h, 900),
+				hist_percentile(h, 990), hist_percentile(h, 999), h->max);
+	}
+
+	if (stats.dropped && len < size)
+		len += snprintf(buf + len, size - len, "dropped %u\n", stats.dropped);
+	STATS_UNLOCK();
+
+	return (len < size) ? len : size - 1;
+}
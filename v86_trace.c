@@ -0,0 +1,64 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "v86.h"
+#include "v86_trace.h"
+
+struct v86_trace_hdr *trace_hdr;
+struct v86_trace_ev *trace_ring;
+
+static size_t trace_len;
+
+int v86_trace_init(const char *path, u32 size)
+{
+	void *m;
+	int fd;
+
+	if (!size || size & (size - 1)) {
+		ulog(LOG_ERR, "Trace ring size has to be a power of 2.\n");
+		return -1;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		ulog(LOG_ERR, "Open '%s' failed with: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	trace_len = sizeof(*trace_hdr) + size * sizeof(*trace_ring);
+	if (ftruncate(fd, trace_len) == -1) {
+		ulog(LOG_ERR, "Failed to resize '%s': %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	m = mmap(NULL, trace_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == (void *)-1) {
+		ulog(LOG_ERR, "mmap '%s' failed with: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	trace_hdr = m;
+	trace_hdr->magic = V86_TRACE_MAGIC;
+	trace_hdr->version = V86_TRACE_VERSION;
+	trace_hdr->size = size;
+	trace_hdr->head = 0;
+	/* Lets the decoder convert timestamps into real time. */
+	trace_hdr->tsc_hz = v86_tsc_hz();
+
+	trace_ring = (struct v86_trace_ev *)(trace_hdr + 1);
+	return 0;
+}
+
+void v86_trace_cleanup(void)
+{
+	if (!trace_ring)
+		return;
+
+	trace_ring = NULL;
+	munmap(trace_hdr, trace_len);
+	trace_hdr = NULL;
+}
@@ -0,0 +1,94 @@
+#ifndef __H_V86_TRACE
+#define __H_V86_TRACE
+
+/*
+ * Binary trace ring.  The ring lives in a memory-mapped file, so that
+ * it can be read while v86d is running or after it has died.  Events are
+ * written without any syscalls or locks: a writer reserves a slot by
+ * atomically incrementing 'head' and then fills it in.  'type' is
+ * cleared while the slot is being written and 'seq' is the number of
+ * the event, so that readers can skip slots that are torn or have been
+ * overwritten in the meantime.
+ *
+ * The file layout is the same on x86 and x86-64.
+ */
+
+#define V86_TRACE_MAGIC		0x52543638	/* "86TR" */
+#define V86_TRACE_VERSION	2
+#define V86_TRACE_DEF_SIZE	65536		/* events, must be a power of 2 */
+
+/* Event types */
+#define TR_REQ_BEGIN	0x01	/* arg = AX, val = cn_msg seq */
+#define TR_REQ_END		0x02	/* arg = AX, val = cn_msg seq */
+#define TR_INT_ENTER	0x03	/* arg = int number, val = EAX */
+#define TR_INT_EXIT		0x04	/* arg = int number, val = EAX */
+#define TR_SOFTINT		0x05	/* arg = int number, val = CS:IP of the INT */
+#define TR_EMU_ENTER	0x06
+#define TR_EMU_EXIT		0x07
+#define TR_PIO_IN		0x08	/* arg = port, size = 1/2/4, val = value */
+#define TR_PIO_OUT		0x09	/* arg = port, size = 1/2/4, val = value */
+#define TR_REG			0x0a	/* arg = TR_REG_*, val = value */
+
+/* Register indices for TR_REG */
+#define TR_REG_FLAGS	0	/* task flags */
+#define TR_REG_EAX		1
+#define TR_REG_EBX		2
+#define TR_REG_ECX		3
+#define TR_REG_EDX		4
+#define TR_REG_ESI		5
+#define TR_REG_EDI		6
+#define TR_REG_ES		7
+
+struct v86_trace_hdr {
+	u32 magic;
+	u32 version;
+	u32 size;			/* number of event slots */
+	u32 head;			/* number of events written, mod 2^32 */
+	u64 tsc_hz;			/* estimated TSC frequency */
+} __attribute__ ((packed));
+
+struct v86_trace_ev {
+	u64 tsc;
+	u8  type;			/* 0 = empty or being written */
+	u8  size;
+	u16 arg;
+	u32 val;
+	u32 seq;			/* value of 'head' the slot was reserved at */
+} __attribute__ ((packed));
+
+extern struct v86_trace_hdr *trace_hdr;
+extern struct v86_trace_ev *trace_ring;
+
+int v86_trace_init(const char *path, u32 size);
+void v86_trace_cleanup(void);
+
+static inline u64 v86_rdtsc(void)
+{
+	u32 lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((u64)hi << 32) | lo;
+}
+
+static inline void v86_trace(u8 type, u8 size, u16 arg, u32 val)
+{
+	struct v86_trace_ev *e;
+	u32 seq;
+
+	if (!trace_ring)
+		return;
+
+	seq = __sync_fetch_and_add(&trace_hdr->head, 1);
+	e = &trace_ring[seq & (trace_hdr->size - 1)];
+	e->type = 0;
+	__sync_synchronize();
+	e->tsc = v86_rdtsc();
+	e->size = size;
+	e->arg = arg;
+	e->val = val;
+	e->seq = seq;
+	__sync_synchronize();
+	e->type = type;
+}
+
+#endif /* __H_V86_TRACE */
@@ -0,0 +1,215 @@
+#include <string.h>
+#include "v86.h"
+
+/*
+ * Software model of the VGA register file: miscellaneous output,
+ * sequencer, CRT controller, graphics controller, attribute controller
+ * and DAC.  It only keeps the register values, so that a BIOS reading
+ * back what it has written sees consistent state.  Nothing is ever
+ * displayed.
+ *
+ * The model handles all ports with the PIO_VIRT policy in the
+ * 0x3b0 - 0x3df range, and all of them when there is no hardware.
+ */
+
+static struct {
+	u8 misc;
+	u8 feat;
+	u8 stat;			/* input status 1 */
+
+	u8 seq_idx;
+	u8 seq[256];
+
+	u8 crtc_idx;
+	u8 crtc[256];
+
+	u8 gc_idx;
+	u8 gc[256];
+
+	u8 attr_idx;
+	u8 attr_ff;			/* 0 = index, 1 = data */
+	u8 attr[32];
+
+	u8 dac_mask;
+	u8 dac_state;		/* 0x00 = write mode, 0x03 = read mode */
+	u8 dac_widx;
+	u8 dac_ridx;
+	u8 dac_wcomp;
+	u8 dac_rcomp;
+	u8 dac_rgb[3];
+	u8 dac[256][3];
+} vga;
+
+/* Bits 0 (display enable) and 3 (vertical retrace) of input status 1. */
+#define VGA_STAT_RETRACE	0x09
+
+/* CRTC registers 0 - 7 are write protected if bit 7 of CR11 is set. */
+#define VGA_CR11_PROTECT	0x80
+
+/*
+ * Ports 0x3b4/5 and 0x3ba are only decoded in monochrome mode, and
+ * 0x3d4/5 and 0x3da only in colour mode (misc output bit 0 set).
+ */
+static int vga_mono_port(u16 port)
+{
+	if ((port & 0xfff0) == 0x3b0)
+		return vga.misc & 1;
+	if ((port & 0xfff0) == 0x3d0)
+		return !(vga.misc & 1);
+	return 0;
+}
+
+static u8 vga_inb(u16 port)
+{
+	u8 val;
+
+	if (vga_mono_port(port))
+		return 0xff;
+
+	switch (port) {
+	case 0x3c0:
+		return vga.attr_idx;
+	case 0x3c1:
+		return vga.attr[vga.attr_idx & 0x1f];
+	case 0x3c2:
+		return 0x00;				/* input status 0 */
+	case 0x3c4:
+		return vga.seq_idx;
+	case 0x3c5:
+		return vga.seq[vga.seq_idx];
+	case 0x3c6:
+		return vga.dac_mask;
+	case 0x3c7:
+		return vga.dac_state;
+	case 0x3c8:
+		return vga.dac_widx;
+	case 0x3c9:
+		val = vga.dac[vga.dac_ridx][vga.dac_rcomp];
+		if (++vga.dac_rcomp == 3) {
+			vga.dac_rcomp = 0;
+			vga.dac_ridx++;
+		}
+		return val;
+	case 0x3ca:
+		return vga.feat;
+	case 0x3cc:
+		return vga.misc;
+	case 0x3ce:
+		return vga.gc_idx;
+	case 0x3cf:
+		return vga.gc[vga.gc_idx];
+	case 0x3b4:
+	case 0x3d4:
+		return vga.crtc_idx;
+	case 0x3b5:
+	case 0x3d5:
+		return vga.crtc[vga.crtc_idx];
+	case 0x3ba:
+	case 0x3da:
+		/*
+		 * Reading the status register resets the attribute controller
+		 * flip-flop.  Toggle the retrace bits, so that BIOS code waiting
+		 * for the start or the end of a retrace doesn't spin forever.
+		 */
+		vga.attr_ff = 0;
+		vga.stat ^= VGA_STAT_RETRACE;
+		return vga.stat;
+	}
+
+	return 0xff;
+}
+
+static void vga_outb(u16 port, u8 val)
+{
+	if (vga_mono_port(port))
+		return;
+
+	switch (port) {
+	case 0x3c0:
+		if (vga.attr_ff)
+			vga.attr[vga.attr_idx & 0x1f] = val;
+		else
+			vga.attr_idx = val & 0x3f;
+		vga.attr_ff ^= 1;
+		break;
+	case 0x3c2:
+		vga.misc = val;
+		break;
+	case 0x3c4:
+		vga.seq_idx = val;
+		break;
+	case 0x3c5:
+		vga.seq[vga.seq_idx] = val;
+		break;
+	case 0x3c6:
+		vga.dac_mask = val;
+		break;
+	case 0x3c7:
+		vga.dac_ridx = val;
+		vga.dac_rcomp = 0;
+		vga.dac_state = 0x03;
+		break;
+	case 0x3c8:
+		vga.dac_widx = val;
+		vga.dac_wcomp = 0;
+		vga.dac_state = 0x00;
+		break;
+	case 0x3c9:
+		/* An entry is only updated once all three components are in. */
+		vga.dac_rgb[vga.dac_wcomp++] = val & 0x3f;
+		if (vga.dac_wcomp == 3) {
+			memcpy(vga.dac[vga.dac_widx++], vga.dac_rgb, 3);
+			vga.dac_wcomp = 0;
+		}
+		break;
+	case 0x3ba:
+	case 0x3da:
+		vga.feat = val;
+		break;
+	case 0x3ce:
+		vga.gc_idx = val;
+		break;
+	case 0x3cf:
+		vga.gc[vga.gc_idx] = val;
+		break;
+	case 0x3b4:
+	case 0x3d4:
+		vga.crtc_idx = val;
+		break;
+	case 0x3b5:
+	case 0x3d5:
+		if (vga.crtc_idx < 8 && vga.crtc[0x11] & VGA_CR11_PROTECT) {
+			/* Only the line compare bit of CR07 stays writable. */
+			if (vga.crtc_idx == 7)
+				vga.crtc[7] = (vga.crtc[7] & ~0x10) | (val & 0x10);
+			break;
+		}
+		vga.crtc[vga.crtc_idx] = val;
+		break;
+	}
+}
+
+static struct pio_dev vga_dev = {
+	.name = "vga",
+	.inb = vga_inb,
+	.outb = vga_outb,
+};
+
+/*
+ * Reset the model to the state of a colour adapter after POST and
+ * attach it to the VGA ports.
+ */
+int v86_vga_init(void)
+{
+	static int registered;
+
+	memset(&vga, 0, sizeof(vga));
+	vga.misc = 0x67;
+	vga.dac_mask = 0xff;
+
+	if (registered)
+		return 0;
+
+	registered = 1;
+	return pio_register(0x3b0, 0x3df, &vga_dev);
+}
@@ -2,15 +2,135 @@
 #include <string.h>
 #include <x86emu.h>
 #include "v86.h"
+#include "v86_trace.h"
 #include "v86_x86emu.h"
 
 u32 stack;
 u32 halt;
 
+/* Instructions executed between two checks of the call limits. */
+#define EXEC_SLICE	100000
+
+static int fast_delays;
+static u8 refresh_bit;
+
+static u32 limit_insns;
+static u32 limit_ms;
+static int (*limit_yield)(void);
+
+/* Instructions left until the next profiling sample */
+static u32 prof_left;
+
 __BUILDIO(b,b,u8);
 __BUILDIO(w,w,u16);
 __BUILDIO(l,,u32);
 
+/*
+ * Port I/O that can't go straight to the hardware: it has to be recorded
+ * or replayed, accounted for, or handled according to the port policy
+ * table (see v86_pio.c).  Without hardware, all ports are virtual.
+ *
+ * Accesses which didn't touch the hardware thanks to the PIO_CACHE and
+ * PIO_DISCARD policies are always counted, everything else only when
+ * the policies have been configured.
+ */
+static inline void pio_account(int policy, u64 start)
+{
+	if (pio_hooks & PIO_HOOK_TABLE || policy >= PIO_CACHE)
+		pio_stats_add(policy, v86_rdtsc() - start);
+}
+
+u32 v86_pio_in(u16 port, int size)
+{
+	int policy;
+	u64 t;
+	u32 value;
+
+	if (rec_mode == REC_REPLAY)
+		return v86_rec_pio(0, port, size, 0);
+
+	t = v86_rdtsc();
+	policy = pio_policy(port);
+
+	if (policy == PIO_VIRT) {
+		value = pio_virt_in(port, size);
+	} else if (policy != PIO_PASS && pio_cache_in(port, size, policy, &value)) {
+		/* served from memory */
+	} else {
+		if (size == 1)
+			value = hw_inb(port);
+		else if (size == 2)
+			value = hw_inw(port);
+		else
+			value = hw_inl(port);
+
+		if (policy == PIO_CACHE)
+			pio_cache_put(port, size, value);
+		policy = PIO_PASS;
+	}
+
+	pio_account(policy, t);
+
+	/*
+	 * Delay loops poll the refresh request toggle in port 0x61, which
+	 * flips every 15 us.  Make it flip on every read instead.
+	 */
+	if (fast_delays && port == 0x61) {
+		refresh_bit ^= 0x10;
+		value = (value & ~0x10) | refresh_bit;
+		v86_delays.refresh++;
+	}
+
+	if (rec_mode == REC_RECORD)
+		v86_rec_pio(0, port, size, value);
+
+	if (pio_hooks & PIO_HOOK_MSET)
+		v86_mset_pio(0, port, size, value);
+
+	return value;
+}
+
+void v86_pio_out(u16 port, int size, u32 value)
+{
+	int policy;
+	u64 t;
+
+	if (rec_mode)
+		v86_rec_pio(1, port, size, value);
+
+	if (rec_mode == REC_REPLAY)
+		return;
+
+	/* The writes to the VGA window have to reach it first. */
+	if (pio_hooks & PIO_HOOK_VRAM)
+		v86_mem_vram_sync();
+
+	if (pio_hooks & PIO_HOOK_MSET)
+		v86_mset_pio(1, port, size, value);
+
+	t = v86_rdtsc();
+	policy = pio_policy(port);
+
+	if (policy == PIO_VIRT) {
+		pio_virt_out(port, size, value);
+	} else if (policy == PIO_DISCARD) {
+		pio_cache_put(port, size, value);
+	} else {
+		if (policy == PIO_CACHE)
+			pio_cache_drop(port, size);
+
+		if (size == 1)
+			hw_outb(port, value);
+		else if (size == 2)
+			hw_outw(port, value);
+		else
+			hw_outl(port, value);
+		policy = PIO_PASS;
+	}
+
+	pio_account(policy, t);
+}
+
 void printk(const char *fmt, ...)
 {
 	va_list argptr;
@@ -31,6 +151,18 @@ static void x86emu_do_int(int num)
 
 	eflags = X86_EFLAGS;
 
+	v86_trace(TR_SOFTINT, 0, num, ((u32)X86_CS << 16) | X86_IP);
+	v86_cost.ints++;
+
+	/* INT 15h, AH=86h: wait CX:DX microseconds. */
+	if (fast_delays && num == 0x15 && X86_AH == 0x86) {
+		v86_delays.waits++;
+		v86_delays.wait_us += ((u32)X86_CX << 16) | X86_DX;
+		X86_AH = 0;
+		X86_EFLAGS &= ~F_CF;
+		return;
+	}
+
 	/* Return address and flags */
 	pushw(eflags);
 	pushw(X86_CS);
@@ -69,7 +201,7 @@ int v86_init()
 		return -1;
 	}
 
-	stack = v86_mem_alloc(DEFAULT_STACK_SIZE);
+	stack = v86_mem_alloc_static(DEFAULT_STACK_SIZE);
 	if (!stack) {
 		ulog(LOG_ERR, "v86 memory allocation failed.");
 		return -1;
@@ -78,13 +210,23 @@ int v86_init()
 	X86_SS = stack >> 4;
 	X86_ESP = DEFAULT_STACK_SIZE;
 
-	halt = v86_mem_alloc(0x100);
+	halt = v86_mem_alloc_static(0x100);
 	if (!halt) {
 		ulog(LOG_ERR, "v86 memory alocation failed.");
 		return -1;
 	}
 	v_wrb(halt, 0xF4);
 
+	if (v86_vga_init()) {
+		ulog(LOG_ERR, "VGA device model initialization failed.");
+		return -1;
+	}
+
+	if (v86_pci_init()) {
+		ulog(LOG_ERR, "PCI device model initialization failed.");
+		return -1;
+	}
+
 	X86EMU_setupPioFuncs(&pioFuncs);
 	X86EMU_setupMemFuncs(&memFuncs);
 
@@ -97,14 +239,17 @@ int v86_init()
 	/* Set the default flags */
 	X86_EFLAGS = X86_IF_MASK | X86_IOPL_MASK;
 
-	ioperm(0, 1024, 1);
-	iopl(3);
+	if (!(pio_hooks & PIO_HOOK_VIRT)) {
+		ioperm(0, 1024, 1);
+		iopl(3);
+	}
 
 	return 0;
 }
 
 void v86_cleanup()
 {
+	v86_prof_cleanup();
 	v86_mem_cleanup();
 }
 
@@ -147,31 +292,196 @@ void rconv_x86emu_to_v86(struct v86_regs *rd)
 }
 
 /*
- * Perform a simulated interrupt call.
+ * Short-circuit the delay services used by option ROM initialization
+ * code: INT 15h/86h waits return right away and the refresh toggle in
+ * port 0x61 flips on every read.
  */
-int v86_int(int num, struct v86_regs *regs)
+void v86_set_fast_delays(int on)
+{
+	fast_delays = on;
+	if (on)
+		pio_hooks |= PIO_HOOK_DELAY;
+	else
+		pio_hooks &= ~PIO_HOOK_DELAY;
+}
+
+/*
+ * Limit the number of instructions and the time a single call can take.
+ * 'yield' is called periodically during long calls, and can abort the
+ * call by returning a non-zero value.  Zero means no limit.
+ */
+void v86_set_limits(u32 insns, u32 ms, int (*yield)(void))
+{
+	limit_insns = insns;
+	limit_ms = ms;
+	limit_yield = yield;
+}
+
+/*
+ * Run the emulator in slices of EXEC_SLICE instructions, checking the
+ * call limits in between.  With profiling, the slices also end every
+ * prof_period instructions to take a sample; the countdown carries over
+ * from one call to the next, so that short calls are sampled as well.
+ * Returns 0 if the call completed normally.
+ */
+static int v86_exec_limited(void)
 {
+	u64 start = v86_time_us(), icount;
+	u32 done = 0, check = EXEC_SLICE, slice;
+	int ret = X86EMU_EXEC_LIMIT;
+
+	if (!prof_left || prof_left > prof_period)
+		prof_left = prof_period;
+
+	for (;;) {
+		slice = check - done;
+		if (limit_insns && limit_insns - done < slice)
+			slice = limit_insns - done;
+		if (prof_period && prof_left < slice)
+			slice = prof_left;
+
+		icount = M.x86.icount;
+		if (done)
+			ret = X86EMU_resume(slice);
+		else
+			ret = X86EMU_exec_limit(slice);
+		done += M.x86.icount - icount;
+
+		if (prof_period) {
+			prof_left -= M.x86.icount - icount;
+			if (!prof_left) {
+				if (ret == X86EMU_EXEC_LIMIT)
+					v86_prof_sample();
+				prof_left = prof_period;
+			}
+		}
+
+		if (ret != X86EMU_EXEC_LIMIT)
+			return 0;
+
+		if (limit_insns && done >= limit_insns) {
+			ulog(LOG_ERR, "Instruction limit exceeded at %04x:%04x.\n",
+				 X86_CS, X86_IP);
+			return 1;
+		}
+
+		if (done < check)
+			continue;
+		check += EXEC_SLICE;
+
+		if (limit_ms && v86_time_us() - start >= (u64)limit_ms * 1000) {
+			ulog(LOG_ERR, "Time limit exceeded at %04x:%04x.\n",
+				 X86_CS, X86_IP);
+			return 1;
+		}
+
+		if (limit_yield && limit_yield())
+			return 1;
+	}
+}
+
+/* Account a run of the emulator started at TSC 't' and instruction 'icount'. */
+static void v86_run_account(u64 t, u64 icount)
+{
+	t = v86_rdtsc() - t;
+	pio_run_add(t);
+	v86_cost.tsc_emu += t;
+	v86_cost.insns += M.x86.icount - icount;
+}
+
+/*
+ * Run BIOS code at cs:ip until it returns to the halt stub.  'num' is
+ * the interrupt number for interrupt calls, or -1 for far calls, which
+ * return with RETF and so don't get the flags pushed.
+ *
+ * If the call has to be aborted because of the call limits, the IVT, BDA
+ * and EBDA are restored to their original contents and AX is set to
+ * 0x014f (VBE: function call failed).  All other registers are left
+ * unchanged.  Writes to the VGA window and to the ports are not undone.
+ * Returns 1 in that case.
+ */
+static int v86_run(int num, u16 cs, u16 ip, struct v86_regs *regs)
+{
+	int limited = limit_insns || limit_ms || limit_yield;
+	u64 t, icount;
+
+	if (limited)
+		v86_mem_save();
+
 	rconv_v86_to_x86emu(regs);
 
 	X86_GS = 0;
 	X86_FS = 0;
 	X86_DS = 0x0040;
-	X86_CS  = v_rdw((num << 2) + 2);
-	X86_EIP = v_rdw((num << 2));
+	X86_CS  = cs;
+	X86_EIP = ip;
 	X86_SS = stack >> 4;
 	X86_ESP = DEFAULT_STACK_SIZE;
 	X86_EFLAGS = X86_IF_MASK | X86_IOPL_MASK;
 
-	pushw(X86_EFLAGS);
+	if (num >= 0)
+		pushw(X86_EFLAGS);
 	pushw((halt >> 4));
 	pushw(0x0);
 
-	X86EMU_exec();
+	if (prof_period)
+		v86_prof_enter(num, regs);
+	if (mem_hooks & MEM_HOOK_HEAT)
+		v86_heat_start(num, regs);
+
+	if (num >= 0)
+		v86_trace(TR_INT_ENTER, 0, num, X86_EAX);
+	v86_trace(TR_EMU_ENTER, 0, 0, 0);
+	icount = M.x86.icount;
+	t = v86_rdtsc();
+	if (limited || prof_period) {
+		if (v86_exec_limited()) {
+			v86_run_account(t, icount);
+			if (mem_hooks & MEM_HOOK_HEAT)
+				v86_heat_stop();
+			if (mem_hooks & MEM_HOOK_VRAM)
+				v86_mem_vram_sync();
+			v86_trace(TR_EMU_EXIT, 0, 0, 0);
+			if (num >= 0)
+				v86_trace(TR_INT_EXIT, 0, num, 0x014f);
+			v86_mem_restore();
+			/* Prefixes left behind by the call must not apply to the next one. */
+			M.x86.mode &= ~(SYSMODE_CLRMASK | SYSMODE_PREFIX_REPE |
+							SYSMODE_PREFIX_REPNE);
+			regs->eax = (regs->eax & 0xffff0000) | 0x014f;
+			return 1;
+		}
+	} else {
+		X86EMU_exec();
+	}
+	v86_run_account(t, icount);
+	if (mem_hooks & MEM_HOOK_HEAT)
+		v86_heat_stop();
+	if (mem_hooks & MEM_HOOK_VRAM)
+		v86_mem_vram_sync();
+	v86_trace(TR_EMU_EXIT, 0, 0, 0);
+	if (num >= 0)
+		v86_trace(TR_INT_EXIT, 0, num, X86_EAX);
 
 	rconv_x86emu_to_v86(regs);
 	return 0;
 }
 
+int v86_int(int num, struct v86_regs *regs)
+{
+	return v86_run(num, v_rdw((num << 2) + 2), v_rdw(num << 2), regs);
+}
+
+/*
+ * Make a far call to seg:off, e.g. to the initialization entry point
+ * of an option ROM.  The registers other than the segment registers and
+ * the stack are passed as they are.
+ */
+int v86_call(u16 seg, u16 off, struct v86_regs *regs)
+{
+	return v86_run(-1, seg, off, regs);
+}
+
 void v86_dump_regs()
 {
 	ulog(LOG_DEBUG,
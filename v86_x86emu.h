@@ -51,19 +51,52 @@
 
 #define DEFAULT_V86_FLAGS  (X86_IF_MASK | X86_IOPL_MASK)
 
+u32 v86_pio_in(u16 port, int size);
+void v86_pio_out(u16 port, int size, u32 value);
+
+/* Sampling period of the profiler, 0 = off (see v86_prof.c) */
+extern u32 prof_period;
+
+void v86_prof_enter(int num, struct v86_regs *regs);
+void v86_heat_start(int num, struct v86_regs *regs);
+void v86_heat_stop(void);
+void v86_prof_sample(void);
+
 #define __BUILDIO(bwl,bw,type)									\
-static void x_out ## bwl (u16 port, type value) {				\
-	/*printf("out" #bwl " %x, %x\n", port, value);*/			\
+static void hw_out ## bwl (u16 port, type value) {				\
 	__asm__ __volatile__("out" #bwl " %" #bw "0, %w1"			\
 			: : "a"(value), "Nd"(port));						\
 }																\
 																\
-static type x_in ## bwl (u16 port) {							\
+static type hw_in ## bwl (u16 port) {							\
 	type value;													\
 	__asm__ __volatile__("in" #bwl " %w1, %" #bw "0"			\
 			: "=a"(value)										\
 			: "Nd"(port));										\
-	/*printf("in" #bwl " %x = %x\n", port, value);*/			\
+	return value;												\
+}																\
+																\
+static void x_out ## bwl (u16 port, type value) {				\
+	u64 t = v86_rdtsc();										\
+	v86_trace(TR_PIO_OUT, sizeof(type), port, value);			\
+	if (pio_hooks || pio_ports[port].policy)					\
+		v86_pio_out(port, sizeof(type), value);					\
+	else														\
+		hw_out ## bwl(port, value);								\
+	v86_cost.pio_out++;											\
+	v86_cost.tsc_io += v86_rdtsc() - t;							\
+}																\
+																\
+static type x_in ## bwl (u16 port) {							\
+	u64 t = v86_rdtsc();										\
+	type value;													\
+	if (pio_hooks || pio_ports[port].policy)					\
+		value = v86_pio_in(port, sizeof(type));					\
+	else														\
+		value = hw_in ## bwl(port);								\
+	v86_trace(TR_PIO_IN, sizeof(type), port, value);			\
+	v86_cost.pio_in++;											\
+	v86_cost.tsc_io += v86_rdtsc() - t;							\
 	return value;												\
 }
 #endif /* __H_V86_X86EMU */
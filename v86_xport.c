@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "v86.h"
+
+/*
+ * Request transports.  Every request is a struct cn_msg followed by
+ * a struct uvesafb_task and the task buffer, and so is every reply.
+ *
+ * The kernel talks to v86d over the netlink connector.  The Unix socket
+ * transport carries the same messages over a local SOCK_SEQPACKET socket,
+ * one message per packet, which makes it possible to run v86d without
+ * the uvesafb module (see v86load).  It serves one client at a time,
+ * further clients wait in the listen queue.  With "fd:<n>" instead of a
+ * path, the connection is a socket inherited from the parent process
+ * (see v86batch), and v86d exits when it is closed.
+ */
+
+#ifdef CONFIG_THREADS
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+#define SEND_LOCK()		pthread_mutex_lock(&send_lock)
+#define SEND_UNLOCK()	pthread_mutex_unlock(&send_lock)
+#else
+#define SEND_LOCK()		do {} while (0)
+#define SEND_UNLOCK()	do {} while (0)
+#endif
+
+/* Netlink connector */
+
+static int nl_sock = -1;
+static __u32 nl_seq;
+
+static int netlink_open(const char *arg)
+{
+	struct sockaddr_nl l_local;
+
+	nl_sock = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_CONNECTOR);
+	if (nl_sock == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	l_local.nl_family = AF_NETLINK;
+	l_local.nl_groups = 1 << (CN_IDX_V86D-1); /* bitmask of requested groups */
+	l_local.nl_pid = 0;
+
+	if (bind(nl_sock, (struct sockaddr *)&l_local, sizeof(struct sockaddr_nl)) == -1) {
+		perror("bind");
+		close(nl_sock);
+		nl_sock = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int netlink_fd(void)
+{
+	return nl_sock;
+}
+
+static int netlink_recv(char *buf, int size, struct cn_msg **msg)
+{
+	struct nlmsghdr *reply;
+	int len;
+
+	len = recv(nl_sock, buf, size, 0);
+	if (len == -1) {
+		perror("recv buf");
+		return -1;
+	}
+
+	reply = (struct nlmsghdr *)buf;
+
+	/* Ignore requests coming from outside the kernel. */
+	if (reply->nlmsg_pid != 0)
+		return 0;
+
+	switch (reply->nlmsg_type) {
+	case NLMSG_ERROR:
+		ulog(LOG_ERR, "Error message received.\n");
+		break;
+
+	case NLMSG_DONE:
+		*msg = (struct cn_msg *)NLMSG_DATA(reply);
+		if (len < NLMSG_LENGTH(sizeof(**msg)) ||
+			(*msg)->len > len - NLMSG_LENGTH(sizeof(**msg))) {
+			ulog(LOG_WARNING, "Malformed message of %d bytes dropped.\n", len);
+			return 0;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+static int netlink_send(struct cn_msg *msg)
+{
+	struct nlmsghdr *nlh;
+	unsigned int size;
+	int err;
+	char buf[CONNECTOR_MAX_MSG_SIZE];
+	struct cn_msg *m;
+
+	size = NLMSG_SPACE(sizeof(struct cn_msg) + msg->len);
+
+	nlh = (struct nlmsghdr *)buf;
+	nlh->nlmsg_pid = getpid();
+	nlh->nlmsg_type = NLMSG_DONE;
+	nlh->nlmsg_len = NLMSG_LENGTH(size - sizeof(*nlh));
+	nlh->nlmsg_flags = 0;
+
+	m = NLMSG_DATA(nlh);
+	memcpy(m, msg, sizeof(*m) + msg->len);
+
+	SEND_LOCK();
+	nlh->nlmsg_seq = nl_seq++;
+	err = send(nl_sock, nlh, size, 0);
+	SEND_UNLOCK();
+	if (err == -1)
+		ulog(LOG_ERR, "Failed to send: %s [%d].\n", strerror(errno), errno);
+
+	return err;
+}
+
+static void netlink_close(void)
+{
+	if (nl_sock != -1)
+		close(nl_sock);
+	nl_sock = -1;
+}
+
+struct v86_xport xport_netlink = {
+	.name = "netlink",
+	.open = netlink_open,
+	.fd = netlink_fd,
+	.recv = netlink_recv,
+	.send = netlink_send,
+	.close = netlink_close,
+};
+
+/* Unix socket */
+
+static int un_listen = -1;
+static int un_conn = -1;
+static char un_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+static int unix_open(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	char *end;
+	long fd;
+
+	if (!strncmp(path, "fd:", 3)) {
+		errno = 0;
+		fd = strtol(path + 3, &end, 10);
+		if (errno || end == path + 3 || *end || fd < 0 || fd > INT_MAX) {
+			fprintf(stderr, "Invalid file descriptor: %s\n", path);
+			return -1;
+		}
+
+		if (fstat(fd, &st) == -1) {
+			perror("fstat");
+			return -1;
+		}
+
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "File descriptor %ld is not a socket.\n", fd);
+			return -1;
+		}
+
+		un_conn = fd;
+		return 0;
+	}
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+
+	un_listen = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (un_listen == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (bind(un_listen, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+		listen(un_listen, 4) == -1) {
+		perror("bind");
+		close(un_listen);
+		un_listen = -1;
+		return -1;
+	}
+
+	strcpy(un_path, path);
+	return 0;
+}
+
+/* Wait for a client if there is none. */
+static int unix_fd(void)
+{
+	return (un_conn != -1) ? un_conn : un_listen;
+}
+
+static void unix_disconnect(void)
+{
+	SEND_LOCK();
+	close(un_conn);
+	un_conn = -1;
+	SEND_UNLOCK();
+}
+
+static int unix_recv(char *buf, int size, struct cn_msg **msg)
+{
+	int len, c;
+
+	if (un_conn == -1) {
+		c = accept(un_listen, NULL, NULL);
+		if (c != -1) {
+			SEND_LOCK();
+			un_conn = c;
+			SEND_UNLOCK();
+		}
+		return 0;
+	}
+
+	len = recv(un_conn, buf, size, 0);
+	if (len <= 0) {
+		if (len == -1 && errno != ECONNRESET)
+			ulog(LOG_WARNING, "Failed to receive: %s [%d].\n",
+				 strerror(errno), errno);
+		unix_disconnect();
+		return (un_listen != -1) ? 0 : -1;
+	}
+
+	*msg = (struct cn_msg *)buf;
+	if (len < sizeof(**msg) + sizeof(struct uvesafb_task) ||
+		len != sizeof(**msg) + (*msg)->len) {
+		ulog(LOG_WARNING, "Malformed request of %d bytes dropped.\n", len);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int unix_send(struct cn_msg *msg)
+{
+	int err;
+
+	SEND_LOCK();
+	/* The client could have gone away in the meantime. */
+	if (un_conn == -1) {
+		SEND_UNLOCK();
+		return -1;
+	}
+	err = send(un_conn, msg, sizeof(*msg) + msg->len, MSG_NOSIGNAL);
+	SEND_UNLOCK();
+
+	if (err == -1 && errno != EPIPE)
+		ulog(LOG_ERR, "Failed to send: %s [%d].\n", strerror(errno), errno);
+
+	return err;
+}
+
+static void unix_close(void)
+{
+	if (un_conn != -1)
+		close(un_conn);
+	if (un_listen != -1) {
+		close(un_listen);
+		unlink(un_path);
+	}
+	un_conn = un_listen = -1;
+}
+
+struct v86_xport xport_unix = {
+	.name = "unix",
+	.open = unix_open,
+	.fd = unix_fd,
+	.recv = unix_recv,
+	.send = unix_send,
+	.close = unix_close,
+};
@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "v86.h"
+
+/*
+ * Test client for batched requests (TF_BATCH).  Starts v86d on one end
+ * of a socketpair ('v86d -u fd:<n>'), checks that it advertises batches,
+ * then gets the mode info of every mode once with one message per task,
+ * and once with up to <size> tasks per message, and compares the replies.
+ * Every batch also carries a 4F03 call, which is never cached and so
+ * always goes through the emulator.
+ *
+ * Usage: v86batch [-n <rounds>] [-b <size>] <v86d> [<v86d options>]
+ */
+
+#define MAX_MODES	256
+#define MIB_SIZE	256
+
+struct ref {
+	struct uvesafb_task tsk;
+	u8 buf[MIB_SIZE];
+	int valid;
+};
+
+static u16 modes[MAX_MODES];
+static int nmodes;
+static struct ref refs[MAX_MODES + 1];		/* [nmodes] is 4F03 */
+static u32 trips, mismatches;
+
+static u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Fill in task 'i': the mode info of modes[i], or 4F03 for i = nmodes. */
+static int build_task(struct uvesafb_task *tsk, int i)
+{
+	memset(tsk, 0, sizeof(*tsk));
+
+	if (i == nmodes) {
+		tsk->regs.eax = 0x4f03;
+		return sizeof(*tsk);
+	}
+
+	tsk->regs.eax = 0x4f01;
+	tsk->regs.ecx = modes[i];
+	tsk->flags = TF_BUF_RET | TF_BUF_ESDI;
+	tsk->buf_len = MIB_SIZE;
+	memset(tsk + 1, 0, MIB_SIZE);
+	return sizeof(*tsk) + MIB_SIZE;
+}
+
+static void msg_init(struct cn_msg *msg, int len)
+{
+	static int seq;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->id.idx = CN_IDX_V86D;
+	msg->id.val = CN_VAL_V86D_UVESAFB;
+	msg->seq = seq++;
+	msg->len = len;
+}
+
+static int xfer(int s, char *buf, int size)
+{
+	struct cn_msg *msg = (struct cn_msg *)buf;
+	int len = sizeof(*msg) + msg->len;
+
+	trips++;
+	if (send(s, buf, len, 0) != len) {
+		perror("send");
+		return -1;
+	}
+
+	len = recv(s, buf, size, 0);
+	if (len < (int)(sizeof(*msg) + sizeof(struct uvesafb_task)) ||
+		len != sizeof(*msg) + msg->len) {
+		fprintf(stderr, "Bad reply of %d bytes.\n", len);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Remember the first reply to task 'i', compare the later ones with it. */
+static void check(struct uvesafb_task *tsk, int i)
+{
+	struct ref *r = &refs[i];
+	int len = sizeof(*tsk) + tsk->buf_len;
+
+	if (!r->valid) {
+		memcpy(r, tsk, len);
+		r->valid = 1;
+		return;
+	}
+
+	if (memcmp(r, tsk, len)) {
+		fprintf(stderr, "Reply to task %d (%04x) differs.\n", i,
+				i < nmodes ? modes[i] : 0);
+		mismatches++;
+	}
+}
+
+static int probe(int s)
+{
+	char buf[CONNECTOR_MAX_MSG_SIZE];
+	struct uvesafb_task *tsk = (struct uvesafb_task *)
+							   (buf + sizeof(struct cn_msg));
+
+	msg_init((struct cn_msg *)buf, sizeof(*tsk));
+	memset(tsk, 0, sizeof(*tsk));
+	tsk->regs.eax = 0x4fff;
+	tsk->flags = TF_CAPS;
+
+	if (xfer(s, buf, sizeof(buf)))
+		return -1;
+
+	if ((tsk->regs.eax & 0xffff) != 0x004f) {
+		printf("v86d doesn't support capability queries (eax = %04x)\n",
+			   tsk->regs.eax & 0xffff);
+		return 0;
+	}
+
+	printf("v86d capabilities: %08x\n", tsk->regs.ebx);
+	return tsk->regs.ebx;
+}
+
+static int get_modes(int s)
+{
+	char buf[CONNECTOR_MAX_MSG_SIZE];
+	struct uvesafb_task *tsk = (struct uvesafb_task *)
+							   (buf + sizeof(struct cn_msg));
+	struct vbe_ib *ib = (struct vbe_ib *)(tsk + 1);
+	u16 *m;
+
+	msg_init((struct cn_msg *)buf, sizeof(*tsk) + sizeof(*ib));
+	memset(tsk, 0, sizeof(*tsk) + sizeof(*ib));
+	tsk->regs.eax = 0x4f00;
+	tsk->flags = TF_VBEIB;
+	tsk->buf_len = sizeof(*ib);
+	memcpy(ib->vbe_signature, "VBE2", 4);
+
+	if (xfer(s, buf, sizeof(buf)))
+		return -1;
+
+	if ((tsk->regs.eax & 0xffff) != 0x004f ||
+		ib->mode_list_ptr >= tsk->buf_len) {
+		fprintf(stderr, "Getting the VBE Info Block failed with eax = %.4x\n",
+				tsk->regs.eax & 0xffff);
+		return -1;
+	}
+
+	m = (u16 *)((u8 *)ib + ib->mode_list_ptr);
+	for (nmodes = 0; (u8 *)(m + 1) <= (u8 *)ib + tsk->buf_len &&
+		 *m != 0xffff && nmodes < MAX_MODES; m++)
+		modes[nmodes++] = *m;
+
+	return 0;
+}
+
+/* One message per task. */
+static int run_single(int s)
+{
+	char buf[CONNECTOR_MAX_MSG_SIZE];
+	struct uvesafb_task *tsk = (struct uvesafb_task *)
+							   (buf + sizeof(struct cn_msg));
+	int i;
+
+	for (i = 0; i <= nmodes; i++) {
+		msg_init((struct cn_msg *)buf, build_task(tsk, i));
+		if (xfer(s, buf, sizeof(buf)))
+			return -1;
+		check(tsk, i);
+	}
+
+	return 0;
+}
+
+/* Up to 'size' mode info tasks and a 4F03 task per message. */
+static int run_batch(int s, int size)
+{
+	char buf[CONNECTOR_MAX_MSG_SIZE];
+	struct uvesafb_task *hdr = (struct uvesafb_task *)
+							   (buf + sizeof(struct cn_msg));
+	int first, i, n, len;
+	u8 *p;
+
+	for (first = 0; first < nmodes; first += n) {
+		n = nmodes - first < size ? nmodes - first : size;
+		p = (u8 *)(hdr + 1);
+		for (i = first; i < first + n; i++)
+			p += build_task((struct uvesafb_task *)p, i);
+		p += build_task((struct uvesafb_task *)p, nmodes);
+
+		len = p - (u8 *)hdr;
+		msg_init((struct cn_msg *)buf, len);
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->regs.eax = 0x4fff;
+		hdr->regs.ecx = n + 1;
+		hdr->flags = TF_BATCH;
+		hdr->buf_len = len - sizeof(*hdr);
+
+		if (xfer(s, buf, sizeof(buf)))
+			return -1;
+
+		if ((hdr->regs.eax & 0xffff) != 0x004f || hdr->regs.ecx != n + 1 ||
+			((struct cn_msg *)buf)->len != len) {
+			fprintf(stderr, "Batch failed with eax = %04x\n",
+					hdr->regs.eax & 0xffff);
+			return -1;
+		}
+
+		p = (u8 *)(hdr + 1);
+		for (i = first; i <= first + n; i++) {
+			check((struct uvesafb_task *)p, i < first + n ? i : nmodes);
+			p += sizeof(*hdr) + ((struct uvesafb_task *)p)->buf_len;
+		}
+	}
+
+	return 0;
+}
+
+static void report(const char *title, u32 tasks, u32 trips, u64 us)
+{
+	printf("%-8s %8u tasks %8u messages %10llu us %8.2f us/task\n", title,
+		   tasks, trips, (unsigned long long)us,
+		   tasks ? (double)us / tasks : 0.0);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: v86batch [-n <rounds>] [-b <tasks per batch>] "
+			"<v86d> [<v86d options>]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = 10, size = 32, max, i, sv[2], status;
+	u32 t_trips, tasks;
+	u64 t, t_single = 0, t_batch = 0, trips_single = 0, trips_batch = 0;
+	char **args, fd[16];
+	pid_t pid;
+
+	while ((i = getopt(argc, argv, "+n:b:")) != -1) {
+		switch (i) {
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		case 'b':
+			size = atoi(optarg);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	max = (CONNECTOR_MAX_MSG_SIZE - sizeof(struct cn_msg)) /
+		  (sizeof(struct uvesafb_task) + MIB_SIZE) - 1;
+	if (size < 1 || size > max) {
+		fprintf(stderr, "At most %d tasks fit into a batch.\n", max);
+		return 1;
+	}
+
+	if (optind >= argc) {
+		usage();
+		return 1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+		perror("socketpair");
+		return 1;
+	}
+
+	/* v86d [options] -u fd:<n> */
+	args = calloc(argc - optind + 3, sizeof(*args));
+	if (!args)
+		return 1;
+	for (i = optind; i < argc; i++)
+		args[i - optind] = argv[i];
+	snprintf(fd, sizeof(fd), "fd:%d", sv[1]);
+	args[argc - optind] = "-u";
+	args[argc - optind + 1] = fd;
+
+	pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+		execv(args[0], args);
+		perror(args[0]);
+		_exit(127);
+	} else if (pid == -1) {
+		perror("fork");
+		return 1;
+	}
+
+	/* v86d daemonizes, the child we have started returns right away. */
+	close(sv[1]);
+	free(args);
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+		WEXITSTATUS(status)) {
+		fprintf(stderr, "Failed to start v86d.\n");
+		return 1;
+	}
+
+	if (!(probe(sv[0]) & V86D_CAP_BATCH)) {
+		fprintf(stderr, "v86d doesn't support batches.\n");
+		close(sv[0]);
+		return 1;
+	}
+
+	if (get_modes(sv[0])) {
+		close(sv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < rounds; i++) {
+		t_trips = trips;
+		t = now_us();
+		if (run_single(sv[0]))
+			break;
+		t_single += now_us() - t;
+		trips_single += trips - t_trips;
+
+		t_trips = trips;
+		t = now_us();
+		if (run_batch(sv[0], size))
+			break;
+		t_batch += now_us() - t;
+		trips_batch += trips - t_trips;
+	}
+
+	/* Closing the socket makes v86d exit. */
+	close(sv[0]);
+
+	if (i < rounds)
+		return 1;
+
+	tasks = rounds * (nmodes + 1);
+	printf("%d modes, %d rounds, up to %d modes per batch\n", nmodes, rounds,
+		   size);
+	report("single", tasks, trips_single, t_single);
+	report("batched", rounds * (nmodes + (nmodes + size - 1) / size), trips_batch,
+		   t_batch);
+	printf("%u replies differ\n", mismatches);
+
+	return mismatches ? 1 : 0;
+}
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+#include "v86.h"
+
+/*
+ * Load generator for 'v86d -u <socket>'.  Sends requests in the same
+ * format as the uvesafb module, keeping up to <depth> of them in flight,
+ * and reports the throughput and the per-function round-trip latencies.
+ *
+ * The request mix is a comma-separated list of:
+ *  info   - 4F00, controller info (cacheable)
+ *  mode   - 4F01 for every mode in the mode list (cacheable)
+ *  state  - 4F03, current mode (not cacheable)
+ *
+ * With -S <MB>, the requests are sent twice: once on an idle system,
+ * then again while a child process keeps dirtying <MB> megabytes of
+ * memory, so that the kernel has to reclaim pages from everyone else.
+ * Comparing the tails of the two runs shows how well v86d is shielded
+ * from memory pressure (see 'v86d -H').
+ */
+
+#define MAX_MODES	256
+#define MAX_DEPTH	64
+#define MAX_MIX		16
+
+#define T_INFO		0
+#define T_MODE		1
+#define T_STATE		2
+
+struct slot {
+	int busy;
+	u64 t;
+	struct v86_regs regs;
+};
+
+static u16 modes[MAX_MODES];
+static int nmodes;
+static struct slot slots[MAX_DEPTH];
+static char stats[65536];
+static int mix[MAX_MIX], nmix, depth = 1;
+static u32 count = 10000;
+
+static u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int build(char *buf, int type, int seq)
+{
+	struct cn_msg *msg = (struct cn_msg *)buf;
+	struct uvesafb_task *tsk = (struct uvesafb_task *)(msg + 1);
+	static int mode_idx;
+
+	memset(msg, 0, sizeof(*msg) + sizeof(*tsk));
+	msg->id.idx = CN_IDX_V86D;
+	msg->id.val = CN_VAL_V86D_UVESAFB;
+	msg->seq = seq;
+
+	switch (type) {
+	case T_INFO:
+		tsk->regs.eax = 0x4f00;
+		tsk->flags = TF_VBEIB;
+		tsk->buf_len = sizeof(struct vbe_ib);
+		memset(tsk + 1, 0, tsk->buf_len);
+		memcpy(tsk + 1, "VBE2", 4);
+		break;
+	case T_MODE:
+		tsk->regs.eax = 0x4f01;
+		tsk->regs.ecx = nmodes ? modes[mode_idx++ % nmodes] : 0x101;
+		tsk->flags = TF_BUF_RET | TF_BUF_ESDI;
+		tsk->buf_len = 256;
+		memset(tsk + 1, 0, tsk->buf_len);
+		break;
+	default:
+		tsk->regs.eax = 0x4f03;
+		break;
+	}
+
+	msg->len = sizeof(*tsk) + tsk->buf_len;
+	return sizeof(*msg) + msg->len;
+}
+
+/* Get the mode list with a single synchronous 4F00 call. */
+static int get_modes(int s)
+{
+	char buf[CONNECTOR_MAX_MSG_SIZE];
+	struct cn_msg *msg = (struct cn_msg *)buf;
+	struct uvesafb_task *tsk = (struct uvesafb_task *)(msg + 1);
+	struct vbe_ib *ib = (struct vbe_ib *)(tsk + 1);
+	u16 *m;
+	int len;
+
+	len = build(buf, T_INFO, 0);
+	if (send(s, buf, len, 0) != len || recv(s, buf, sizeof(buf), 0) <= 0) {
+		perror("4f00");
+		return -1;
+	}
+
+	if ((tsk->regs.eax & 0xffff) != 0x004f ||
+		ib->mode_list_ptr >= tsk->buf_len) {
+		fprintf(stderr, "Getting the VBE Info Block failed with eax = %.4x\n",
+				tsk->regs.eax & 0xffff);
+		return -1;
+	}
+
+	m = (u16 *)((u8 *)ib + ib->mode_list_ptr);
+	for (nmodes = 0; (u8 *)(m + 1) <= (u8 *)ib + tsk->buf_len &&
+		 *m != 0xffff && nmodes < MAX_MODES; m++)
+		modes[nmodes++] = *m;
+
+	return 0;
+}
+
+static int parse_mix(char *spec, int *mix)
+{
+	char *s;
+	int n = 0;
+
+	for (s = strtok(spec, ","); s && n < MAX_MIX; s = strtok(NULL, ",")) {
+		if (!strcmp(s, "info"))
+			mix[n++] = T_INFO;
+		else if (!strcmp(s, "mode"))
+			mix[n++] = T_MODE;
+		else if (!strcmp(s, "state"))
+			mix[n++] = T_STATE;
+		else
+			return 0;
+	}
+
+	return n;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: v86load [-n <requests>] [-q <depth>] "
+			"[-f <mix>] [-S <MB>] <socket>\n\n"
+			"  -n <count>  number of requests to send (default: 10000)\n"
+			"  -q <depth>  number of requests in flight (default: 1, max: %d)\n"
+			"  -f <mix>    request types, any of info, mode, state "
+			"(default: mode)\n"
+			"  -S <MB>     repeat the run under memory pressure from a "
+			"process\n"
+			"              dirtying <MB> megabytes\n", MAX_DEPTH);
+}
+
+/*
+ * Fork a process that keeps writing to 'mb' megabytes of anonymous
+ * memory until it is killed.  Returns its pid.
+ */
+static pid_t hog_start(u32 mb)
+{
+	size_t size = (size_t)mb << 20, i;
+	volatile u8 *m;
+	pid_t pid;
+	u8 v = 0;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	m = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == (void *)-1) {
+		perror("mmap");
+		_exit(1);
+	}
+
+	for (;; v++) {
+		for (i = 0; i < size; i += 4096)
+			m[i] = v;
+	}
+}
+
+static void hog_stop(pid_t pid)
+{
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/*
+ * Send 'count' requests over 's' and print the statistics.  Returns
+ * the number of failed requests, or -1 if the connection broke.
+ */
+static int run(int s, const char *title)
+{
+	char buf[CONNECTOR_MAX_MSG_SIZE];
+	struct cn_msg *msg = (struct cn_msg *)buf;
+	struct uvesafb_task *tsk = (struct uvesafb_task *)(msg + 1);
+	u32 sent = 0, done = 0, failed = 0;
+	u64 start, t;
+	int i, len;
+
+	v86_stats_reset();
+	start = now_us();
+
+	while (done < count) {
+		/* Fill the window. */
+		for (i = 0; i < depth && sent < count; i++) {
+			if (slots[i].busy)
+				continue;
+
+			len = build(buf, mix[sent % nmix], i);
+			slots[i].busy = 1;
+			slots[i].regs = tsk->regs;
+			slots[i].t = now_us();
+
+			if (send(s, buf, len, 0) != len) {
+				perror("send");
+				return -1;
+			}
+			sent++;
+		}
+
+		len = recv(s, buf, sizeof(buf), 0);
+		t = now_us();
+		if (len <= 0) {
+			fprintf(stderr, "v86d closed the connection.\n");
+			return -1;
+		}
+
+		if (len < sizeof(*msg) + sizeof(*tsk) || msg->seq >= depth ||
+			!slots[msg->seq].busy) {
+			fprintf(stderr, "Unexpected reply.\n");
+			return -1;
+		}
+
+		slots[msg->seq].busy = 0;
+		v86_stats_add(&slots[msg->seq].regs, t - slots[msg->seq].t);
+		if ((tsk->regs.eax & 0xffff) != 0x004f)
+			failed++;
+		done++;
+	}
+
+	t = now_us() - start;
+
+	v86_stats_dump(stats, sizeof(stats), STATS_FMT_TEXT);
+	if (title)
+		printf("%s:\n", title);
+	printf("%s", stats);
+	printf("\n%u requests in %llu us, %.0f requests/s, depth %d, "
+		   "%d modes, %u failed\n", done, (unsigned long long)t,
+		   t ? done * 1000000.0 / t : 0.0, depth, nmodes, failed);
+
+	return failed;
+}
+
+int main(int argc, char *argv[])
+{
+	char mixspec[64] = "mode";
+	struct sockaddr_un addr;
+	int s, i, failed;
+	u32 hog_mb = 0;
+	pid_t hog;
+
+	while ((i = getopt(argc, argv, "n:q:f:S:")) != -1) {
+		switch (i) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'f':
+			strncpy(mixspec, optarg, sizeof(mixspec) - 1);
+			break;
+		case 'S':
+			hog_mb = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	nmix = parse_mix(mixspec, mix);
+	if (optind != argc - 1 || depth < 1 || depth > MAX_DEPTH || !nmix ||
+		strlen(argv[optind]) >= sizeof(addr.sun_path)) {
+		usage();
+		return 1;
+	}
+
+	s = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (s == -1) {
+		perror("socket");
+		return 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, argv[optind]);
+
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("connect");
+		return 1;
+	}
+
+	if (get_modes(s))
+		return 1;
+
+	if (!hog_mb) {
+		failed = run(s, NULL);
+		close(s);
+		return failed ? (failed < 0 ? 1 : 2) : 0;
+	}
+
+	failed = run(s, "Idle");
+	if (failed < 0)
+		return 1;
+
+	hog = hog_start(hog_mb);
+	if (hog == -1) {
+		perror("fork");
+		return 1;
+	}
+
+	/* Give the hog time to fill its memory and start pushing. */
+	sleep(1);
+
+	printf("\n");
+	i = run(s, "Under memory pressure");
+	hog_stop(hog);
+	close(s);
+
+	if (i < 0)
+		return 1;
+	return (failed || i) ? 2 : 0;
+}
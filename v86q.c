@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "v86q.h"
+
+/*
+ * Client side of the v86d query socket, see v86q.h.  Only uses the
+ * socket, so it can be linked into any program.
+ */
+
+int v86q_open(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd == -1)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void v86q_close(int fd)
+{
+	close(fd);
+}
+
+int v86q_get(int fd, int type, int arg, void *buf, int size)
+{
+	struct v86q_req req;
+	struct v86q_rep *rep;
+	char *msg;
+	int len;
+
+	msg = malloc(sizeof(*rep) + V86Q_MAX_REPLY);
+	if (!msg)
+		return -1;
+
+	req.type = type;
+	req.arg = arg;
+	if (send(fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req))
+		goto err;
+
+	len = recv(fd, msg, sizeof(*rep) + V86Q_MAX_REPLY, 0);
+	if (len < (int)sizeof(*rep)) {
+		if (len >= 0)
+			errno = EPROTO;
+		goto err;
+	}
+
+	rep = (struct v86q_rep *)msg;
+	if (rep->status) {
+		errno = -rep->status;
+		goto err;
+	}
+
+	len -= sizeof(*rep);
+	if (len > size)
+		len = size;
+	memcpy(buf, rep + 1, len);
+	free(msg);
+	return len;
+
+err:
+	free(msg);
+	return -1;
+}
+
+int v86q_info(int fd, struct vbe_ib *ib)
+{
+	memset(ib, 0, sizeof(*ib));
+	return v86q_get(fd, V86Q_INFO, 0, ib, sizeof(*ib)) < 0 ? -1 : 0;
+}
+
+/* Returns the number of modes. */
+int v86q_modes(int fd, __u16 *modes, int max)
+{
+	int len;
+
+	len = v86q_get(fd, V86Q_MODES, 0, modes, max * sizeof(*modes));
+	return len < 0 ? -1 : len / (int)sizeof(*modes);
+}
+
+/* 'mib' has to hold V86Q_MIB_SIZE bytes. */
+int v86q_mode_info(int fd, __u16 mode, void *mib)
+{
+	memset(mib, 0, V86Q_MIB_SIZE);
+	return v86q_get(fd, V86Q_MODE, mode, mib, V86Q_MIB_SIZE) < 0 ? -1 : 0;
+}
+
+/* 'edid' has to hold V86Q_EDID_SIZE bytes. */
+int v86q_edid(int fd, void *edid)
+{
+	return v86q_get(fd, V86Q_EDID, 0, edid, V86Q_EDID_SIZE) < 0 ? -1 : 0;
+}
+
+static int v86q_text(int fd, int type, char *buf, int size)
+{
+	int len;
+
+	len = v86q_get(fd, type, 0, buf, size - 1);
+	if (len < 0)
+		return -1;
+
+	buf[len] = 0;
+	return len;
+}
+
+/* Returns the length of the text, which is always terminated. */
+int v86q_stats(int fd, char *buf, int size)
+{
+	return v86q_text(fd, V86Q_STATS, buf, size);
+}
+
+/* Ditto. */
+int v86q_cost(int fd, char *buf, int size)
+{
+	return v86q_text(fd, V86Q_COST, buf, size);
+}
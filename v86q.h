@@ -0,0 +1,53 @@
+#ifndef __H_V86Q
+#define __H_V86Q
+
+#include <linux/types.h>
+#include <video/uvesafb.h>
+
+/*
+ * Query socket protocol ('v86d -Q <socket>').  The socket is a local
+ * SOCK_SEQPACKET socket.  Every request is a struct v86q_req, every
+ * reply a struct v86q_rep followed by 'len' bytes of data.  The answers
+ * come from the results v86d has already obtained for the kernel; no
+ * BIOS code is run for a query.
+ */
+
+#define V86Q_INFO		1	/* VBE Info Block (4F00), pointers as offsets */
+#define V86Q_MODES		2	/* mode list, an array of __u16 */
+#define V86Q_MODE		3	/* Mode Info Block (4F01) of mode 'arg' */
+#define V86Q_EDID		4	/* EDID block 0 (4F15/01) */
+#define V86Q_STATS		5	/* the per-function latencies, as text */
+#define V86Q_COST		6	/* the per-function average cost, as text */
+
+#define V86Q_MIB_SIZE	256
+#define V86Q_EDID_SIZE	128
+#define V86Q_MAX_REPLY	65536
+
+struct v86q_req {
+	__u32 type;
+	__u32 arg;
+};
+
+struct v86q_rep {
+	__s32 status;		/* 0, or a negative errno value */
+	__u32 len;
+};
+
+/*
+ * Client library.  All functions return -1 and set errno on failure,
+ * errno is ENOENT if v86d doesn't have the answer yet.
+ */
+int v86q_open(const char *path);
+void v86q_close(int fd);
+
+/* Returns the length of the reply data copied to 'buf'. */
+int v86q_get(int fd, int type, int arg, void *buf, int size);
+
+int v86q_info(int fd, struct vbe_ib *ib);
+int v86q_modes(int fd, __u16 *modes, int max);
+int v86q_mode_info(int fd, __u16 mode, void *mib);
+int v86q_edid(int fd, void *edid);
+int v86q_stats(int fd, char *buf, int size);
+int v86q_cost(int fd, char *buf, int size);
+
+#endif /* __H_V86Q */
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "v86q.h"
+
+/*
+ * Command line client of the v86d query socket ('v86d -Q <socket>').
+ * With -n, the query is repeated and the average round-trip time is
+ * printed instead of the answer.
+ */
+
+static char buf[V86Q_MAX_REPLY];
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: v86query [-n <count>] <socket> "
+			"info|modes|mode <mode>|edid|stats|cost\n");
+}
+
+static void print_info(struct vbe_ib *ib)
+{
+	int len = sizeof(*ib);
+
+	printf("VBE version: %d.%d\n", ib->vbe_version >> 8,
+		   ib->vbe_version & 0xff);
+	printf("Total memory: %d kB\n", ib->total_memory * 64);
+
+	if (ib->oem_string_ptr && ib->oem_string_ptr < len)
+		printf("OEM string: %.64s\n", (char *)ib + ib->oem_string_ptr);
+	if (ib->oem_vendor_name_ptr && ib->oem_vendor_name_ptr < len)
+		printf("OEM vendor: %.64s\n", (char *)ib + ib->oem_vendor_name_ptr);
+	if (ib->oem_product_name_ptr && ib->oem_product_name_ptr < len)
+		printf("OEM product: %.64s\n", (char *)ib + ib->oem_product_name_ptr);
+}
+
+static void print_hex(unsigned char *p, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		printf("%02x%s", p[i], (i % 16 == 15 || i == len - 1) ? "\n" : " ");
+}
+
+int main(int argc, char *argv[])
+{
+	int fd, c, type, arg = 0, len = 0, i, count = 0;
+	unsigned long long t;
+	__u16 *modes = (__u16 *)buf;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (argc - optind < 2) {
+		usage();
+		return 1;
+	}
+
+	if (!strcmp(argv[optind + 1], "info")) {
+		type = V86Q_INFO;
+	} else if (!strcmp(argv[optind + 1], "modes")) {
+		type = V86Q_MODES;
+	} else if (!strcmp(argv[optind + 1], "mode") && argc - optind == 3) {
+		type = V86Q_MODE;
+		arg = strtoul(argv[optind + 2], NULL, 16);
+	} else if (!strcmp(argv[optind + 1], "edid")) {
+		type = V86Q_EDID;
+	} else if (!strcmp(argv[optind + 1], "stats")) {
+		type = V86Q_STATS;
+	} else if (!strcmp(argv[optind + 1], "cost")) {
+		type = V86Q_COST;
+	} else {
+		usage();
+		return 1;
+	}
+
+	fd = v86q_open(argv[optind]);
+	if (fd == -1) {
+		perror("v86q_open");
+		return 1;
+	}
+
+	t = now_us();
+	for (i = 0; i < (count > 0 ? count : 1); i++) {
+		len = v86q_get(fd, type, arg, buf, sizeof(buf));
+		if (len < 0) {
+			perror("query");
+			v86q_close(fd);
+			return 1;
+		}
+	}
+	t = now_us() - t;
+	v86q_close(fd);
+
+	if (count > 0) {
+		printf("%d queries in %llu us, %.2f us/query\n", count, t,
+			   (double)t / count);
+		return 0;
+	}
+
+	switch (type) {
+	case V86Q_INFO:
+		print_info((struct vbe_ib *)buf);
+		break;
+	case V86Q_MODES:
+		for (i = 0; i < len / 2; i++)
+			printf("%04x%s", modes[i], (i % 8 == 7 || i == len / 2 - 1) ? "\n" : " ");
+		break;
+	case V86Q_STATS:
+	case V86Q_COST:
+		fwrite(buf, 1, len, stdout);
+		break;
+	default:
+		print_hex((unsigned char *)buf, len);
+	}
+
+	return 0;
+}
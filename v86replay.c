@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "v86.h"
+
+/*
+ * Replay a BIOS session recorded with 'v86d -r', verify the replies and
+ * report how long the calls took.  No access to the hardware is needed,
+ * so a recording made on one machine can be used to benchmark v86d on
+ * any other.
+ */
+
+#ifndef LOG_PERROR
+#define LOG_PERROR	0
+#endif
+
+static char stats[65536];
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: v86replay [-n <passes>] [-v] <recording>\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct uvesafb_task *tsk;
+	int passes = 1, verbose = 0, pass, i;
+	u32 tasks = 0, failed = 0;
+	u64 t, total = 0;
+
+	while ((i = getopt(argc, argv, "n:v")) != -1) {
+		switch (i) {
+		case 'n':
+			passes = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1 || passes < 1) {
+		usage();
+		return 1;
+	}
+
+	openlog("v86replay", LOG_PERROR, LOG_USER);
+
+	if (v86_rec_init(argv[optind], REC_REPLAY)) {
+		fprintf(stderr, "Failed to open the recording %s.\n", argv[optind]);
+		return 1;
+	}
+
+	for (pass = 0; pass < passes; pass++) {
+		/* Every pass starts from the recorded memory image. */
+		if (v86_init()) {
+			fprintf(stderr, "Failed to set up the emulator.\n");
+			return 1;
+		}
+
+		v86_rec_rewind();
+
+		while ((tsk = v86_rec_next())) {
+			u8 *buf = (u8*)(tsk + 1);
+			struct v86_regs regs = tsk->regs;
+			int err;
+
+			t = v86_time_us();
+			err = v86_task(tsk, buf);
+			t = v86_time_us() - t;
+			v86_stats_cost(&regs, &v86_cost);
+
+			if (v86_rec_check(tsk, buf, err) || err)
+				failed++;
+
+			v86_stats_add(&regs, t);
+			total += t;
+			tasks++;
+
+			if (verbose && !pass)
+				printf("%04x %8llu us %s\n", regs.eax & 0xffff,
+					   (unsigned long long)t, err ? "error" : "");
+			free(tsk);
+		}
+
+		v86_cleanup();
+	}
+
+	v86_rec_cleanup();
+
+	v86_stats_dump(stats, sizeof(stats), STATS_FMT_TEXT);
+	printf("%s", stats);
+	v86_stats_dump(stats, sizeof(stats), STATS_FMT_COST);
+	printf("\n%s", stats);
+	printf("\n%u tasks in %d passes, %u failed, %llu us total, "
+		   "%.1f us per task\n", tasks, passes, failed,
+		   (unsigned long long)total, tasks ? (double)total / tasks : 0.0);
+	closelog();
+
+	return failed ? 2 : 0;
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "v86.h"
+#include "v86_trace.h"
+
+/*
+ * Decode a v86d trace ring file and print the events it contains,
+ * oldest first.
+ */
+
+struct v86_trace_hdr *trace_hdr;
+struct v86_trace_ev *trace_ring;
+
+static const char *reg_names[] = {
+	"flags", "eax", "ebx", "ecx", "edx", "esi", "edi", "es",
+};
+
+static void print_event(struct v86_trace_ev *e, double us)
+{
+	printf("%14.3f ", us);
+
+	switch (e->type) {
+	case TR_REQ_BEGIN:
+		printf("req begin   ax=%04x seq=%u\n", e->arg, e->val);
+		break;
+	case TR_REQ_END:
+		printf("req end     ax=%04x seq=%u\n", e->arg, e->val);
+		break;
+	case TR_INT_ENTER:
+		printf("int enter   %02x eax=%08x\n", e->arg, e->val);
+		break;
+	case TR_INT_EXIT:
+		printf("int exit    %02x eax=%08x\n", e->arg, e->val);
+		break;
+	case TR_SOFTINT:
+		printf("softint     %02x at %04x:%04x\n", e->arg,
+			   e->val >> 16, e->val & 0xffff);
+		break;
+	case TR_EMU_ENTER:
+		printf("emu enter\n");
+		break;
+	case TR_EMU_EXIT:
+		printf("emu exit\n");
+		break;
+	case TR_PIO_IN:
+		printf("in%c         %04x -> %0*x\n", "?bw?l"[e->size & 7],
+			   e->arg, e->size * 2, e->val);
+		break;
+	case TR_PIO_OUT:
+		printf("out%c        %04x <- %0*x\n", "?bw?l"[e->size & 7],
+			   e->arg, e->size * 2, e->val);
+		break;
+	case TR_REG:
+		printf("reg         %-5s = %0*x\n",
+			   e->arg < sizeof(reg_names) / sizeof(*reg_names) ?
+			   reg_names[e->arg] : "?", e->size * 2, e->val);
+		break;
+	default:
+		printf("unknown %02x  arg=%04x val=%08x\n", e->type, e->arg, e->val);
+		break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct stat st;
+	struct v86_trace_ev *e, ev;
+	u32 i, start, head;
+	u64 tsc0 = 0;
+	double hz;
+	void *m;
+	int fd;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: v86trace <trace file>\n");
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "Failed to open %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	if (st.st_size < sizeof(*trace_hdr)) {
+		fprintf(stderr, "%s is not a v86d trace file.\n", argv[1]);
+		return 1;
+	}
+
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == (void *)-1) {
+		fprintf(stderr, "Failed to mmap %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	trace_hdr = m;
+	trace_ring = (struct v86_trace_ev *)(trace_hdr + 1);
+
+	if (trace_hdr->magic != V86_TRACE_MAGIC ||
+		trace_hdr->version != V86_TRACE_VERSION ||
+		sizeof(*trace_hdr) + (u64)trace_hdr->size * sizeof(*e) > st.st_size) {
+		fprintf(stderr, "%s is not a v86d trace file.\n", argv[1]);
+		return 1;
+	}
+
+	if (!trace_hdr->size || trace_hdr->size & (trace_hdr->size - 1)) {
+		fprintf(stderr, "%s has an invalid ring size.\n", argv[1]);
+		return 1;
+	}
+
+	/*
+	 * 'head' wraps at 2^32, so the last 'size' slots are always read;
+	 * the ones that haven't been written yet don't match their seq.
+	 */
+	head = trace_hdr->head;
+	start = head - trace_hdr->size;
+	hz = trace_hdr->tsc_hz ? trace_hdr->tsc_hz / 1e6 : 1.0;
+
+	if (!trace_hdr->tsc_hz)
+		printf("# TSC frequency unknown, timestamps are in TSC ticks\n");
+
+	for (i = start; i != head; i++) {
+		e = &trace_ring[i & (trace_hdr->size - 1)];
+		ev = *(volatile struct v86_trace_ev *)e;
+		__sync_synchronize();
+
+		/* Skip the slots which are being written or have been reused. */
+		if (!ev.type || ev.seq != i || e->type != ev.type || e->seq != i)
+			continue;
+		if (!tsc0)
+			tsc0 = ev.tsc;
+		print_event(&ev, (ev.tsc - tsc0) / hz);
+	}
+
+	return 0;
+}